@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2012-2013, Liexusong <liexusong at qq dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Compare the dynamic loop (ngr_event.c) with the compile time specialized
+ * one (ngr_event_static.h): fds which stay readable are dispatched over
+ * and over, then timers are created and fired in bulk.
+ *
+ * Only the io numbers measure the specialization, both loops share the
+ * epoll backend there. The dynamic timers live in a rbtree, the static
+ * ones in a binary heap, so the timer numbers compare the structures.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "ngr_event.h"
+#include "ngr_event_static.h"
+
+#define BENCH_FDS      1000
+#define BENCH_LOOPS    2000
+#define BENCH_TIMERS   1000000
+
+static uint64_t counter;
+
+
+static int64_t bench_usec()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+static void dynamic_io_handler(ngr_event_t *ev, int fd, void *data, int mask)
+{
+    counter++;
+}
+
+
+static uint64_t dynamic_timer_handler(ngr_event_t *ev, void *data)
+{
+    counter++;
+    return 0;
+}
+
+
+NGR_EVENT_STATIC_DEFINE(bench_loop, static_io_handler, static_timer_handler)
+
+
+static void static_io_handler(bench_loop_t *lp, int fd, void *data, int mask)
+{
+    counter++;
+}
+
+
+static uint64_t static_timer_handler(bench_loop_t *lp, void *data)
+{
+    counter++;
+    return 0;
+}
+
+
+static void report(const char *name, int64_t usec)
+{
+    printf("%-24s %10llu events %8lld usec %8.2f ns/event\n", name,
+           (unsigned long long)counter, (long long)usec,
+           usec * 1000.0 / (counter ? counter : 1));
+}
+
+
+int main(int argc, char *argv[])
+{
+    ngr_event_t *ev;
+    bench_loop_t lp;
+    int fds[BENCH_FDS][2];
+    int64_t start;
+    int i;
+
+    for (i = 0; i < BENCH_FDS; i++) {
+        if (pipe(fds[i]) == -1 || write(fds[i][1], "x", 1) != 1) {
+            printf("can not create pipes\n");
+            exit(-1);
+        }
+    }
+
+    ev = ngr_event_new(0);
+    if (!ev || bench_loop_init(&lp, 0) == -1) {
+        printf("can not create event object\n");
+        exit(-1);
+    }
+
+    for (i = 0; i < BENCH_FDS; i++) {
+        ngr_event_create_io_event(ev, fds[i][0], NGR_EVENT_READABLE,
+                                  dynamic_io_handler, NULL);
+        bench_loop_add(&lp, fds[i][0], NGR_EVENT_READABLE, NULL);
+    }
+
+    counter = 0;
+    start = bench_usec();
+    for (i = 0; i < BENCH_LOOPS; i++) {
+        ngr_event_process_events(ev, 1);
+    }
+    report("dynamic io", bench_usec() - start);
+
+    counter = 0;
+    start = bench_usec();
+    for (i = 0; i < BENCH_LOOPS; i++) {
+        bench_loop_process(&lp, 1);
+    }
+    report("static io", bench_usec() - start);
+
+    for (i = 0; i < BENCH_FDS; i++) {
+        ngr_event_del_io_event(ev, fds[i][0], NGR_EVENT_READABLE);
+        bench_loop_del(&lp, fds[i][0], NGR_EVENT_READABLE);
+    }
+
+    counter = 0;
+    start = bench_usec();
+    for (i = 0; i < BENCH_TIMERS; i++) {
+        ngr_event_create_timer(ev, 0, dynamic_timer_handler, NULL, NULL);
+    }
+    while (counter < BENCH_TIMERS) {
+        ngr_event_process_events(ev, 1);
+    }
+    report("dynamic timers (rbtree)", bench_usec() - start);
+
+    counter = 0;
+    start = bench_usec();
+    for (i = 0; i < BENCH_TIMERS; i++) {
+        bench_loop_timer(&lp, 0, NULL);
+    }
+    while (counter < BENCH_TIMERS) {
+        bench_loop_process(&lp, 1);
+    }
+    report("static timers (heap)", bench_usec() - start);
+
+    bench_loop_free(&lp);
+
+    return 0;
+}
@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2012-2013, Liexusong <liexusong at qq dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ngr_channel.h"
+
+#ifdef HAVE_EPOLL
+#include <sys/eventfd.h>
+#endif
+
+
+static void ngr_channel_wakeup(ngr_channel_t *ch)
+{
+#ifdef HAVE_EPOLL
+    uint64_t one = 1;
+
+    (void)write(ch->notify[1], &one, sizeof(one));
+#else
+    char c = 0;
+
+    (void)write(ch->notify[1], &c, 1);
+#endif
+}
+
+
+static int ngr_channel_pop(ngr_channel_t *ch, void **msg)
+{
+    ngr_channel_slot_t *slot;
+    size_t head, seq;
+
+    head = atomic_load_explicit(&ch->head, memory_order_relaxed);
+    slot = &ch->slots[head & ch->mask];
+
+    if (ch->type == NGR_CHANNEL_SPSC) {
+        if (head == atomic_load_explicit(&ch->tail, memory_order_acquire)) {
+            return 0;
+        }
+
+        *msg = slot->msg;
+        atomic_store_explicit(&ch->head, head + 1, memory_order_release);
+
+        return 1;
+    }
+
+    seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (seq != head + 1) { /* the producer didn't publish it yet */
+        return 0;
+    }
+
+    *msg = slot->msg;
+
+    /* hand the slot back to the producers for the next lap */
+    atomic_store_explicit(&slot->seq, head + ch->mask + 1,
+                          memory_order_release);
+    atomic_store_explicit(&ch->head, head + 1, memory_order_relaxed);
+
+    return 1;
+}
+
+
+static void ngr_channel_handle(ngr_event_t *ev, int fd, void *data, int mask)
+{
+    ngr_channel_t *ch = data;
+    char buf[64];
+    size_t n;
+    void *msg;
+
+    while (read(fd, buf, sizeof(buf)) > 0) {
+        /* void */
+    }
+
+    ch->wakeups++;
+
+    for ( ;; ) {
+
+        /* bound the work, a busy producer must not starve the loop */
+        for (n = 0; n <= ch->mask && ngr_channel_pop(ch, &msg); n++) {
+            ch->handler(ev, ch, msg, ch->data);
+        }
+
+        ch->received += n;
+
+        if (n > ch->mask) { /* still busy, come back on the next loop */
+            ngr_channel_wakeup(ch);
+            return;
+        }
+
+        /*
+         * Announce we are idle and check the ring again, a producer which
+         * pushed before seeing the flag would otherwise not wake us up.
+         */
+        atomic_store(&ch->idle, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (!ngr_channel_pop(ch, &msg)) {
+            return;
+        }
+
+        /* a producer may have taken the flag already, a spurious wakeup */
+        atomic_store(&ch->idle, 0);
+
+        ch->handler(ev, ch, msg, ch->data);
+        ch->received++;
+    }
+}
+
+
+ngr_channel_t *ngr_channel_new(ngr_event_t *ev, int size, int type,
+    ngr_channel_handler *handler, void *data)
+{
+    ngr_channel_t *ch;
+    size_t capacity, i;
+
+    if (size <= 0) return NULL;
+
+    for (capacity = 1; capacity < (size_t)size; capacity <<= 1) {
+        /* void */
+    }
+
+    if (posix_memalign((void **)&ch, NGR_CACHELINE_SIZE, sizeof(*ch)) != 0) {
+        return NULL;
+    }
+
+    ch->slots = malloc(capacity * sizeof(ngr_channel_slot_t));
+    if (ch->slots == NULL) {
+        free(ch);
+        return NULL;
+    }
+
+    for (i = 0; i < capacity; i++) {
+        atomic_init(&ch->slots[i].seq, i);
+        ch->slots[i].msg = NULL;
+    }
+
+    ch->ev = ev;
+    ch->type = type;
+    ch->mask = capacity - 1;
+    ch->handler = handler;
+    ch->data = data;
+    ch->received = 0;
+    ch->wakeups = 0;
+
+    atomic_init(&ch->tail, 0);
+    atomic_init(&ch->head, 0);
+    atomic_init(&ch->idle, 1);
+
+#ifdef HAVE_EPOLL
+    ch->notify[0] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    ch->notify[1] = ch->notify[0];
+    if (ch->notify[0] == -1) {
+        free(ch->slots);
+        free(ch);
+        return NULL;
+    }
+#else
+    if (pipe(ch->notify) == -1) {
+        free(ch->slots);
+        free(ch);
+        return NULL;
+    }
+
+    fcntl(ch->notify[0], F_SETFL, O_NONBLOCK);
+    fcntl(ch->notify[1], F_SETFL, O_NONBLOCK);
+#endif
+
+    if (ngr_event_create_io_event(ev, ch->notify[0], NGR_EVENT_READABLE,
+            ngr_channel_handle, ch) == -1)
+    {
+        close(ch->notify[0]);
+        if (ch->notify[1] != ch->notify[0]) close(ch->notify[1]);
+        free(ch->slots);
+        free(ch);
+        return NULL;
+    }
+
+    ngr_event_pin(ev, ch->notify[0]);
+
+    return ch;
+}
+
+
+/*
+ * Must be called from the consumer loop thread once the producers are
+ * gone, messages still in the ring are dropped.
+ */
+void ngr_channel_destroy(ngr_channel_t *ch)
+{
+    ngr_event_del_io_event(ch->ev, ch->notify[0], NGR_EVENT_READABLE);
+
+    close(ch->notify[0]);
+    if (ch->notify[1] != ch->notify[0]) close(ch->notify[1]);
+
+    free(ch->slots);
+    free(ch);
+}
+
+
+/*
+ * Hand every message in the ring to the handler right away, call from the
+ * consumer loop thread. Returns the number of messages handled.
+ */
+int ngr_channel_drain(ngr_channel_t *ch)
+{
+    void *msg;
+    int n = 0;
+
+    while (ngr_channel_pop(ch, &msg)) {
+        ch->handler(ch->ev, ch, msg, ch->data);
+        n++;
+    }
+
+    ch->received += n;
+
+    return n;
+}
+
+
+/*
+ * Returns -1 when the ring is full. Only the send which finds the consumer
+ * idle pays for a wakeup syscall, the others are a few atomic operations.
+ */
+int ngr_channel_send(ngr_channel_t *ch, void *msg)
+{
+    ngr_channel_slot_t *slot;
+    size_t tail, seq;
+
+    if (ch->type == NGR_CHANNEL_SPSC) {
+        tail = atomic_load_explicit(&ch->tail, memory_order_relaxed);
+
+        if (tail - atomic_load_explicit(&ch->head, memory_order_acquire)
+            > ch->mask)
+        {
+            return -1;
+        }
+
+        ch->slots[tail & ch->mask].msg = msg;
+        atomic_store_explicit(&ch->tail, tail + 1, memory_order_release);
+
+    } else {
+        tail = atomic_load_explicit(&ch->tail, memory_order_relaxed);
+
+        for ( ;; ) {
+            slot = &ch->slots[tail & ch->mask];
+            seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+            if (seq == tail) { /* free slot, try to claim it */
+                if (atomic_compare_exchange_weak_explicit(&ch->tail, &tail,
+                        tail + 1, memory_order_relaxed, memory_order_relaxed))
+                {
+                    break;
+                }
+
+            } else if ((intptr_t)(seq - tail) < 0) { /* a lap behind, full */
+                return -1;
+
+            } else {
+                tail = atomic_load_explicit(&ch->tail, memory_order_relaxed);
+            }
+        }
+
+        slot->msg = msg;
+        atomic_store_explicit(&slot->seq, tail + 1, memory_order_release);
+    }
+
+    /* pairs with the consumer storing idle and checking the ring again */
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (atomic_load_explicit(&ch->idle, memory_order_relaxed)
+        && atomic_exchange(&ch->idle, 0))
+    {
+        ngr_channel_wakeup(ch);
+    }
+
+    return 0;
+}
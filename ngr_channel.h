@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2012-2013, Liexusong <liexusong at qq dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _NGR_CHANNEL_H
+#define _NGR_CHANNEL_H
+
+#include <stdatomic.h>
+#include "ngr_event.h"
+
+
+#define NGR_CHANNEL_SPSC  0   /* one producer thread */
+#define NGR_CHANNEL_MPSC  1   /* any number of producer threads */
+
+typedef struct ngr_channel_s ngr_channel_t;
+
+/* runs in the consumer loop, once per message */
+typedef void ngr_channel_handler(ngr_event_t *ev, ngr_channel_t *ch,
+    void *msg, void *data);
+
+
+typedef struct ngr_channel_slot_s {
+    atomic_size_t seq;       /* MPSC only, slot turn */
+    void *msg;
+} ngr_channel_slot_t;
+
+
+struct ngr_channel_s {
+    ngr_event_t *ev;         /* consumer loop */
+    int type;
+    size_t mask;             /* capacity - 1, capacity is a power of 2 */
+    ngr_channel_slot_t *slots;
+    int notify[2];           /* notify[0] is watched by the consumer */
+    ngr_channel_handler *handler;
+    void *data;
+
+    /* producer side */
+    _Alignas(NGR_CACHELINE_SIZE) atomic_size_t tail;
+
+    /* consumer side */
+    _Alignas(NGR_CACHELINE_SIZE) atomic_size_t head;
+    atomic_int idle;         /* consumer waits for a wakeup */
+
+    uint64_t received;
+    uint64_t wakeups;
+};
+
+
+ngr_channel_t *ngr_channel_new(ngr_event_t *ev, int size, int type,
+    ngr_channel_handler *handler, void *data);
+void ngr_channel_destroy(ngr_channel_t *ch);
+int ngr_channel_drain(ngr_channel_t *ch);
+int ngr_channel_send(ngr_channel_t *ch, void *msg);
+
+#endif
@@ -0,0 +1,453 @@
+/*
+ * Copyright (c) 2012-2013, Liexusong <liexusong at qq dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE  /* recvmmsg, sendmmsg */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+
+#include "ngr_dgram.h"
+
+#ifndef SOL_UDP
+#define SOL_UDP  IPPROTO_UDP
+#endif
+
+#define NGR_DGRAM_RCTRL_SIZE  CMSG_SPACE(sizeof(int))
+#define NGR_DGRAM_SCTRL_SIZE  CMSG_SPACE(sizeof(uint16_t))
+
+
+#ifndef HAVE_EPOLL
+
+/* plain recvmsg/sendmsg loops where the mmsg calls are missing */
+
+static int ngr_dgram_recvmmsg(int fd, struct mmsghdr *msgs, int vlen)
+{
+    ssize_t n;
+    int i;
+
+    for (i = 0; i < vlen; i++) {
+        n = recvmsg(fd, &msgs[i].msg_hdr, MSG_DONTWAIT);
+        if (n == -1) {
+            return i > 0 ? i : -1;
+        }
+        msgs[i].msg_len = n;
+    }
+
+    return i;
+}
+
+static int ngr_dgram_sendmmsg(int fd, struct mmsghdr *msgs, int vlen)
+{
+    ssize_t n;
+    int i;
+
+    for (i = 0; i < vlen; i++) {
+        n = sendmsg(fd, &msgs[i].msg_hdr, 0);
+        if (n == -1) {
+            return i > 0 ? i : -1;
+        }
+        msgs[i].msg_len = n;
+    }
+
+    return i;
+}
+
+#else
+
+#define ngr_dgram_recvmmsg(fd, msgs, vlen)                                    \
+    recvmmsg(fd, msgs, vlen, MSG_DONTWAIT, NULL)
+#define ngr_dgram_sendmmsg(fd, msgs, vlen)                                    \
+    sendmmsg(fd, msgs, vlen, 0)
+
+#endif
+
+
+static size_t ngr_dgram_gro_size(struct msghdr *hdr, size_t len)
+{
+#ifdef UDP_GRO
+    struct cmsghdr *cmsg;
+    int size;
+
+    for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+            return size > 0 ? (size_t)size : len;
+        }
+    }
+#endif
+
+    return len;
+}
+
+
+static void ngr_dgram_handle(ngr_event_t *ev, int fd, void *data, int mask)
+{
+    ngr_dgram_t *dg = data;
+    struct msghdr *hdr;
+    size_t len, seg, off;
+    int round, n, i, np;
+
+    for (round = 0; round < NGR_DGRAM_MAX_ROUNDS; round++) {
+
+        for (i = 0; i < dg->batch; i++) { /* the kernel updates these */
+            hdr = &dg->rmsgs[i].msg_hdr;
+            hdr->msg_namelen = sizeof(struct sockaddr_storage);
+            if (dg->flags & NGR_DGRAM_GRO) {
+                hdr->msg_controllen = NGR_DGRAM_RCTRL_SIZE;
+            }
+        }
+
+        n = ngr_dgram_recvmmsg(fd, dg->rmsgs, dg->batch);
+        if (n <= 0) {
+            break;
+        }
+
+        dg->recv_calls++;
+        np = 0;
+
+        for (i = 0; i < n; i++) {
+            hdr = &dg->rmsgs[i].msg_hdr;
+            len = dg->rmsgs[i].msg_len;
+            seg = len;
+
+            if (dg->flags & NGR_DGRAM_GRO) { /* split coalesced datagrams */
+                seg = ngr_dgram_gro_size(hdr, len);
+            }
+
+            for (off = 0; off < len || len == 0; off += seg) {
+
+                if (np == dg->batch) {
+                    dg->handler(ev, dg, dg->packets, np, dg->data);
+                    np = 0;
+                }
+
+                dg->packets[np].data = dg->rbufs + i * dg->bufsize + off;
+                dg->packets[np].len = len - off < seg ? len - off : seg;
+                dg->packets[np].addr = (struct sockaddr *)&dg->raddrs[i];
+                dg->packets[np].addrlen = hdr->msg_namelen;
+                np++;
+
+                dg->received++;
+
+                if (len == 0) break; /* empty datagram */
+            }
+        }
+
+        if (np > 0) {
+            dg->handler(ev, dg, dg->packets, np, dg->data);
+        }
+
+        if (n < dg->batch) { /* socket drained */
+            break;
+        }
+    }
+
+    if (dg->squeued > 0) {
+        (void)ngr_dgram_flush(dg);
+    }
+}
+
+
+ngr_dgram_t *ngr_dgram_new(ngr_event_t *ev, int fd, int batch, int flags,
+    ngr_dgram_handler *handler, void *data)
+{
+    ngr_dgram_t *dg;
+    struct msghdr *hdr;
+    int i, one = 1;
+
+    if (batch <= 0) {
+        batch = NGR_DGRAM_DEFAULT_BATCH;
+    }
+
+    dg = calloc(1, sizeof(*dg));
+    if (dg == NULL) {
+        return NULL;
+    }
+
+    dg->ev = ev;
+    dg->fd = fd;
+    dg->batch = batch;
+    dg->handler = handler;
+    dg->data = data;
+    dg->bufsize = NGR_DGRAM_DEFAULT_BUFSIZE;
+
+#ifdef UDP_GRO
+    if ((flags & NGR_DGRAM_GRO)
+        && setsockopt(fd, SOL_UDP, UDP_GRO, &one, sizeof(one)) == 0)
+    {
+        dg->flags |= NGR_DGRAM_GRO;
+        dg->bufsize = NGR_DGRAM_GRO_BUFSIZE;
+    }
+#endif
+
+#ifdef UDP_SEGMENT
+    if (flags & NGR_DGRAM_GSO) {
+        dg->flags |= NGR_DGRAM_GSO;
+    }
+#endif
+
+    dg->rmsgs = calloc(batch, sizeof(struct mmsghdr));
+    dg->riov = calloc(batch, sizeof(struct iovec));
+    dg->raddrs = calloc(batch, sizeof(struct sockaddr_storage));
+    dg->rbufs = malloc(batch * dg->bufsize);
+    dg->rctrl = calloc(batch, NGR_DGRAM_RCTRL_SIZE);
+    dg->packets = calloc(batch, sizeof(ngr_dgram_packet_t));
+
+    dg->smsgs = calloc(batch, sizeof(struct mmsghdr));
+    dg->siov = calloc(batch, sizeof(struct iovec));
+    dg->saddrs = calloc(batch, sizeof(struct sockaddr_storage));
+    dg->sbufs = malloc(batch * NGR_DGRAM_DEFAULT_BUFSIZE);
+    dg->sctrl = calloc(batch, NGR_DGRAM_SCTRL_SIZE);
+    dg->slens = calloc(batch, sizeof(size_t));
+    dg->saddrlens = calloc(batch, sizeof(socklen_t));
+
+    if (!dg->rmsgs || !dg->riov || !dg->raddrs || !dg->rbufs || !dg->rctrl
+        || !dg->packets || !dg->smsgs || !dg->siov || !dg->saddrs
+        || !dg->sbufs || !dg->sctrl || !dg->slens || !dg->saddrlens)
+    {
+        goto failed;
+    }
+
+    for (i = 0; i < batch; i++) {
+        dg->riov[i].iov_base = dg->rbufs + i * dg->bufsize;
+        dg->riov[i].iov_len = dg->bufsize;
+
+        hdr = &dg->rmsgs[i].msg_hdr;
+        hdr->msg_name = &dg->raddrs[i];
+        hdr->msg_iov = &dg->riov[i];
+        hdr->msg_iovlen = 1;
+
+        if (dg->flags & NGR_DGRAM_GRO) {
+            hdr->msg_control = dg->rctrl + i * NGR_DGRAM_RCTRL_SIZE;
+        }
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    if (ngr_event_create_io_event(ev, fd, NGR_EVENT_READABLE,
+            ngr_dgram_handle, dg) == -1)
+    {
+        goto failed;
+    }
+
+    ngr_event_pin(ev, fd);
+
+    return dg;
+
+failed:
+
+    dg->fd = -1;
+    ngr_dgram_destroy(dg);
+
+    return NULL;
+}
+
+
+void ngr_dgram_destroy(ngr_dgram_t *dg)
+{
+    if (dg->fd != -1) {
+        ngr_event_del_io_event(dg->ev, dg->fd, NGR_EVENT_READABLE);
+    }
+
+    free(dg->rmsgs);
+    free(dg->riov);
+    free(dg->raddrs);
+    free(dg->rbufs);
+    free(dg->rctrl);
+    free(dg->packets);
+    free(dg->smsgs);
+    free(dg->siov);
+    free(dg->saddrs);
+    free(dg->sbufs);
+    free(dg->sctrl);
+    free(dg->slens);
+    free(dg->saddrlens);
+    free(dg);
+}
+
+
+/*
+ * Queue a datagram, it is copied into the send ring and goes out with the
+ * next flush. The ring is flushed early when it is full.
+ */
+int ngr_dgram_send(ngr_dgram_t *dg, const void *buf, size_t len,
+    const struct sockaddr *addr, socklen_t addrlen)
+{
+    int slot;
+
+    if (len > NGR_DGRAM_DEFAULT_BUFSIZE
+        || addrlen > sizeof(struct sockaddr_storage))
+    {
+        return -1;
+    }
+
+    if (dg->squeued == dg->batch) {
+        (void)ngr_dgram_flush(dg);
+    }
+
+    slot = dg->squeued++;
+
+    memcpy(dg->sbufs + slot * NGR_DGRAM_DEFAULT_BUFSIZE, buf, len);
+    memcpy(&dg->saddrs[slot], addr, addrlen);
+    dg->slens[slot] = len;
+    dg->saddrlens[slot] = addrlen;
+
+    return 0;
+}
+
+
+static int ngr_dgram_same_addr(ngr_dgram_t *dg, int a, int b)
+{
+    return dg->saddrlens[a] == dg->saddrlens[b]
+           && memcmp(&dg->saddrs[a], &dg->saddrs[b], dg->saddrlens[a]) == 0;
+}
+
+
+/*
+ * Build one message per run of datagrams. With GSO, consecutive replies to
+ * the same peer with the same size (the last one may be shorter) share one
+ * message and the kernel segments it.
+ */
+static int ngr_dgram_build(ngr_dgram_t *dg)
+{
+    struct msghdr *hdr;
+    struct cmsghdr *cmsg;
+    size_t total;
+    uint16_t size;
+    int i, j, k, nmsgs = 0;
+
+    for (i = 0; i < dg->squeued; i = j) {
+
+        j = i + 1;
+        total = dg->slens[i];
+
+        if (dg->flags & NGR_DGRAM_GSO) {
+            while (j < dg->squeued
+                   && j - i < NGR_DGRAM_MAX_SEGMENTS
+                   && dg->slens[j - 1] == dg->slens[i]
+                   && dg->slens[j] <= dg->slens[i]
+                   && dg->slens[j] > 0
+                   && total + dg->slens[j] <= 65507
+                   && ngr_dgram_same_addr(dg, i, j))
+            {
+                total += dg->slens[j];
+                j++;
+            }
+        }
+
+        for (k = i; k < j; k++) {
+            dg->siov[k].iov_base = dg->sbufs + k * NGR_DGRAM_DEFAULT_BUFSIZE;
+            dg->siov[k].iov_len = dg->slens[k];
+        }
+
+        hdr = &dg->smsgs[nmsgs].msg_hdr;
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->msg_name = &dg->saddrs[i];
+        hdr->msg_namelen = dg->saddrlens[i];
+        hdr->msg_iov = &dg->siov[i];
+        hdr->msg_iovlen = j - i;
+
+#ifdef UDP_SEGMENT
+        if (j - i > 1) {
+            hdr->msg_control = dg->sctrl + nmsgs * NGR_DGRAM_SCTRL_SIZE;
+            hdr->msg_controllen = NGR_DGRAM_SCTRL_SIZE;
+
+            cmsg = CMSG_FIRSTHDR(hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+            size = (uint16_t)dg->slens[i];
+            memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+        }
+#endif
+
+        nmsgs++;
+    }
+
+    return nmsgs;
+}
+
+
+int ngr_dgram_flush(ngr_dgram_t *dg)
+{
+    int nmsgs, done = 0, n, i, rc = 0;
+
+    if (dg->squeued == 0) {
+        return 0;
+    }
+
+    nmsgs = ngr_dgram_build(dg);
+
+    while (done < nmsgs) {
+
+        n = ngr_dgram_sendmmsg(dg->fd, dg->smsgs + done, nmsgs - done);
+
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if ((dg->flags & NGR_DGRAM_GSO) && done == 0
+                && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT))
+            {
+                /* no GSO on this path, resend unsegmented */
+                dg->flags &= ~NGR_DGRAM_GSO;
+                nmsgs = ngr_dgram_build(dg);
+                continue;
+            }
+
+            /* datagrams are lossy anyway, drop the rest of the queue */
+            for (i = done; i < nmsgs; i++) {
+                dg->dropped += dg->smsgs[i].msg_hdr.msg_iovlen;
+            }
+
+            rc = -1;
+            break;
+        }
+
+        dg->send_calls++;
+
+        for (i = done; i < done + n; i++) {
+            dg->sent += dg->smsgs[i].msg_hdr.msg_iovlen;
+        }
+
+        done += n;
+    }
+
+    dg->squeued = 0;
+
+    return rc;
+}
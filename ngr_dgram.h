@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2012-2013, Liexusong <liexusong at qq dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _NGR_DGRAM_H
+#define _NGR_DGRAM_H
+
+#include <sys/socket.h>
+#include "ngr_event.h"
+
+
+#define NGR_DGRAM_DEFAULT_BATCH    64
+#define NGR_DGRAM_DEFAULT_BUFSIZE  2048
+#define NGR_DGRAM_GRO_BUFSIZE      65536
+#define NGR_DGRAM_MAX_ROUNDS       4      /* recv calls per readable event */
+#define NGR_DGRAM_MAX_SEGMENTS     64     /* kernel limit for UDP GSO */
+
+#define NGR_DGRAM_GRO  1
+#define NGR_DGRAM_GSO  2
+
+typedef struct ngr_dgram_s ngr_dgram_t;
+
+typedef struct ngr_dgram_packet_s {
+    char *data;                    /* view into the receive ring */
+    size_t len;
+    struct sockaddr *addr;
+    socklen_t addrlen;
+} ngr_dgram_packet_t;
+
+/*
+ * Receives a batch of datagrams, the views are valid until the handler
+ * returns. Replies queued with ngr_dgram_send() from the handler are
+ * flushed with one sendmmsg() after it returns.
+ */
+typedef void ngr_dgram_handler(ngr_event_t *ev, ngr_dgram_t *dg,
+    ngr_dgram_packet_t *packets, int npackets, void *data);
+
+
+struct ngr_dgram_s {
+    ngr_event_t *ev;
+    int fd;
+    int batch;                     /* datagrams per recvmmsg/sendmmsg */
+    size_t bufsize;
+    int flags;                     /* NGR_DGRAM_GRO|NGR_DGRAM_GSO in use */
+    ngr_dgram_handler *handler;
+    void *data;
+
+    /* receive ring */
+    struct mmsghdr *rmsgs;
+    struct iovec *riov;
+    struct sockaddr_storage *raddrs;
+    char *rbufs;
+    char *rctrl;
+    ngr_dgram_packet_t *packets;
+
+    /* send queue */
+    struct mmsghdr *smsgs;
+    struct iovec *siov;
+    struct sockaddr_storage *saddrs;
+    char *sbufs;
+    char *sctrl;
+    size_t *slens;
+    socklen_t *saddrlens;
+    int squeued;
+
+    uint64_t received;
+    uint64_t sent;
+    uint64_t recv_calls;
+    uint64_t send_calls;
+    uint64_t dropped;              /* replies which could not be sent */
+};
+
+
+ngr_dgram_t *ngr_dgram_new(ngr_event_t *ev, int fd, int batch, int flags,
+    ngr_dgram_handler *handler, void *data);
+void ngr_dgram_destroy(ngr_dgram_t *dg);
+int ngr_dgram_send(ngr_dgram_t *dg, const void *buf, size_t len,
+    const struct sockaddr *addr, socklen_t addrlen);
+int ngr_dgram_flush(ngr_dgram_t *dg);
+
+#endif
@@ -1,30 +1,43 @@
 
+#include <errno.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
 
 struct ngr_event_lib_context {
     int epfd;
+    int sigfd;
+    sigset_t sigmask;
+    int nevents;
     struct epoll_event *events;
 };
 
 static int ngr_event_lib_init(ngr_event_t *ev)
 {
-    struct ngr_event_lib_context *ctx = malloc(sizeof(*ctx));
+    struct ngr_event_lib_context *ctx;
+
+    ctx = ngr_event_alloc(ev->node, sizeof(*ctx));
 
     if (!ctx) return -1;
 
-    ctx->events = malloc(sizeof(struct epoll_event) * ev->max_events);
+    ctx->events = ngr_event_alloc(ev->node,
+                                  sizeof(struct epoll_event) * ev->max_events);
     if (!ctx->events) {
-        free(ctx);
+        ngr_event_free(ctx);
         return -1;
     }
 
     ctx->epfd = epoll_create(1024); /* 1024 is just an hint for the kernel */
     if (ctx->epfd == -1) {
-        free(ctx->events);
-        free(ctx);
+        ngr_event_free(ctx->events);
+        ngr_event_free(ctx);
         return -1;
     }
 
+    ctx->sigfd = -1;
+    sigemptyset(&ctx->sigmask);
+
     ev->ctx = ctx;
     return 0;
 }
@@ -33,11 +46,26 @@ static void ngr_event_lib_free_context(ngr_event_t *ev)
 {
     struct ngr_event_lib_context *ctx = ev->ctx;
 
+    if (ctx->sigfd != -1) {
+        sigprocmask(SIG_UNBLOCK, &ctx->sigmask, NULL);
+        close(ctx->sigfd);
+    }
+
     close(ctx->epfd);
-    free(ctx->events);
-    free(ctx);
+    ngr_event_free(ctx->events);
+    ngr_event_free(ctx);
 }
 
+/*
+ * The event data carries the fd and the generation of its registration,
+ * so events of a fd closed and reused within one poll are told apart.
+ */
+static inline uint64_t ngr_event_lib_data(ngr_event_t *ev, int fd)
+{
+    return (uint64_t)ev->events[fd].gen << 32 | (uint32_t)fd;
+}
+
+
 static int ngr_event_lib_add_event(ngr_event_t *ev, int fd, int mask)
 {
     struct ngr_event_lib_context *ctx = ev->ctx;
@@ -49,15 +77,20 @@ static int ngr_event_lib_add_event(ngr_event_t *ev, int fd, int mask)
 
     ee.events = 0;
     mask |= ev->events[fd].mask;
+    mask &= ~ev->events[fd].throttled;
     if (mask & NGR_EVENT_READABLE) ee.events |= EPOLLIN;
     if (mask & NGR_EVENT_WRITABLE) ee.events |= EPOLLOUT;
 
-    ee.data.u64 = 0; /* avoid valgrind warning */
-    ee.data.fd = fd;
+    ee.data.u64 = ngr_event_lib_data(ev, fd);
 
-    if (epoll_ctl(ctx->epfd, op, fd, &ee) == -1)
-        return -1;
-    return 0;
+    if (epoll_ctl(ctx->epfd, op, fd, &ee) == 0)
+        return 0;
+
+    /* closed with close() while registered, the kernel dropped it */
+    if (op == EPOLL_CTL_MOD && errno == ENOENT)
+        return NGR_EVENT_LIB_STALE;
+
+    return -1;
 }
 
 static void ngr_event_lib_del_event(ngr_event_t *ev, int fd, int delmask)
@@ -65,13 +98,13 @@ static void ngr_event_lib_del_event(ngr_event_t *ev, int fd, int delmask)
     struct ngr_event_lib_context *ctx = ev->ctx;
     struct epoll_event ee;
     int mask = ev->events[fd].mask & (~delmask);
+    int armed = mask & ~ev->events[fd].throttled;
 
     ee.events = 0;
-    if (mask & NGR_EVENT_READABLE) ee.events |= EPOLLIN;
-    if (mask & NGR_EVENT_WRITABLE) ee.events |= EPOLLOUT;
+    if (armed & NGR_EVENT_READABLE) ee.events |= EPOLLIN;
+    if (armed & NGR_EVENT_WRITABLE) ee.events |= EPOLLOUT;
 
-    ee.data.u64 = 0; /* avoid valgrind warning */
-    ee.data.fd = fd;
+    ee.data.u64 = ngr_event_lib_data(ev, fd);
 
     if (mask != NGR_EVENT_NONE) {
         epoll_ctl(ctx->epfd, EPOLL_CTL_MOD, fd, &ee);
@@ -82,33 +115,206 @@ static void ngr_event_lib_del_event(ngr_event_t *ev, int fd, int delmask)
     }
 }
 
+/*
+ * The node throttled bits are already updated, a fd with every direction
+ * paused stays in the set with no events.
+ */
+static void ngr_event_lib_pause(ngr_event_t *ev, int fd, int mask)
+{
+    struct ngr_event_lib_context *ctx = ev->ctx;
+    struct epoll_event ee;
+    int armed = ev->events[fd].mask & ~ev->events[fd].throttled;
+
+    ee.events = 0;
+    if (armed & NGR_EVENT_READABLE) ee.events |= EPOLLIN;
+    if (armed & NGR_EVENT_WRITABLE) ee.events |= EPOLLOUT;
+
+    ee.data.u64 = ngr_event_lib_data(ev, fd);
+
+    epoll_ctl(ctx->epfd, EPOLL_CTL_MOD, fd, &ee);
+}
+
+static void ngr_event_lib_resume(ngr_event_t *ev, int fd, int mask)
+{
+    ngr_event_lib_pause(ev, fd, mask); /* the same MOD */
+}
+
 static int ngr_event_lib_poll(ngr_event_t *ev, struct timeval *tvp)
 {
     struct ngr_event_lib_context *ctx = ev->ctx;
     int retval, numevents = 0;
 
-    retval = epoll_wait(ctx->epfd, ctx->events, ev->max_events,
-            tvp ? (tvp->tv_sec * 1000 + tvp->tv_usec / 1000) : -1);
+#if defined(SYS_epoll_pwait2)
+    if (tvp && ev->timer_policy == NGR_EVENT_TIMER_PRECISE) {
+        struct timespec ts;
+
+        ts.tv_sec = tvp->tv_sec;
+        ts.tv_nsec = tvp->tv_usec * 1000;
+
+        retval = syscall(SYS_epoll_pwait2, ctx->epfd, ctx->events,
+                         ev->max_events, &ts, NULL, 0);
+    } else
+#endif
+    {
+        /* epoll_wait() takes milliseconds, a truncated timeout returns
+         * just before the deadline and the next poll spins on zero */
+        retval = epoll_wait(ctx->epfd, ctx->events, ev->max_events,
+                tvp ? (tvp->tv_sec * 1000 + (tvp->tv_usec + 999) / 1000) : -1);
+    }
 
     if (retval > 0) {
         int j;
 
         numevents = retval;
 
-        for (j = 0; j < numevents; j++) {
+        for (j = 0; j < numevents && j < NGR_PREFETCH_DISTANCE; j++) {
+            ngr_prefetch(&ev->events[(uint32_t)ctx->events[j].data.u64]);
+        }
+    }
+
+    ctx->nevents = numevents;
+
+    return numevents;
+}
+
+/* epoll_pwait2() takes a timespec, probe it since it needs Linux 5.11 */
+static int ngr_event_lib_precise(ngr_event_t *ev)
+{
+#if defined(SYS_epoll_pwait2)
+    struct ngr_event_lib_context *ctx = ev->ctx;
+    struct timespec ts;
+
+    ts.tv_sec = 0;
+    ts.tv_nsec = 0;
+
+    if (syscall(SYS_epoll_pwait2, ctx->epfd, NULL, 0, &ts, NULL, 0) == -1
+        && errno == ENOSYS)
+    {
+        return 0;
+    }
+
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * The fired events stay in the epoll result array, the node is indexed
+ * by the fd in the event data and dropped when its generation moved on.
+ * Nodes a few slots ahead are prefetched.
+ */
+static inline ngr_event_node_t *ngr_event_lib_fired(ngr_event_t *ev, int j,
+    int *mask)
+{
+    struct ngr_event_lib_context *ctx = ev->ctx;
+    struct epoll_event *e = ctx->events + j;
+    ngr_event_node_t *node = &ev->events[(uint32_t)e->data.u64];
+
+    if (j + NGR_PREFETCH_DISTANCE < ctx->nevents) {
+        uint32_t ahead = e[NGR_PREFETCH_DISTANCE].data.u64;
 
-            int mask = 0;
-            struct epoll_event *e = ctx->events + j;
+        ngr_prefetch(&ev->events[ahead]);
+    }
+
+    if ((uint32_t)(e->data.u64 >> 32) != node->gen) { /* stale */
+        return NULL;
+    }
+
+    *mask = 0;
+    if (e->events & EPOLLIN)  *mask |= NGR_EVENT_READABLE;
+    if (e->events & EPOLLOUT) *mask |= NGR_EVENT_WRITABLE;
+
+    return node;
+}
 
-            if (e->events & EPOLLIN)  mask |= NGR_EVENT_READABLE;
-            if (e->events & EPOLLOUT) mask |= NGR_EVENT_WRITABLE;
+static void ngr_event_lib_signal_handler(ngr_event_t *ev, int fd, void *data,
+    int mask)
+{
+    struct signalfd_siginfo info[16];
+    ssize_t n;
+    int j;
 
-            ev->fired[j].fd = e->data.fd;
-            ev->fired[j].mask = mask;
+    /* drain every queued signal, the loop dispatches them coalesced */
+    while ((n = read(fd, info, sizeof(info))) > 0) {
+        for (j = 0; j < n / (ssize_t)sizeof(info[0]); j++) {
+            ev->signals[info[j].ssi_signo].count++;
         }
+        ev->signal_pending = 1;
     }
+}
 
-    return numevents;
+/*
+ * Signals are received through a signalfd, so they must be blocked in
+ * every thread. The mask is changed for the calling thread only, call this
+ * before starting other threads.
+ */
+static int ngr_event_lib_add_signal(ngr_event_t *ev, int signo)
+{
+    struct ngr_event_lib_context *ctx = ev->ctx;
+    int fd;
+
+    sigaddset(&ctx->sigmask, signo);
+
+    if (sigprocmask(SIG_BLOCK, &ctx->sigmask, NULL) == -1) {
+        sigdelset(&ctx->sigmask, signo);
+        return -1;
+    }
+
+    fd = signalfd(ctx->sigfd, &ctx->sigmask, SFD_NONBLOCK|SFD_CLOEXEC);
+    if (fd == -1) {
+        sigdelset(&ctx->sigmask, signo);
+        return -1;
+    }
+
+    if (ctx->sigfd == -1) {
+        if (ngr_event_create_io_event(ev, fd, NGR_EVENT_READABLE,
+                ngr_event_lib_signal_handler, NULL) == -1)
+        {
+            close(fd);
+            sigdelset(&ctx->sigmask, signo);
+            return -1;
+        }
+
+        ngr_event_set_priority(ev, fd, NGR_EVENT_PRIORITY_HIGH);
+        ngr_event_pin(ev, fd);
+        ctx->sigfd = fd;
+    }
+
+    return 0;
+}
+
+static void ngr_event_lib_del_signal(ngr_event_t *ev, int signo)
+{
+    struct ngr_event_lib_context *ctx = ev->ctx;
+    sigset_t set;
+
+    sigdelset(&ctx->sigmask, signo);
+    (void)signalfd(ctx->sigfd, &ctx->sigmask, SFD_NONBLOCK|SFD_CLOEXEC);
+
+    sigemptyset(&set);
+    sigaddset(&set, signo);
+    sigprocmask(SIG_UNBLOCK, &set, NULL);
+}
+
+static int ngr_event_lib_busy_poll(ngr_event_t *ev, int64_t usec)
+{
+#ifdef EPIOCSPARAMS
+    struct ngr_event_lib_context *ctx = ev->ctx;
+    struct epoll_params params;
+
+    memset(&params, 0, sizeof(params)); /* all zero turns it off */
+
+    if (usec > 0) {
+        params.busy_poll_usecs = usec;
+        params.busy_poll_budget = 8;
+        params.prefer_busy_poll = 1;
+    }
+
+    return ioctl(ctx->epfd, EPIOCSPARAMS, &params);
+#else
+    return -1;
+#endif
 }
 
 char *ngr_event_lib_name(void)
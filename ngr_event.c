@@ -27,15 +27,107 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE  /* sched_setaffinity */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sched.h>
 
 #include "ngr_event.h"
 
-#ifdef HAVE_EPOLL
+#define NGR_MPOL_PREFERRED  1
+
+/* precedes every table, its mapping size or 0 when it came from malloc */
+#define NGR_ALLOC_HEADER    NGR_CACHELINE_SIZE
+
+#if !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS       MAP_ANON
+#endif
+
+
+/*
+ * Loop tables are cache line aligned, so the tables of two loops never
+ * share a line, and zeroed by the calling thread, which places them on
+ * its NUMA node at first touch. With a known node tables of a page or
+ * more get pages of their own, bound to it before they are first touched,
+ * so no other object is placed or moved with them.
+ */
+static void *ngr_event_alloc(int node, size_t size)
+{
+    size_t *h;
+
+    size = (size + NGR_CACHELINE_SIZE - 1) & ~(NGR_CACHELINE_SIZE - 1);
+
+#if defined(SYS_mbind)
+    if (node >= 0 && node < 1024 && size >= (size_t)sysconf(_SC_PAGESIZE)) {
+        unsigned long mask[1024 / (sizeof(long) * 8)] = { 0 };
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t len = (size + NGR_ALLOC_HEADER + page - 1) & ~(page - 1);
+        int bits = sizeof(long) * 8;
+
+        h = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+                 -1, 0);
+        if (h == MAP_FAILED) {
+            return NULL;
+        }
+
+        mask[node / bits] = 1UL << (node % bits);
+
+        /* best effort, the pages are still untouched and come zeroed */
+        (void)syscall(SYS_mbind, h, len, NGR_MPOL_PREFERRED, mask, 1024, 0);
+
+        *h = len;
+
+        return (char *)h + NGR_ALLOC_HEADER;
+    }
+#endif
+
+    if (posix_memalign((void **)&h, NGR_CACHELINE_SIZE,
+                       size + NGR_ALLOC_HEADER) != 0)
+    {
+        return NULL;
+    }
+
+    memset(h, 0, size + NGR_ALLOC_HEADER);
+
+    return (char *)h + NGR_ALLOC_HEADER;
+}
+
+
+static void ngr_event_free(void *p)
+{
+    size_t *h;
+
+    if (p == NULL) {
+        return;
+    }
+
+    h = (size_t *)((char *)p - NGR_ALLOC_HEADER);
+
+    if (*h) {
+        munmap(h, *h);
+    } else {
+        free(h);
+    }
+}
+
+
+/* add_event found the fd closed with close() while it was registered */
+#define NGR_EVENT_LIB_STALE  1
+
+#if defined(NGR_EVENT_SIM)
+#include "ngr_sim.c"
+#elif defined(HAVE_EPOLL)
 #include "ngr_epoll.c"
 #else
 # ifdef HAVE_KQUEUE
@@ -46,50 +138,123 @@
 #endif
 
 
-static int64_t ngr_event_current_time()
+static void ngr_event_wakeup_handler(ngr_event_t *ev, int fd, void *data,
+    int mask);
+static void ngr_event_release_timer(ngr_event_t *ev, ngr_event_timer_t *timer);
+
+
+static int64_t ngr_event_current_usec()
 {
+#ifdef NGR_EVENT_SIM
+    return ngr_sim_now();
+#else
     struct timeval tv;
-    int64_t ret;
 
     gettimeofday(&tv, NULL);
 
-    ret  = (int64_t)tv.tv_sec * 1000;
-    ret += (int64_t)tv.tv_usec / 1000;
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+
+/* bind the calling thread to cpu, returns the NUMA node or -1 */
+static int ngr_event_bind_cpu(int cpu)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    unsigned c, node;
+
+    if (cpu >= CPU_SETSIZE) {
+        errno = EINVAL;
+        return -2;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        return -2;
+    }
 
-    return ret;
+    if (syscall(SYS_getcpu, &c, &node, NULL) == -1) {
+        return -1;
+    }
+
+    return (int)node;
+#else
+    errno = ENOSYS;
+    return -2;
+#endif
 }
 
 
 ngr_event_t *ngr_event_new(int max_events)
+{
+    return ngr_event_new_on(max_events, -1);
+}
+
+
+/*
+ * Bind the calling thread to cpu, then create a loop whose tables live on
+ * the NUMA node of that cpu. Must be called by the thread which is going
+ * to run the loop. A negative cpu leaves the thread where it is.
+ */
+ngr_event_t *ngr_event_new_on(int max_events, int cpu)
 {
     ngr_event_t *ev;
-    int i;
+    int i, node = -1;
 
     if (max_events <= 0) {
         max_events = NGR_DEFAULT_EVENTS;
     }
 
-    ev = malloc(sizeof(*ev));
+    if (cpu >= 0) {
+        node = ngr_event_bind_cpu(cpu);
+        if (node == -2) {
+            return NULL;
+        }
+    }
+
+    ev = ngr_event_alloc(node, sizeof(*ev));
     if (ev == NULL) {
         return NULL;
     }
 
+    ev->cpu = cpu >= 0 ? cpu : -1;
+    ev->node = node;
     ev->max_fd = -1;
     ev->max_events = max_events;
+    ev->budget = 0;
+    memset(ev->cursor, 0, sizeof(ev->cursor));
+    ev->timer_policy = NGR_EVENT_TIMER_ROUND_UP;
+    ev->spin = 0;
+    ev->spin_window = 0;
+    ev->spin_adaptive = 0;
     ev->stop = 0;
     ev->free_timers = NULL;
+    ev->running_timer = NULL;
+    ev->buckets = NULL;
     ev->free_timers_count = 0;
-
-    ev->events = malloc(max_events * sizeof(ngr_event_node_t));
+    ev->signals = NULL;
+    ev->children = NULL;
+    ev->signal_pending = 0;
+    ev->ready = NULL;
+    ev->nready = 0;
+    ev->trace = NULL;
+    ev->drain_handler = NULL;
+    ev->drain_data = NULL;
+    ev->drain_timeout = 0;
+    ev->drain_timer = NULL;
+    ev->drain = 0;
+    ev->draining = 0;
+    ev->drain_expired = 0;
+    ev->busy = 0;
+
+    memset(&ev->stats, 0, sizeof(ev->stats));
+
+    ev->events = ngr_event_alloc(node, max_events * sizeof(ngr_event_node_t));
     if (ev->events == NULL) {
-        free(ev);
-        return NULL;
-    }
-
-    ev->fired = malloc(max_events * sizeof(ngr_event_fired_t));
-    if (ev->fired == NULL) {
-        free(ev->events);
-        free(ev);
+        ngr_event_free(ev);
         return NULL;
     }
 
@@ -97,56 +262,166 @@ ngr_event_t *ngr_event_new(int max_events)
 
     /* init event lib */
     if (ngr_event_lib_init(ev) != 0) {
-        free(ev->events);
-        free(ev->fired);
-        free(ev);
+        ngr_event_free(ev->events);
+        ngr_event_free(ev);
         return NULL;
     }
 
     /* set all events to none */
     for (i = 0; i < ev->max_events; i++) {
         ev->events[i].mask = NGR_EVENT_NONE;
+        ev->events[i].priority = NGR_EVENT_PRIORITY_NORMAL;
+        ev->events[i].throttled = 0;
+    }
+
+    /* wakeup fd, written by ngr_event_wakeup() from any thread */
+#ifdef HAVE_EPOLL
+    ev->wakeup[0] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    ev->wakeup[1] = ev->wakeup[0];
+    if (ev->wakeup[0] == -1) {
+        goto failed;
     }
+#else
+    if (pipe(ev->wakeup) == -1) {
+        goto failed;
+    }
+
+    for (i = 0; i < 2; i++) {
+        fcntl(ev->wakeup[i], F_SETFL, O_NONBLOCK);
+        fcntl(ev->wakeup[i], F_SETFD, FD_CLOEXEC);
+    }
+#endif
+
+    if (ngr_event_create_io_event(ev, ev->wakeup[0], NGR_EVENT_READABLE,
+            ngr_event_wakeup_handler, NULL) == -1)
+    {
+        close(ev->wakeup[0]);
+        if (ev->wakeup[1] != ev->wakeup[0]) close(ev->wakeup[1]);
+        goto failed;
+    }
+
+    ngr_event_pin(ev, ev->wakeup[0]);
+    ngr_event_set_priority(ev, ev->wakeup[0], NGR_EVENT_PRIORITY_HIGH);
 
     return ev;
+
+failed:
+
+    ngr_event_lib_free_context(ev);
+    ngr_event_free(ev->events);
+    ngr_event_free(ev);
+    return NULL;
+}
+
+
+/* release the pending timers, their destroy handlers run */
+static void ngr_event_clear_timers(ngr_event_t *ev)
+{
+    struct rbnode *node;
+
+    while ((node = rbtree_min(&ev->timer)) != NULL) {
+        ngr_event_timer_t *timer = node->data;
+
+        rbtree_delete(&ev->timer, node);
+        ngr_event_release_timer(ev, timer);
+    }
 }
 
 
 void ngr_event_destroy(ngr_event_t *ev)
 {
     ngr_event_timer_t *timer;
+    ngr_event_child_t *child;
+
+    ngr_event_clear_timers(ev);
 
     ngr_event_lib_free_context(ev); /* free the event lib context */
 
+    close(ev->wakeup[0]);
+    if (ev->wakeup[1] != ev->wakeup[0]) close(ev->wakeup[1]);
+
+    while (ev->children) {
+        child = ev->children;
+        ev->children = child->next;
+        if (child->fd != -1) close(child->fd);
+        free(child);
+    }
+
+    ngr_event_free(ev->signals);
+    ngr_event_free(ev->ready);
+
     while (ev->free_timers) {
         timer = ev->free_timers;
         ev->free_timers = timer->next;
         free(timer);
     }
 
-    free(ev->events);               /* free events array */
-    free(ev->fired);                /* free fireds array */
-    free(ev);                       /* free event object */
+    ngr_event_free(ev->events);               /* free events array */
+    ngr_event_free(ev);                       /* free event object */
 }
 
 
-int ngr_event_create_io_event(ngr_event_t *ev, int fd, int mask,
-    ngr_event_io_event_handler *handler, void *data)
+/*
+ * A fd has either io handlers or a batch handler. A registration of the
+ * other kind must cover every direction already registered, it then
+ * replaces the old one.
+ */
+static int ngr_event_register(ngr_event_t *ev, int fd, int mask,
+    ngr_event_io_event_handler *handler,
+    ngr_event_io_batch_handler *batch_handler, void *data)
 {
     ngr_event_node_t *node;
+    int rc;
 
-    if (fd >= ev->max_events) return -1;
+    if (fd < 0 || fd >= ev->max_events) return -1;
 
-    /* add fd to event lib */
-    if (ngr_event_lib_add_event(ev, fd, mask) == -1) return -1;
+    /* draining, only the registered fds may change */
+    if (ev->draining && ev->events[fd].mask == NGR_EVENT_NONE) return -1;
 
     node = &ev->events[fd]; /* event node */
+
+    if ((node->mask & ~mask)
+        && (node->batch_handler == NULL) != (batch_handler == NULL))
+    {
+        return -1;
+    }
+
+    /* add fd to event lib, paused directions stay paused */
+    rc = ngr_event_lib_add_event(ev, fd, mask & ~node->throttled);
+
+    if (rc == NGR_EVENT_LIB_STALE) {
+        /* the old registration is gone, this one starts over */
+        node->gen++;
+        if (!node->pinned) ev->busy--;
+        node->mask = NGR_EVENT_NONE;
+        node->throttled = 0;
+        node->rev_handler = NULL;
+        node->wev_handler = NULL;
+        node->batch_handler = NULL;
+
+        rc = ngr_event_lib_add_event(ev, fd, mask);
+    }
+
+    if (rc == -1) {
+        return -1;
+    }
+
+    if (node->mask == NGR_EVENT_NONE) { /* new registration */
+        node->priority = NGR_EVENT_PRIORITY_NORMAL;
+        node->pinned = 0;
+        ev->busy++;
+        node->dispatched = 0;
+        node->rlimit = NULL;
+        node->wlimit = NULL;
+    }
+
     node->mask |= mask;
     node->fd = fd;
     node->data = data;
+    node->batch_handler = batch_handler;
 
     if (mask & NGR_EVENT_READABLE) node->rev_handler = handler;
-    if (mask & NGR_EVENT_WRITABLE) node->rev_handler = handler;
+    if (mask & NGR_EVENT_WRITABLE) node->wev_handler = handler;
 
     if (fd > ev->max_fd) ev->max_fd = fd;
 
@@ -154,11 +429,41 @@ int ngr_event_create_io_event(ngr_event_t *ev, int fd, int mask,
 }
 
 
+int ngr_event_create_io_event(ngr_event_t *ev, int fd, int mask,
+    ngr_event_io_event_handler *handler, void *data)
+{
+    return ngr_event_register(ev, fd, mask, handler, NULL, data);
+}
+
+
+/*
+ * Like ngr_event_create_io_event(), but the ready fds sharing a batch
+ * handler are collected and passed to it in one call per dispatch pass,
+ * so the handler can process (and issue syscalls for) them together.
+ */
+int ngr_event_create_io_batch_event(ngr_event_t *ev, int fd, int mask,
+    ngr_event_io_batch_handler *handler, void *data)
+{
+    if (handler == NULL) return -1;
+
+    if (ev->ready == NULL) {
+        size_t size = ev->max_events * sizeof(ngr_event_ready_t);
+
+        ev->ready = ngr_event_alloc(ev->node, size);
+        if (ev->ready == NULL) {
+            return -1;
+        }
+    }
+
+    return ngr_event_register(ev, fd, mask, NULL, handler, data);
+}
+
+
 void ngr_event_del_io_event(ngr_event_t *ev, int fd, int mask)
 {
     ngr_event_node_t *node;
 
-    if (fd >= ev->max_events) return;
+    if (fd < 0 || fd >= ev->max_events) return;
 
     node = &ev->events[fd];
 
@@ -168,6 +473,12 @@ void ngr_event_del_io_event(ngr_event_t *ev, int fd, int mask)
     ngr_event_lib_del_event(ev, fd, mask);
 
     node->mask = node->mask & (~mask);
+    node->throttled &= node->mask;
+
+    if (node->mask == NGR_EVENT_NONE) { /* pending fired entries go stale */
+        node->gen++;
+        if (!node->pinned) ev->busy--;
+    }
 
     if (fd == ev->max_fd && node->mask == NGR_EVENT_NONE) {
         int j;
@@ -179,163 +490,1212 @@ void ngr_event_del_io_event(ngr_event_t *ev, int fd, int mask)
 }
 
 
-int ngr_event_create_timer(ngr_event_t *ev, int64_t timeout,
-    ngr_event_timer_handler *handler, void *data,
-    ngr_event_destroy_handler *destroy)
+/*
+ * Unregister fd and close it. Use it instead of close(), a fd closed
+ * while registered leaves the epoll set and the fd table out of sync,
+ * and its events still pending in the current pass would be dispatched
+ * to the next connection given the same fd number.
+ */
+int ngr_event_close_fd(ngr_event_t *ev, int fd)
 {
-    ngr_event_timer_t *node;
+    if (fd >= 0) {
+        ngr_event_del_io_event(ev, fd, NGR_EVENT_READABLE|NGR_EVENT_WRITABLE);
+    }
 
-    if (ev->free_timers_count > 0) {
-        node = ev->free_timers;
-        ev->free_timers = node->next;
-        ev->free_timers_count--;
+    return close(fd);
+}
 
-    } else {
-        node = malloc(sizeof(*node));
-        if (node == NULL) {
-            return -1;
-        }
-    }
 
-    node->handler = handler;
-    node->data = data;
-    node->destroy = destroy; /* destroy data handler */
+/* a new registration starts at normal priority, set it afterwards */
+int ngr_event_set_priority(ngr_event_t *ev, int fd, int priority)
+{
+    if (fd < 0 || fd >= ev->max_events) return -1;
 
-    rbtree_node_init(&node->timer);
-    node->timer.key = ngr_event_current_time() + timeout;
-    node->timer.data = node; /* which timer belong to */
+    if (ev->events[fd].mask == NGR_EVENT_NONE) return -1;
 
-    rbtree_insert(&ev->timer, &node->timer);
+    if (priority < NGR_EVENT_PRIORITY_HIGH
+        || priority > NGR_EVENT_PRIORITY_LOW)
+    {
+        return -1;
+    }
+
+    ev->events[fd].priority = priority;
 
     return 0;
 }
 
 
-static int ngr_event_process_timers(ngr_event_t *ev)
+/*
+ * Mark a fd as owned by the library (signal, notification and listening
+ * fds), pinned fds stay on their loop when connections are migrated.
+ */
+void ngr_event_pin(ngr_event_t *ev, int fd)
 {
-    struct rbnode *min_node;
-    ngr_event_timer_t *timer;
-    int64_t now, timeout;
-    int processed = 0;
-
-    while (1) {
-
-        min_node = rbtree_min(&ev->timer); /* find the min timer node */
-        if (min_node == NULL) {
-            break;
-        }
+    if (fd < 0 || fd >= ev->max_events) return;
 
-        now = ngr_event_current_time();
+    if (ev->events[fd].mask != NGR_EVENT_NONE && !ev->events[fd].pinned) {
+        ev->busy--;
+    }
 
-        if (min_node->key <= now) { /* timeout */
+    ev->events[fd].pinned = 1;
+}
 
-            timer = min_node->data;
-            timeout = timer->handler(ev, timer->data);
 
-            rbtree_delete(&ev->timer, min_node);
+/* credit is kept in millionths of a byte, capped at burst bytes */
+static void ngr_event_limit_refill(ngr_event_limit_t *lim)
+{
+    int64_t now = ngr_event_current_usec();
+    int64_t full = lim->burst * 1000000;
+    int64_t elapsed = now - lim->last;
 
-            if (timeout > 0) {  /* if had new timeout, we reinit this node */
-                min_node->key = ngr_event_current_time() + timeout;
-                min_node->data = timer;
-                rbtree_insert(&ev->timer, min_node);
+    lim->last = now;
 
-            } else {
-                if (timer->destroy) {
-                    timer->destroy(timer->data);
-                }
+    if (elapsed <= 0) {
+        return;
+    }
 
-                if (ev->free_timers_count < NGR_FREE_TIMERS_COUNT) {
-                    timer->next = ev->free_timers;
-                    ev->free_timers = timer;
-                    ev->free_timers_count++;
-                } else {
-                    free(timer);
-                }
-            }
+    /* compared before multiplying, a long idle time can't overflow */
+    if (elapsed >= (full - lim->credit) / lim->rate) {
+        lim->credit = full;
+    } else {
+        lim->credit += elapsed * lim->rate;
+    }
+}
 
-            processed++;
-            continue;
-        }
 
-        break;
+/* less than a quantum of credit, a bucket in credit costs no clock read */
+static inline int ngr_event_limit_empty(ngr_event_limit_t *lim)
+{
+    if (lim->credit >= lim->quantum) {
+        return 0;
     }
 
-    return processed;
+    ngr_event_limit_refill(lim);
+
+    return lim->credit < lim->quantum;
 }
 
 
-int ngr_event_process_events(ngr_event_t *ev, int dont_wait)
+/* msec until the bucket holds a quantum again */
+static int64_t ngr_event_limit_delay(ngr_event_limit_t *lim)
 {
-    struct rbnode *min_node;
-    struct timeval tv, *tvp;
-    int num_events, j, processed = 0;
+    int64_t usec = (lim->quantum - lim->credit) / lim->rate;
 
-    min_node = rbtree_min(&ev->timer); /* find the min timer node */
+    return usec < 1000 ? 1 : (usec + 999) / 1000;
+}
 
-    if (min_node != NULL) {
 
-        int64_t now = ngr_event_current_time();
-        int64_t remain = min_node->key - now;
+static uint64_t ngr_event_limit_resume(ngr_event_t *ev, void *data)
+{
+    ngr_event_limit_t *lim = data;
+    ngr_event_node_t *node;
+    int i, fd, dir;
 
-        tvp = &tv;
+    if (ngr_event_limit_empty(lim)) { /* still in debt */
+        return ngr_event_limit_delay(lim);
+    }
 
-        if (remain <= 0) {
-            tvp->tv_sec  = 0;
-            tvp->tv_usec = 0;
-        } else {
-            tvp->tv_sec  = remain / 1000;
-            tvp->tv_usec = (remain % 1000) * 1000;
+    for (i = 0; i < lim->nwaiters; i++) {
+        fd = lim->waiters[i];
+        node = &ev->events[fd];
+
+        dir = 0;
+        if ((node->throttled & NGR_EVENT_READABLE) && node->rlimit == lim) {
+            dir |= NGR_EVENT_READABLE;
+        }
+        if ((node->throttled & NGR_EVENT_WRITABLE) && node->wlimit == lim) {
+            dir |= NGR_EVENT_WRITABLE;
         }
 
-    } else {
-        if (dont_wait) { /* non-blocking */
-            tvp = &tv;
-            tvp->tv_sec  = 0;
-            tvp->tv_usec = 0;
-        } else {
-            tvp = NULL;
+        if (dir) {
+            node->throttled &= ~dir;
+            ngr_event_lib_resume(ev, fd, dir);
         }
     }
 
-    num_events = ngr_event_lib_poll(ev, tvp); /* waiting for event lib poll */
+    lim->nwaiters = 0;
+    lim->timer = NULL;
+
+    return 0;
+}
 
-    for (j = 0; j < num_events; j++) {
 
-        ngr_event_node_t *node = &ev->events[ev->fired[j].fd];
-        int mask = ev->fired[j].mask;
-        int fd = ev->fired[j].fd;
-        int rfired = 0;
+/* pause dir of fd until lim has credit again */
+static void ngr_event_limit_pause(ngr_event_t *ev, ngr_event_limit_t *lim,
+    ngr_event_node_t *node, int fd, int dir)
+{
+    lim->throttled++;
 
-        if (node->mask & (mask & NGR_EVENT_READABLE)) { /* readable */
-            rfired = 1;
-            node->rev_handler(ev, fd, node->data, mask);
-        }
+    if (node->throttled & dir) { /* reported by the poll that paused it */
+        return;
+    }
+
+    if (lim->nwaiters == lim->size) {
+        int size = lim->size ? lim->size * 2 : 64;
+        int *waiters = realloc(lim->waiters, size * sizeof(int));
 
-        if (node->mask & (mask & NGR_EVENT_WRITABLE)) { /* writable */
-            if (!rfired || node->wev_handler != node->rev_handler)
-                node->wev_handler(ev, fd, node->data, mask);
+        if (waiters == NULL) {
+            return; /* dispatched anyway on the next poll */
         }
 
-        processed++;
+        lim->waiters = waiters;
+        lim->size = size;
     }
 
-    if (min_node != NULL) { /* process timer events */
-        processed += ngr_event_process_timers(ev);
+    lim->waiters[lim->nwaiters++] = fd;
+
+    node->throttled |= dir;
+    ngr_event_lib_pause(ev, fd, dir);
+
+    if (lim->timer == NULL) {
+        lim->timer = ngr_event_add_timer(ev, ngr_event_limit_delay(lim),
+            ngr_event_limit_resume, lim, NULL);
+    }
+}
+
+
+/* rate in bytes per second, burst the bytes which may go at once */
+int ngr_event_limit_init(ngr_event_limit_t *lim, int64_t rate,
+    int64_t burst)
+{
+    if (rate <= 0 || burst <= 0) {
+        return -1;
     }
 
-    return processed;
+    lim->rate = rate;
+    lim->burst = burst;
+
+    /*
+     * Dispatch in slices of a millisecond of rate at least, or a slow
+     * loop would be woken up for every byte which trickles in.
+     */
+    lim->quantum = rate / 1000;
+    if (lim->quantum > burst) lim->quantum = burst;
+    if (lim->quantum < 1) lim->quantum = 1;
+    lim->quantum *= 1000000;
+
+    lim->credit = burst * 1000000;
+    lim->last = ngr_event_current_usec();
+    lim->timer = NULL;
+    lim->waiters = NULL;
+    lim->nwaiters = 0;
+    lim->size = 0;
+    lim->throttled = 0;
+
+    return 0;
 }
 
 
-void ngr_event_stop(ngr_event_t *ev)
+/* the fds must be detached or closed before */
+void ngr_event_limit_free(ngr_event_t *ev, ngr_event_limit_t *lim)
 {
-    ev->stop = 1;
+    if (lim->timer) {
+        ngr_event_del_timer(ev, lim->timer);
+        lim->timer = NULL;
+    }
+
+    free(lim->waiters);
+    lim->waiters = NULL;
+    lim->nwaiters = 0;
+    lim->size = 0;
 }
 
 
-void ngr_event_loop(ngr_event_t *ev)
+/*
+ * Limit the readable and/or writable dispatch of fd by lim, NULL removes
+ * the limit. A group limit is just the same lim set on many fds.
+ */
+int ngr_event_set_limit(ngr_event_t *ev, int fd, int mask,
+    ngr_event_limit_t *lim)
 {
-    while (!ev->stop) {
-        (void)ngr_event_process_events(ev, 0);
+    ngr_event_node_t *node;
+    int dir;
+
+    if (fd < 0 || fd >= ev->max_events) return -1;
+
+    node = &ev->events[fd];
+
+    if (node->mask == NGR_EVENT_NONE) return -1;
+
+    if (mask & NGR_EVENT_READABLE) node->rlimit = lim;
+    if (mask & NGR_EVENT_WRITABLE) node->wlimit = lim;
+
+    dir = node->throttled & mask;
+
+    if (dir) { /* paused by the previous limit */
+        node->throttled &= ~dir;
+        ngr_event_lib_resume(ev, fd, dir);
+    }
+
+    return 0;
+}
+
+
+/* bytes which may be moved now, 0 or less while in debt */
+int64_t ngr_event_limit_avail(ngr_event_limit_t *lim)
+{
+    ngr_event_limit_refill(lim);
+
+    return lim->credit / 1000000;
+}
+
+
+/* the bucket may go into debt, the fds stay paused until it is paid */
+void ngr_event_limit_consume(ngr_event_limit_t *lim, int64_t bytes)
+{
+    lim->credit -= bytes * 1000000;
+}
+
+
+/* attach a tracer opened with ngr_trace_open(), NULL detaches it */
+void ngr_event_set_trace(ngr_event_t *ev, ngr_trace_t *trace)
+{
+    ev->trace = trace;
+}
+
+
+/*
+ * Limit the io events dispatched by one ngr_event_process_events() call.
+ * Ready fds over the budget are left to the next loop, the backends are
+ * level triggered so they are reported again without being lost. Each
+ * class resumes after the last fd it dispatched, so the fds a poll lists
+ * first can't starve the others.
+ */
+void ngr_event_set_budget(ngr_event_t *ev, int budget)
+{
+    ev->budget = budget > 0 ? budget : 0;
+}
+
+
+/*
+ * Round up keeps millisecond event libs from waking up just before a
+ * deadline and spinning on zero timeout polls until it passes. Precise
+ * asks the event lib for the exact timeout, it fails when the event lib
+ * can't do better than milliseconds.
+ */
+int ngr_event_set_timer_policy(ngr_event_t *ev, int policy)
+{
+    if (policy != NGR_EVENT_TIMER_ROUND_UP
+        && policy != NGR_EVENT_TIMER_PRECISE)
+    {
+        return -1;
+    }
+
+    if (policy == NGR_EVENT_TIMER_PRECISE && !ngr_event_lib_precise(ev)) {
+        return -1;
+    }
+
+    ev->timer_policy = policy;
+
+    return 0;
+}
+
+
+/*
+ * Spin with zero timeout polls for up to usec microseconds before blocking.
+ * In adaptive mode the window follows the recent event arrival: it grows
+ * when events show up shortly after a spin gave up, and halves when the
+ * loop had to block for longer than the whole window.
+ */
+int ngr_event_set_busy_poll(ngr_event_t *ev, int64_t usec, int adaptive)
+{
+    if (usec < 0) return -1;
+
+    /* let the kernel busy poll the device queues too, where supported,
+     * and turn it off again with the spin */
+    if (usec > 0 || ev->spin > 0) {
+        (void)ngr_event_lib_busy_poll(ev, usec);
+    }
+
+    ev->spin = usec;
+    ev->spin_window = usec;
+    ev->spin_adaptive = adaptive ? 1 : 0;
+
+    return 0;
+}
+
+
+int ngr_event_set_socket_busy_poll(int fd, int usec)
+{
+#ifdef SO_BUSY_POLL
+    return setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec));
+#else
+    return -1;
+#endif
+}
+
+
+/*
+ * Like ngr_event_create_timer(), but returns the timer so it can be
+ * cancelled with ngr_event_del_timer() until its handler returns 0.
+ */
+ngr_event_timer_t *ngr_event_add_timer(ngr_event_t *ev, int64_t timeout,
+    ngr_event_timer_handler *handler, void *data,
+    ngr_event_destroy_handler *destroy)
+{
+    ngr_event_timer_t *node;
+
+    if (ev->free_timers_count > 0) {
+        node = ev->free_timers;
+        ev->free_timers = node->next;
+        ev->free_timers_count--;
+
+    } else {
+        node = malloc(sizeof(*node));
+        if (node == NULL) {
+            return NULL;
+        }
+    }
+
+    node->handler = handler;
+    node->data = data;
+    node->destroy = destroy; /* destroy data handler */
+    node->cancelled = 0;
+    node->lateness = 0;
+    node->period = 0;
+
+    rbtree_node_init(&node->timer);
+    node->timer.key = ngr_event_current_usec() + timeout * 1000;
+    node->timer.data = node; /* which timer belong to */
+
+    rbtree_insert(&ev->timer, &node->timer);
+
+    return node;
+}
+
+
+int ngr_event_create_timer(ngr_event_t *ev, int64_t timeout,
+    ngr_event_timer_handler *handler, void *data,
+    ngr_event_destroy_handler *destroy)
+{
+    return ngr_event_add_timer(ev, timeout, handler, data, destroy) ? 0 : -1;
+}
+
+
+static void ngr_event_release_timer(ngr_event_t *ev, ngr_event_timer_t *timer)
+{
+    if (timer->destroy) {
+        timer->destroy(timer->data);
+    }
+
+    if (ev->free_timers_count < NGR_FREE_TIMERS_COUNT) {
+        timer->next = ev->free_timers;
+        ev->free_timers = timer;
+        ev->free_timers_count++;
+    } else {
+        free(timer);
+    }
+}
+
+
+void ngr_event_del_timer(ngr_event_t *ev, ngr_event_timer_t *node)
+{
+    if (node == ev->running_timer) { /* released when the handler returns */
+        node->cancelled = 1;
+        return;
+    }
+
+    rbtree_delete(&ev->timer, &node->timer);
+    ngr_event_release_timer(ev, node);
+}
+
+
+static uint64_t ngr_event_bucket_tick(ngr_event_t *ev, void *data)
+{
+    ngr_event_bucket_t *bucket = data;
+    ngr_event_timer_t *timer = ev->running_timer;
+    ngr_event_periodic_t *p;
+    int ticks = 1;
+
+    if (bucket->policy == NGR_EVENT_PERIODIC_SKIP) {
+        ticks += timer->lateness / timer->period;
+    }
+
+    /* the cursor keeps the walk valid when handlers delete members */
+    for (p = bucket->members; p; p = bucket->cursor) {
+        bucket->cursor = p->next;
+        p->handler(ev, ticks, p->data);
+    }
+
+    bucket->cursor = NULL;
+
+    return ticks; /* periods to the next deadline */
+}
+
+
+static void ngr_event_bucket_free(void *data)
+{
+    ngr_event_bucket_t *bucket = data;
+    ngr_event_bucket_t **prev;
+    ngr_event_periodic_t *p;
+
+    for (prev = &bucket->ev->buckets; *prev; prev = &(*prev)->next) {
+        if (*prev == bucket) {
+            *prev = bucket->next;
+            break;
+        }
+    }
+
+    while (bucket->members) {
+        p = bucket->members;
+        bucket->members = p->next;
+        if (p->destroy) p->destroy(p->data);
+        free(p);
+    }
+
+    free(bucket);
+}
+
+
+/*
+ * Runs handler every period milliseconds. Deadlines are anchored to the
+ * first one, so handler and poll times don't make the timer drift. The
+ * periodic timers with the same period and policy share one bucket timer,
+ * a tick costs one tree operation however many of them there are. A new
+ * timer joins the bucket phase, its first run is at most one period away.
+ */
+ngr_event_periodic_t *ngr_event_add_periodic(ngr_event_t *ev, int64_t period,
+    int policy, ngr_event_periodic_handler *handler, void *data,
+    ngr_event_destroy_handler *destroy)
+{
+    ngr_event_bucket_t *bucket;
+    ngr_event_periodic_t *p;
+
+    if (period <= 0
+        || (policy != NGR_EVENT_PERIODIC_CATCH_UP
+            && policy != NGR_EVENT_PERIODIC_SKIP))
+    {
+        return NULL;
+    }
+
+    for (bucket = ev->buckets; bucket; bucket = bucket->next) {
+        if (bucket->timer && bucket->period == period
+            && bucket->policy == policy)
+        {
+            break;
+        }
+    }
+
+    p = malloc(sizeof(*p));
+    if (p == NULL) {
+        return NULL;
+    }
+
+    if (bucket == NULL) {
+        bucket = malloc(sizeof(*bucket));
+        if (bucket == NULL) {
+            free(p);
+            return NULL;
+        }
+
+        bucket->ev = ev;
+        bucket->period = period;
+        bucket->policy = policy;
+        bucket->members = NULL;
+        bucket->cursor = NULL;
+
+        bucket->timer = ngr_event_add_timer(ev, period,
+            ngr_event_bucket_tick, bucket, ngr_event_bucket_free);
+        if (bucket->timer == NULL) {
+            free(bucket);
+            free(p);
+            return NULL;
+        }
+
+        bucket->timer->period = period * 1000;
+
+        bucket->next = ev->buckets;
+        ev->buckets = bucket;
+    }
+
+    p->handler = handler;
+    p->destroy = destroy;
+    p->data = data;
+    p->bucket = bucket;
+    p->prev = NULL;
+    p->next = bucket->members;
+
+    if (bucket->members) bucket->members->prev = p;
+    bucket->members = p;
+
+    return p;
+}
+
+
+void ngr_event_del_periodic(ngr_event_t *ev, ngr_event_periodic_t *p)
+{
+    ngr_event_bucket_t *bucket = p->bucket;
+
+    if (bucket->cursor == p) bucket->cursor = p->next;
+
+    if (p->prev) p->prev->next = p->next;
+    else bucket->members = p->next;
+
+    if (p->next) p->next->prev = p->prev;
+
+    if (p->destroy) p->destroy(p->data);
+    free(p);
+
+    if (bucket->members == NULL) { /* the bucket timer frees the bucket */
+        ngr_event_timer_t *timer = bucket->timer;
+
+        bucket->timer = NULL;
+        ngr_event_del_timer(ev, timer);
+    }
+}
+
+
+int ngr_event_create_signal(ngr_event_t *ev, int signo,
+    ngr_event_signal_handler *handler, void *data)
+{
+    if (signo <= 0 || signo >= NSIG) return -1;
+
+    if (ev->signals == NULL) {
+        ev->signals = ngr_event_alloc(ev->node,
+                                      NSIG * sizeof(ngr_event_signal_t));
+        if (ev->signals == NULL) {
+            return -1;
+        }
+    }
+
+    if (ev->signals[signo].handler == NULL
+        && ngr_event_lib_add_signal(ev, signo) == -1)
+    {
+        return -1;
+    }
+
+    ev->signals[signo].handler = handler;
+    ev->signals[signo].data = data;
+    ev->signals[signo].count = 0;
+
+    return 0;
+}
+
+
+void ngr_event_del_signal(ngr_event_t *ev, int signo)
+{
+    if (signo <= 0 || signo >= NSIG) return;
+
+    if (ev->signals == NULL || ev->signals[signo].handler == NULL) return;
+
+    ngr_event_lib_del_signal(ev, signo);
+
+    ev->signals[signo].handler = NULL;
+    ev->signals[signo].count = 0;
+}
+
+
+static void ngr_event_reap_child(ngr_event_t *ev, ngr_event_child_t *child,
+    int status)
+{
+    ngr_event_child_t **prev;
+
+    for (prev = &ev->children; *prev != child; prev = &(*prev)->next) {
+        /* void */
+    }
+
+    *prev = child->next;
+
+    if (child->fd != -1) {
+        ngr_event_close_fd(ev, child->fd);
+    }
+
+    child->handler(ev, child->pid, status, child->data);
+    free(child);
+}
+
+
+#if defined(HAVE_EPOLL) && defined(SYS_pidfd_open)
+static void ngr_event_pidfd_handler(ngr_event_t *ev, int fd, void *data,
+    int mask)
+{
+    ngr_event_child_t *child = data;
+    int status;
+    pid_t rc;
+
+    rc = waitpid(child->pid, &status, WNOHANG);
+
+    if (rc == child->pid) {
+        ngr_event_reap_child(ev, child, status);
+
+    } else if (rc == -1 && errno == ECHILD) { /* reaped by someone else */
+        ngr_event_reap_child(ev, child, -1);
+    }
+}
+#endif
+
+
+static void ngr_event_sigchld_handler(ngr_event_t *ev, int signo, int count,
+    void *data)
+{
+    ngr_event_child_t *child, *next;
+    int status;
+    pid_t rc;
+
+    /* one SIGCHLD may stand for several exits, check every watched child */
+    for (child = ev->children; child; child = next) {
+        next = child->next;
+
+        if (child->fd != -1) continue;
+
+        rc = waitpid(child->pid, &status, WNOHANG);
+
+        if (rc == child->pid) {
+            ngr_event_reap_child(ev, child, status);
+
+        } else if (rc == -1 && errno == ECHILD) {
+            ngr_event_reap_child(ev, child, -1);
+        }
+    }
+}
+
+
+/*
+ * Watch a child process exit. On Linux a pidfd is registered as a normal
+ * readable fd, elsewhere the children are checked on SIGCHLD. The handler
+ * receives the waitpid() status, the child is reaped by the loop. The
+ * status is -1 when the child was reaped by someone else.
+ */
+int ngr_event_create_child(ngr_event_t *ev, pid_t pid,
+    ngr_event_child_handler *handler, void *data)
+{
+    ngr_event_child_t *child;
+
+    child = malloc(sizeof(*child));
+    if (child == NULL) {
+        return -1;
+    }
+
+    child->pid = pid;
+    child->fd = -1;
+    child->handler = handler;
+    child->data = data;
+
+#if defined(HAVE_EPOLL) && defined(SYS_pidfd_open)
+    child->fd = syscall(SYS_pidfd_open, pid, 0);
+
+    if (child->fd != -1
+        && ngr_event_create_io_event(ev, child->fd, NGR_EVENT_READABLE,
+               ngr_event_pidfd_handler, child) == -1)
+    {
+        close(child->fd);
+        child->fd = -1;
+    }
+
+    if (child->fd != -1) {
+        ngr_event_pin(ev, child->fd);
+    }
+#endif
+
+    if (child->fd == -1
+        && (ev->signals == NULL || ev->signals[SIGCHLD].handler == NULL)
+        && ngr_event_create_signal(ev, SIGCHLD, ngr_event_sigchld_handler,
+               NULL) == -1)
+    {
+        free(child);
+        return -1;
+    }
+
+    child->next = ev->children;
+    ev->children = child;
+
+    return 0;
+}
+
+
+static int ngr_event_process_signals(ngr_event_t *ev)
+{
+    ngr_event_signal_t *sig;
+    int signo, count, processed = 0;
+    int64_t start;
+
+    ev->signal_pending = 0;
+
+    for (signo = 1; signo < NSIG; signo++) {
+        sig = &ev->signals[signo];
+
+        if (sig->count == 0 || sig->handler == NULL) continue;
+
+        count = sig->count;
+        sig->count = 0;
+
+        start = ngr_trace_begin(ev);
+        sig->handler(ev, signo, count, sig->data);
+        ngr_trace_end(ev, NGR_TRACE_SIGNAL, signo, start);
+        processed++;
+    }
+
+    return processed;
+}
+
+
+static int ngr_event_process_timers(ngr_event_t *ev)
+{
+    struct rbnode *min_node;
+    ngr_event_timer_t *timer;
+    int64_t now, timeout, start, deadline;
+    int processed = 0;
+
+    while (1) {
+
+        min_node = rbtree_min(&ev->timer); /* find the min timer node */
+        if (min_node == NULL) {
+            break;
+        }
+
+        now = ngr_event_current_usec();
+
+        if (min_node->key <= now) { /* timeout */
+
+            timer = min_node->data;
+
+            deadline = min_node->key;
+            timer->lateness = now - deadline;
+
+            rbtree_delete(&ev->timer, min_node);
+
+            ev->stats.timers_fired++;
+            ev->stats.timer_lateness += timer->lateness;
+            if (timer->lateness > ev->stats.timer_lateness_max) {
+                ev->stats.timer_lateness_max = timer->lateness;
+            }
+
+            ev->running_timer = timer;
+            start = ngr_trace_begin(ev);
+            timeout = timer->handler(ev, timer->data);
+            ngr_trace_end(ev, NGR_TRACE_TIMER, (intptr_t)timer, start);
+            ev->running_timer = NULL;
+
+            if (timer->cancelled) { /* deleted by its own handler */
+                timeout = 0;
+            }
+
+            if (timeout > 0) {  /* if had new timeout, we reinit this node */
+                if (timer->period) { /* fixed rate, timeout counts periods */
+                    min_node->key = deadline + timeout * timer->period;
+                } else {
+                    min_node->key = ngr_event_current_usec() + timeout * 1000;
+                }
+
+                min_node->data = timer;
+                rbtree_insert(&ev->timer, min_node);
+
+            } else {
+                ngr_event_release_timer(ev, timer);
+            }
+
+            processed++;
+            continue;
+        }
+
+        break;
+    }
+
+    return processed;
+}
+
+
+static void ngr_event_dispatch(ngr_event_t *ev, ngr_event_node_t *node,
+    int fd, int mask)
+{
+    int rfired = 0;
+    int64_t start;
+
+    if ((mask & node->mask & NGR_EVENT_READABLE) && node->rlimit
+        && ngr_event_limit_empty(node->rlimit))
+    {
+        ngr_event_limit_pause(ev, node->rlimit, node, fd, NGR_EVENT_READABLE);
+        mask &= ~NGR_EVENT_READABLE;
+    }
+
+    if ((mask & node->mask & NGR_EVENT_WRITABLE) && node->wlimit
+        && ngr_event_limit_empty(node->wlimit))
+    {
+        ngr_event_limit_pause(ev, node->wlimit, node, fd, NGR_EVENT_WRITABLE);
+        mask &= ~NGR_EVENT_WRITABLE;
+    }
+
+    if (mask == 0) {
+        return;
+    }
+
+    node->dispatched++;
+
+    if (node->batch_handler) { /* deferred to the end of the pass */
+        ev->ready[ev->nready].fd = fd;
+        ev->ready[ev->nready].mask = mask;
+        ev->ready[ev->nready].gen = node->gen;
+        ev->nready++;
+        return;
+    }
+
+    start = ngr_trace_begin(ev);
+
+    if (node->mask & (mask & NGR_EVENT_READABLE)) { /* readable */
+        rfired = 1;
+        node->rev_handler(ev, fd, node->data, mask);
+    }
+
+    if (node->mask & (mask & NGR_EVENT_WRITABLE)) { /* writable */
+        if (!rfired || node->wev_handler != node->rev_handler)
+            node->wev_handler(ev, fd, node->data, mask);
+    }
+
+    ngr_trace_end(ev, NGR_TRACE_IO, fd, start);
+}
+
+
+static int ngr_event_poll(ngr_event_t *ev, struct timeval *tvp)
+{
+    struct timeval zero;
+    int64_t start, now, window, timeout, blocked;
+    int num_events;
+
+    if (ev->spin == 0) {
+        start = ngr_event_current_usec();
+        num_events = ngr_event_lib_poll(ev, tvp);
+        ev->stats.block_time += ngr_event_current_usec() - start;
+        return num_events;
+    }
+
+    window = ev->spin_window;
+    timeout = tvp ? (int64_t)tvp->tv_sec * 1000000 + tvp->tv_usec : -1;
+
+    if (timeout >= 0 && window > timeout) { /* never spin past the timeout */
+        window = timeout;
+    }
+
+    zero.tv_sec = 0;
+    zero.tv_usec = 0;
+
+    start = ngr_event_current_usec();
+    now = start;
+
+    do {
+        num_events = ngr_event_lib_poll(ev, &zero);
+        now = ngr_event_current_usec();
+    } while (num_events == 0 && now - start < window);
+
+    ev->stats.spin_time += now - start;
+
+    if (num_events > 0) {
+        ev->stats.spin_hits++;
+
+        if (ev->spin_adaptive && ev->spin_window < ev->spin) {
+            ev->spin_window *= 2;
+            if (ev->spin_window > ev->spin) ev->spin_window = ev->spin;
+        }
+
+        return num_events;
+    }
+
+    if (timeout >= 0) {
+        timeout -= now - start; /* the spin consumed part of the timeout */
+
+        if (timeout <= 0) {
+            return 0;
+        }
+
+        tvp->tv_sec = timeout / 1000000;
+        tvp->tv_usec = timeout % 1000000;
+    }
+
+    ev->stats.spin_miss++;
+
+    num_events = ngr_event_lib_poll(ev, tvp);
+
+    blocked = ngr_event_current_usec() - now;
+    ev->stats.block_time += blocked;
+
+    if (ev->spin_adaptive) {
+        if (num_events > 0 && ev->spin_window + blocked <= ev->spin) {
+            ev->spin_window += blocked; /* the next spin would catch it */
+
+        } else if (ev->spin_window > NGR_SPIN_MIN_WINDOW) {
+            ev->spin_window /= 2;
+        }
+    }
+
+    return num_events;
+}
+
+
+/*
+ * Group the collected batch events by handler and call every handler once
+ * with its group. Fds unregistered (or closed and reused) by an earlier
+ * handler are dropped.
+ */
+static void ngr_event_dispatch_batches(ngr_event_t *ev)
+{
+    ngr_event_io_batch_handler *handler;
+    ngr_event_ready_t *ready = ev->ready, tmp;
+    ngr_event_node_t *node;
+    int start, j, n, total = ev->nready;
+    int64_t trace;
+
+    ev->nready = 0;
+
+    for (start = 0; start < total; start += n) {
+
+        handler = NULL;
+        n = 0;
+
+        for (j = start; j < total; j++) {
+            node = &ev->events[ready[j].fd];
+
+            if (ready[j].gen != node->gen) {
+                ready[j].mask = 0;
+            }
+
+            ready[j].mask &= node->mask;
+
+            if (ready[j].mask == 0 || node->batch_handler == NULL) {
+                continue;
+            }
+
+            if (handler == NULL) handler = node->batch_handler;
+
+            if (node->batch_handler != handler) continue;
+
+            ready[j].data = node->data;
+
+            /* move it next to the others of its group */
+            tmp = ready[start + n];
+            ready[start + n] = ready[j];
+            ready[j] = tmp;
+            n++;
+        }
+
+        if (handler == NULL) { /* nothing left to dispatch */
+            break;
+        }
+
+        trace = ngr_trace_begin(ev);
+        handler(ev, ready + start, n);
+        ngr_trace_end(ev, NGR_TRACE_BATCH, n, trace);
+    }
+}
+
+
+int ngr_event_process_events(ngr_event_t *ev, int dont_wait)
+{
+    struct rbnode *min_node;
+    struct timeval tv, *tvp;
+    int num_events, j, k, first, budget, priority, lowest, processed = 0;
+    int64_t start, trace, deadline = 0;
+
+    min_node = rbtree_min(&ev->timer); /* find the min timer node */
+
+    if (min_node != NULL) {
+
+        int64_t now = ngr_event_current_usec();
+        int64_t remain = min_node->key - now;
+
+        tvp = &tv;
+
+        if (remain <= 0) {
+            tvp->tv_sec  = 0;
+            tvp->tv_usec = 0;
+        } else {
+            tvp->tv_sec  = remain / 1000000;
+            tvp->tv_usec = remain % 1000000;
+            deadline = min_node->key;
+        }
+
+    } else {
+        if (dont_wait) { /* non-blocking */
+            tvp = &tv;
+            tvp->tv_sec  = 0;
+            tvp->tv_usec = 0;
+        } else {
+            tvp = NULL;
+        }
+    }
+
+    trace = ngr_trace_begin(ev);
+    num_events = ngr_event_poll(ev, tvp); /* waiting for event lib poll */
+    ngr_trace_end(ev, NGR_TRACE_POLL, num_events, trace);
+
+    /* the event lib returned before the nearest timer expired */
+    if (num_events == 0 && deadline > ngr_event_current_usec()) {
+        ev->stats.early_wakeups++;
+    }
+
+    start = num_events > 0 ? ngr_event_current_usec() : 0;
+    budget = ev->budget > 0 ? ev->budget : num_events;
+    lowest = NGR_EVENT_PRIORITY_HIGH;
+
+    /*
+     * Dispatch the fired events class by class, so listening sockets and
+     * control channels are served before bulk transfers. Every pass after
+     * the first only runs when the previous one saw a lower class.
+     */
+    for (priority = NGR_EVENT_PRIORITY_HIGH;
+         priority <= lowest && budget > 0;
+         priority++)
+    {
+        first = ev->cursor[priority] < num_events ? ev->cursor[priority] : 0;
+
+        for (k = 0; k < num_events && budget > 0; k++) {
+
+            int mask;
+            ngr_event_node_t *node;
+
+            j = first + k;
+            if (j >= num_events) j -= num_events;
+
+            node = ngr_event_lib_fired(ev, j, &mask);
+
+            if (node == NULL) { /* the fd was unregistered meanwhile */
+                continue;
+            }
+
+            if (node->priority != priority) {
+                if (node->priority > lowest) lowest = node->priority;
+                continue;
+            }
+
+            ngr_event_dispatch(ev, node, node->fd, mask);
+
+            budget--;
+            processed++;
+
+            if (budget == 0) { /* the rest of the class goes first next */
+                ev->cursor[priority] = j + 1;
+            }
+        }
+
+        if (ev->nready > 0) {
+            ngr_event_dispatch_batches(ev);
+        }
+    }
+
+    if (num_events > 0) {
+        ev->stats.busy_time += ngr_event_current_usec() - start;
+        ev->stats.dispatched += processed;
+    }
+
+    if (ev->signal_pending) { /* process coalesced signals */
+        processed += ngr_event_process_signals(ev);
+    }
+
+    if (min_node != NULL) { /* process timer events */
+        processed += ngr_event_process_timers(ev);
+    }
+
+    return processed;
+}
+
+
+/*
+ * Interrupt a blocking ngr_event_process_events(), safe to call from any
+ * thread and from signal handlers.
+ */
+void ngr_event_wakeup(ngr_event_t *ev)
+{
+    uint64_t one = 1;
+
+    (void)write(ev->wakeup[1], &one, sizeof(one));
+
+#ifdef NGR_EVENT_SIM
+    ngr_sim_wakeup(ev);
+#endif
+}
+
+
+void ngr_event_stop(ngr_event_t *ev)
+{
+    ev->stop = 1;
+    ngr_event_wakeup(ev);
+}
+
+
+static uint64_t ngr_event_drain_expired(ngr_event_t *ev, void *data)
+{
+    ev->drain_timer = NULL;
+    ev->drain_expired = 1;
+    return 0;
+}
+
+
+static void ngr_event_wakeup_handler(ngr_event_t *ev, int fd, void *data,
+    int mask)
+{
+    char buf[64];
+
+    while (read(fd, buf, sizeof(buf)) > 0) { /* void */ }
+
+    if (!ev->drain) {
+        return;
+    }
+
+    /* requests made while draining join the drain in progress */
+    ev->drain = 0;
+
+    if (!ev->draining) {
+        ev->draining = 1;
+
+        if (ev->drain_timeout > 0) {
+            ev->drain_timer = ngr_event_add_timer(ev, ev->drain_timeout,
+                ngr_event_drain_expired, NULL, NULL);
+        }
+
+        if (ev->drain_handler) {
+            ev->drain_handler(ev, ev->drain_data);
+        }
+    }
+}
+
+
+/*
+ * The drain handler runs in the loop thread when draining starts, it
+ * should close the listening sockets so no new connections come in.
+ */
+void ngr_event_set_drain_handler(ngr_event_t *ev,
+    ngr_event_drain_handler *handler, void *data)
+{
+    ev->drain_handler = handler;
+    ev->drain_data = data;
+}
+
+
+/*
+ * Ask ngr_event_loop() to return once the connections in flight are gone,
+ * or after timeout milliseconds (0 waits for them forever). New io events
+ * are refused meanwhile, the loop can be run again afterwards. Pending
+ * timers are kept, ngr_event_destroy() runs their destroy handlers. Safe
+ * to call from any thread and from signal handlers.
+ */
+void ngr_event_drain(ngr_event_t *ev, int64_t timeout)
+{
+    ev->drain_timeout = timeout;
+    ev->drain = 1;
+    ngr_event_wakeup(ev);
+}
+
+
+void ngr_event_loop(ngr_event_t *ev)
+{
+    while (!ev->stop) {
+        (void)ngr_event_process_events(ev, 0);
+
+        if (ev->draining && (ev->busy == 0 || ev->drain_expired)) {
+            break;
+        }
+    }
+
+    /*
+     * Drained, the loop may be run again. The pending timers stay, the
+     * library holds handles to some of them, ngr_event_destroy() releases
+     * them.
+     */
+    if (ev->draining) {
+        if (ev->drain_timer) {
+            ngr_event_del_timer(ev, ev->drain_timer);
+            ev->drain_timer = NULL;
+        }
+
+        ev->draining = 0;
+        ev->drain_expired = 0;
     }
 }
@@ -30,10 +30,19 @@
 #ifndef _NGR_EVENT_H
 #define _NGR_EVENT_H
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <signal.h>
+#include <sys/types.h>
 #include "ngr_rbtree.h"
+#include "ngr_trace.h"
 
 
-#if defined(__FreeBSD__)
+#if defined(NGR_EVENT_SIM)
+/* in memory event lib, see ngr_sim.c */
+#elif defined(__FreeBSD__)
 # define HAVE_KQUEUE   1
 #elif defined(linux)
 # define HAVE_EPOLL    1
@@ -42,26 +51,76 @@
 
 #define NGR_DEFAULT_EVENTS     10240
 #define NGR_FREE_TIMERS_COUNT  1000
+#define NGR_SPIN_MIN_WINDOW    1      /* usec */
+#define NGR_PREFETCH_DISTANCE  4      /* fired nodes prefetched ahead */
+#define NGR_CACHELINE_SIZE     64
+
+#if defined(__GNUC__)
+# define ngr_prefetch(p)  __builtin_prefetch(p)
+#else
+# define ngr_prefetch(p)
+#endif
 
 #define NGR_EVENT_NONE      0
 #define NGR_EVENT_READABLE  1
 #define NGR_EVENT_WRITABLE  2
 
+/* dispatch classes, lower value is dispatched first */
+#define NGR_EVENT_PRIORITY_HIGH    0
+#define NGR_EVENT_PRIORITY_NORMAL  1
+#define NGR_EVENT_PRIORITY_LOW     2
+
+/* what a periodic timer does with the ticks it was too late for */
+#define NGR_EVENT_PERIODIC_CATCH_UP  0  /* run them back to back */
+#define NGR_EVENT_PERIODIC_SKIP      1  /* run once, ticks tells how many */
+
+/* how poll timeouts are fit to the event lib resolution */
+#define NGR_EVENT_TIMER_ROUND_UP   0  /* never wake up before the deadline */
+#define NGR_EVENT_TIMER_PRECISE    1  /* sub msec timeouts when possible */
+
 typedef unsigned char ngr_uint8_t;
 typedef struct ngr_event_s ngr_event_t;
 typedef struct ngr_event_timer_s ngr_event_timer_t;
+typedef struct ngr_event_periodic_s ngr_event_periodic_t;
+typedef struct ngr_event_bucket_s ngr_event_bucket_t;
+typedef struct ngr_event_limit_s ngr_event_limit_t;
 
 typedef void ngr_event_io_event_handler(ngr_event_t *ev, int fd, void *data,
     int mask);
+
+typedef struct ngr_event_ready_s {
+    int fd;
+    void *data;
+    int mask;
+    uint32_t gen;         /* registration it fired for, internal */
+} ngr_event_ready_t;
+
+typedef void ngr_event_io_batch_handler(ngr_event_t *ev,
+    ngr_event_ready_t *ready, int nready);
 typedef uint64_t ngr_event_timer_handler(ngr_event_t *ev, void *data);
 typedef void ngr_event_destroy_handler(void *data);
+typedef void ngr_event_periodic_handler(ngr_event_t *ev, int ticks,
+    void *data);
+typedef void ngr_event_signal_handler(ngr_event_t *ev, int signo, int count,
+    void *data);
+typedef void ngr_event_child_handler(ngr_event_t *ev, pid_t pid, int status,
+    void *data);
+typedef void ngr_event_drain_handler(ngr_event_t *ev, void *data);
 
 
 typedef struct ngr_event_node_s {
     int mask;
     int fd;
+    int priority;
+    int pinned;           /* owned by the library, never migrated */
+    uint64_t dispatched;  /* handler calls, for load balancing */
+    int throttled;        /* directions paused by their rate limit */
+    uint32_t gen;         /* bumped when the fd is unregistered */
+    ngr_event_limit_t *rlimit;
+    ngr_event_limit_t *wlimit;
     ngr_event_io_event_handler *rev_handler;
     ngr_event_io_event_handler *wev_handler;
+    ngr_event_io_batch_handler *batch_handler; /* set for batch events */
     void *data;
 } ngr_event_node_t;
 
@@ -69,43 +128,193 @@ typedef struct ngr_event_node_s {
 typedef struct ngr_event_fired_s {
     int fd;
     int mask;
+    uint32_t gen;
 } ngr_event_fired_t;
 
 
+typedef struct ngr_event_signal_s {
+    ngr_event_signal_handler *handler;
+    void *data;
+    int count;  /* deliveries coalesced since the last dispatch */
+} ngr_event_signal_t;
+
+
+typedef struct ngr_event_child_s ngr_event_child_t;
+
+struct ngr_event_child_s {
+    pid_t pid;
+    int fd;     /* pidfd, -1 when watched through SIGCHLD */
+    ngr_event_child_handler *handler;
+    void *data;
+    ngr_event_child_t *next;
+};
+
+
+typedef struct ngr_event_stats_s {
+    int64_t spin_time;   /* usec spent in zero timeout polls */
+    int64_t block_time;  /* usec spent blocked in the event lib */
+    uint64_t spin_hits;  /* polls which found events while spinning */
+    uint64_t spin_miss;  /* spin windows which ended up blocking */
+    int64_t busy_time;   /* usec spent dispatching io events */
+    uint64_t dispatched; /* io events dispatched */
+    uint64_t timers_fired;
+    int64_t timer_lateness;     /* usec between deadlines and handler runs */
+    int64_t timer_lateness_max;
+    uint64_t early_wakeups;     /* polls returned before the nearest timer */
+} ngr_event_stats_t;
+
+
 struct ngr_event_timer_s {
     ngr_event_timer_handler *handler;
     ngr_event_destroy_handler *destroy;
     void *data;
+    int cancelled;           /* deleted from its own handler */
+    int64_t lateness;        /* usec the last run started after deadline */
+    int64_t period;          /* usec, fixed rate schedule when not 0 */
     ngr_event_timer_t *next; /* free next */
     struct rbnode timer;
 };
 
 
+struct ngr_event_periodic_s {
+    ngr_event_periodic_handler *handler;
+    ngr_event_destroy_handler *destroy;
+    void *data;
+    ngr_event_bucket_t *bucket;
+    ngr_event_periodic_t *prev;
+    ngr_event_periodic_t *next;
+};
+
+
+/* the periodic timers sharing a period and policy, run by one timer */
+struct ngr_event_bucket_s {
+    ngr_event_t *ev;
+    int64_t period;                /* msec */
+    int policy;
+    ngr_event_timer_t *timer;      /* NULL once the bucket is deleted */
+    ngr_event_periodic_t *members;
+    ngr_event_periodic_t *cursor;  /* next member to run in a tick */
+    ngr_event_bucket_t *next;
+};
+
+
+/*
+ * Token bucket shared by any number of fds and directions. Handlers
+ * report the bytes they moved with ngr_event_limit_consume(), while the
+ * bucket is empty the fds are paused in the event lib and the loop
+ * resumes them from one timer per bucket.
+ */
+struct ngr_event_limit_s {
+    int64_t rate;            /* bytes per second */
+    int64_t burst;           /* bytes */
+    int64_t credit;          /* bytes * 1000000, negative while in debt */
+    int64_t quantum;         /* credit needed to dispatch */
+    int64_t last;            /* usec of the last refill */
+    ngr_event_timer_t *timer;
+    int *waiters;            /* paused fds, stale entries are skipped */
+    int nwaiters;
+    int size;
+    uint64_t throttled;      /* dispatches held back */
+};
+
+
 struct ngr_event_s {
+    int cpu;          /* the loop thread is bound to, -1 when not placed */
+    int node;         /* NUMA node of the loop tables, -1 when unknown */
     int max_fd;
     int max_events;
+    int busy;         /* registered fds not pinned, connections in flight */
+    int budget;       /* max io events dispatched per loop, 0 unlimited */
+    int cursor[NGR_EVENT_PRIORITY_LOW + 1]; /* where a class resumes */
+    int timer_policy;
+    int64_t spin;        /* max busy poll window in usec, 0 disabled */
+    int64_t spin_window; /* current busy poll window in usec */
     ngr_event_node_t *events;
-    ngr_event_fired_t *fired;
+    ngr_event_ready_t *ready;      /* batch events of the current pass */
+    int nready;
     struct rbtree timer;
     struct rbnode sentinel;
     ngr_event_timer_t *free_timers; /* cache timer nodes */
+    ngr_event_timer_t *running_timer;
+    ngr_event_bucket_t *buckets;
     int free_timers_count;
+    ngr_event_signal_t *signals;   /* indexed by signo, NSIG entries */
+    ngr_event_child_t *children;
+    int signal_pending;
     void *ctx;
-    ngr_uint8_t stop:1;
+    ngr_event_stats_t stats;
+    ngr_trace_t *trace;            /* NULL when not tracing */
+    int wakeup[2];                 /* wakeup[0] is watched by the loop */
+    ngr_event_drain_handler *drain_handler;
+    void *drain_data;
+    volatile int64_t drain_timeout;
+    ngr_event_timer_t *drain_timer; /* ends a drain after its timeout */
+    volatile sig_atomic_t drain;   /* drain requested */
+    volatile sig_atomic_t stop;    /* may be set from any thread */
+    ngr_uint8_t spin_adaptive:1;
+    ngr_uint8_t draining:1;        /* new io events are refused */
+    ngr_uint8_t drain_expired:1;
 };
 
 
 ngr_event_t *ngr_event_new(int max_events);
+ngr_event_t *ngr_event_new_on(int max_events, int cpu);
+void ngr_event_destroy(ngr_event_t *ev);
 int ngr_event_create_io_event(ngr_event_t *ev, int fd, int mask,
     ngr_event_io_event_handler *handler, void *data);
 void ngr_event_del_io_event(ngr_event_t *ev, int fd, int mask);
+int ngr_event_close_fd(ngr_event_t *ev, int fd);
+int ngr_event_create_io_batch_event(ngr_event_t *ev, int fd, int mask,
+    ngr_event_io_batch_handler *handler, void *data);
+int ngr_event_set_priority(ngr_event_t *ev, int fd, int priority);
+void ngr_event_set_budget(ngr_event_t *ev, int budget);
+int ngr_event_set_timer_policy(ngr_event_t *ev, int policy);
+void ngr_event_pin(ngr_event_t *ev, int fd);
+int ngr_event_limit_init(ngr_event_limit_t *lim, int64_t rate,
+    int64_t burst);
+void ngr_event_limit_free(ngr_event_t *ev, ngr_event_limit_t *lim);
+int ngr_event_set_limit(ngr_event_t *ev, int fd, int mask,
+    ngr_event_limit_t *lim);
+int64_t ngr_event_limit_avail(ngr_event_limit_t *lim);
+void ngr_event_limit_consume(ngr_event_limit_t *lim, int64_t bytes);
+void ngr_event_set_trace(ngr_event_t *ev, ngr_trace_t *trace);
+int ngr_event_set_busy_poll(ngr_event_t *ev, int64_t usec, int adaptive);
+int ngr_event_set_socket_busy_poll(int fd, int usec);
 int ngr_event_create_timer(ngr_event_t *ev, int64_t timeout,
     ngr_event_timer_handler *handler, void *data,
     ngr_event_destroy_handler *destroy);
+ngr_event_timer_t *ngr_event_add_timer(ngr_event_t *ev, int64_t timeout,
+    ngr_event_timer_handler *handler, void *data,
+    ngr_event_destroy_handler *destroy);
 void ngr_event_del_timer(ngr_event_t *ev, ngr_event_timer_t *node);
+ngr_event_periodic_t *ngr_event_add_periodic(ngr_event_t *ev, int64_t period,
+    int policy, ngr_event_periodic_handler *handler, void *data,
+    ngr_event_destroy_handler *destroy);
+void ngr_event_del_periodic(ngr_event_t *ev, ngr_event_periodic_t *p);
+int ngr_event_create_signal(ngr_event_t *ev, int signo,
+    ngr_event_signal_handler *handler, void *data);
+void ngr_event_del_signal(ngr_event_t *ev, int signo);
+int ngr_event_create_child(ngr_event_t *ev, pid_t pid,
+    ngr_event_child_handler *handler, void *data);
 int ngr_event_process_events(ngr_event_t *ev, int dont_wait);
+void ngr_event_wakeup(ngr_event_t *ev);
 void ngr_event_stop(ngr_event_t *ev);
+void ngr_event_set_drain_handler(ngr_event_t *ev,
+    ngr_event_drain_handler *handler, void *data);
+void ngr_event_drain(ngr_event_t *ev, int64_t timeout);
 void ngr_event_loop(ngr_event_t *ev);
 char *ngr_event_lib_name();
 
+#ifdef NGR_EVENT_SIM
+int ngr_sim_inject(ngr_event_t *ev, int64_t at, int fd, int mask);
+void ngr_sim_signal(ngr_event_t *ev, int signo);
+int64_t ngr_sim_now(void);
+void ngr_sim_advance(int64_t usec);
+int ngr_sim_pending(ngr_event_t *ev);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
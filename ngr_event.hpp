@@ -0,0 +1,532 @@
+/*
+ * Copyright (c) 2012-2013, Liexusong <liexusong at qq dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * C++20 front-end: RAII handles for io registrations and timers, and
+ * coroutine awaitables resumed from ngr_event_process_events().
+ *
+ *   ngr::task echo(ngr::loop &l, int fd)
+ *   {
+ *       while (co_await ngr::readable(l, fd) > 0) {
+ *           ...
+ *           co_await ngr::sleep(l, 10);
+ *       }
+ *   }
+ *
+ * A coroutine returning ngr::task whose first parameter is a ngr::loop,
+ * followed by at most four others, gets its frame from that loop's frame
+ * pool instead of the heap. Tasks start eagerly and free themselves when
+ * they finish; they must finish before their loop is destroyed. Handlers
+ * run from C and must not throw.
+ */
+
+#ifndef _NGR_EVENT_HPP
+#define _NGR_EVENT_HPP
+
+#include <cerrno>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "ngr_event.h"
+
+
+namespace ngr {
+
+
+class io_awaitable;
+
+
+/*
+ * Size-classed free lists for coroutine frames. Every frame carries a
+ * header naming its pool, frames from the plain heap have none.
+ */
+class frame_pool {
+public:
+    static constexpr std::size_t granularity = 64;
+    static constexpr std::size_t classes = 16;  /* frames up to 1 KiB */
+
+    frame_pool() noexcept = default;
+    frame_pool(const frame_pool &) = delete;
+    frame_pool &operator=(const frame_pool &) = delete;
+
+    ~frame_pool()
+    {
+        for (std::size_t i = 0; i < classes; i++) {
+            while (free_[i]) {
+                block *b = free_[i];
+                free_[i] = b->next;
+                ::operator delete(b);
+            }
+        }
+    }
+
+    static void *allocate(frame_pool *pool, std::size_t n)
+    {
+        std::size_t cls = (n + sizeof(header) + granularity - 1) / granularity;
+        header *h;
+
+        if (pool && cls <= classes && pool->free_[cls - 1]) {
+            block *b = pool->free_[cls - 1];
+            pool->free_[cls - 1] = b->next;
+            h = reinterpret_cast<header *>(b);
+
+        } else {
+            if (pool == nullptr || cls > classes) {
+                pool = nullptr;
+                h = static_cast<header *>(
+                        ::operator new(n + sizeof(header)));
+            } else {
+                h = static_cast<header *>(::operator new(cls * granularity));
+            }
+        }
+
+        h->pool = pool;
+        h->cls = cls;
+
+        return h + 1;
+    }
+
+    static void deallocate(void *p) noexcept
+    {
+        header *h = static_cast<header *>(p) - 1;
+        frame_pool *pool = h->pool;
+
+        if (pool == nullptr) {
+            ::operator delete(h);
+            return;
+        }
+
+        block *b = reinterpret_cast<block *>(h);
+        b->next = pool->free_[h->cls - 1];
+        pool->free_[h->cls - 1] = b;
+    }
+
+private:
+    struct alignas(std::max_align_t) header {
+        frame_pool *pool;
+        std::size_t cls;
+    };
+
+    struct block {
+        block *next;
+    };
+
+    block *free_[classes] = {};
+};
+
+
+class loop {
+public:
+    explicit loop(int max_events = 0) : ev_(ngr_event_new(max_events))
+    {
+        if (ev_ == nullptr) {
+            throw std::bad_alloc();
+        }
+    }
+
+    /* binds the calling thread to cpu, construct on the loop thread */
+    loop(int max_events, int cpu) : ev_(ngr_event_new_on(max_events, cpu))
+    {
+        if (ev_ == nullptr) {
+            throw std::system_error(errno, std::generic_category());
+        }
+    }
+
+    ~loop() { ngr_event_destroy(ev_); }
+
+    loop(const loop &) = delete;
+    loop &operator=(const loop &) = delete;
+
+    ngr_event_t *get() const noexcept { return ev_; }
+    frame_pool &frames() noexcept { return frames_; }
+
+    int process(bool dont_wait = false)
+    {
+        return ngr_event_process_events(ev_, dont_wait ? 1 : 0);
+    }
+
+    void run() { ngr_event_loop(ev_); }
+    void stop() noexcept { ngr_event_stop(ev_); }
+    void drain(int64_t timeout) noexcept { ngr_event_drain(ev_, timeout); }
+
+private:
+    friend class io_awaitable;
+
+    /* the coroutines suspended on a fd, one per direction */
+    struct awaiters {
+        io_awaitable *reader = nullptr;
+        io_awaitable *writer = nullptr;
+    };
+
+    awaiters *awaiting(int fd)
+    {
+        if (fd < 0 || fd >= ev_->max_events) {
+            return nullptr;
+        }
+
+        if (awaiters_.empty()) {
+            awaiters_.resize(ev_->max_events);
+        }
+
+        return &awaiters_[fd];
+    }
+
+    ngr_event_t *ev_;
+    frame_pool frames_;
+    std::vector<awaiters> awaiters_;
+};
+
+
+/*
+ * Keeps fd registered with f(fd, mask) as handler while alive. The handle
+ * is the callback context, so it can be neither copied nor moved.
+ */
+template <class F>
+class io_watch {
+public:
+    io_watch(loop &l, int fd, int mask, F f)
+        : ev_(l.get()), fd_(fd), mask_(mask), f_(std::move(f))
+    {
+        if (ngr_event_create_io_event(ev_, fd_, mask_, &io_watch::dispatch,
+                                      this) == -1)
+        {
+            throw std::runtime_error("ngr_event_create_io_event failed");
+        }
+    }
+
+    ~io_watch() { ngr_event_del_io_event(ev_, fd_, mask_); }
+
+    io_watch(const io_watch &) = delete;
+    io_watch &operator=(const io_watch &) = delete;
+
+    int fd() const noexcept { return fd_; }
+
+private:
+    static void dispatch(ngr_event_t *, int fd, void *data, int mask) noexcept
+    {
+        static_cast<io_watch *>(data)->f_(fd, mask);
+    }
+
+    ngr_event_t *ev_;
+    int fd_;
+    int mask_;
+    F f_;
+};
+
+
+/*
+ * Calls f() after timeout milliseconds, f returns the next timeout or 0
+ * to stop. Destroying the handle (even from f) cancels the timer.
+ */
+template <class F>
+class timer {
+public:
+    timer(loop &l, int64_t timeout, F f) : ev_(l.get()), f_(std::move(f))
+    {
+        node_ = ngr_event_add_timer(ev_, timeout, &timer::fire, this,
+                                    &timer::finished);
+        if (node_ == nullptr) {
+            throw std::bad_alloc();
+        }
+    }
+
+    ~timer() { cancel(); }
+
+    timer(const timer &) = delete;
+    timer &operator=(const timer &) = delete;
+
+    bool active() const noexcept { return node_ != nullptr; }
+
+    void cancel() noexcept
+    {
+        ngr_event_timer_t *node = node_;
+
+        if (node) {
+            node_ = nullptr;
+            node->destroy = nullptr; /* this may be gone when it runs */
+            ngr_event_del_timer(ev_, node);
+        }
+    }
+
+private:
+    static uint64_t fire(ngr_event_t *, void *data) noexcept
+    {
+        return static_cast<timer *>(data)->f_();
+    }
+
+    static void finished(void *data) noexcept
+    {
+        static_cast<timer *>(data)->node_ = nullptr;
+    }
+
+    ngr_event_t *ev_;
+    ngr_event_timer_t *node_;
+    F f_;
+};
+
+
+class task {
+public:
+    struct promise_type {
+    private:
+        /* binds to any coroutine argument without copying it */
+        struct any {
+            template <class T>
+            any(T &&) noexcept {}
+        };
+
+    public:
+        task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+
+        /*
+         * Frames of coroutines whose first parameter is a loop come from
+         * its pool. These overloads are not templates so that gcc pairs
+         * them with the sized delete below, coroutines with more than
+         * four other parameters get their frames from the heap.
+         */
+        static void *operator new(std::size_t n, loop &l)
+        {
+            return frame_pool::allocate(&l.frames(), n);
+        }
+
+        static void *operator new(std::size_t n, loop &l, any)
+        {
+            return frame_pool::allocate(&l.frames(), n);
+        }
+
+        static void *operator new(std::size_t n, loop &l, any, any)
+        {
+            return frame_pool::allocate(&l.frames(), n);
+        }
+
+        static void *operator new(std::size_t n, loop &l, any, any, any)
+        {
+            return frame_pool::allocate(&l.frames(), n);
+        }
+
+        static void *operator new(std::size_t n, loop &l, any, any, any,
+                                  any)
+        {
+            return frame_pool::allocate(&l.frames(), n);
+        }
+
+        static void *operator new(std::size_t n)
+        {
+            return frame_pool::allocate(nullptr, n);
+        }
+
+        static void operator delete(void *p, std::size_t) noexcept
+        {
+            frame_pool::deallocate(p);
+        }
+    };
+};
+
+
+/*
+ * Suspends until fd is ready, the result is the ready mask or -1 when the
+ * fd could not be registered or another coroutine already waits for the
+ * same direction. A reader and a writer may wait on one fd at once. The
+ * registration only lasts one wakeup, other handlers must not be mixed
+ * with awaitables on the same fd. Destroying a suspended coroutine
+ * removes the registration it waits on.
+ */
+class io_awaitable {
+public:
+    io_awaitable(loop &l, int fd, int mask) noexcept
+        : loop_(&l), fd_(fd), mask_(mask), result_(-1), pending_(false) {}
+
+    ~io_awaitable()
+    {
+        if (pending_) {
+            ngr_event_del_io_event(loop_->get(), fd_, mask_);
+            release(loop_->awaiting(fd_));
+        }
+    }
+
+    io_awaitable(const io_awaitable &) = delete;
+    io_awaitable &operator=(const io_awaitable &) = delete;
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        loop::awaiters *w = loop_->awaiting(fd_);
+
+        if (w == nullptr
+            || ((mask_ & NGR_EVENT_READABLE) && w->reader)
+            || ((mask_ & NGR_EVENT_WRITABLE) && w->writer))
+        {
+            return false;
+        }
+
+        /* the data of a fd is shared by its directions, so it is the loop */
+        if (ngr_event_create_io_event(loop_->get(), fd_, mask_,
+                                      &io_awaitable::resume, loop_) == -1)
+        {
+            return false;
+        }
+
+        if (mask_ & NGR_EVENT_READABLE) w->reader = this;
+        if (mask_ & NGR_EVENT_WRITABLE) w->writer = this;
+
+        handle_ = h;
+        pending_ = true;
+
+        return true;
+    }
+
+    int await_resume() const noexcept { return result_; }
+
+private:
+    static void resume(ngr_event_t *, int fd, void *data, int mask) noexcept
+    {
+        loop::awaiters *w = static_cast<loop *>(data)->awaiting(fd);
+        io_awaitable *reader = (mask & NGR_EVENT_READABLE) ? w->reader
+                                                            : nullptr;
+        io_awaitable *writer = (mask & NGR_EVENT_WRITABLE) ? w->writer
+                                                            : nullptr;
+
+        if (reader) {
+            reader->wake(w, mask);
+        }
+
+        /* unless the reader was waiting for both, or gone with its peer */
+        if (writer && writer != reader && w->writer == writer) {
+            writer->wake(w, mask);
+        }
+    }
+
+    void wake(loop::awaiters *w, int mask) noexcept
+    {
+        ngr_event_del_io_event(loop_->get(), fd_, mask_);
+        release(w);
+
+        pending_ = false;
+        result_ = mask & mask_;
+        handle_.resume();
+    }
+
+    void release(loop::awaiters *w) noexcept
+    {
+        if (w->reader == this) w->reader = nullptr;
+        if (w->writer == this) w->writer = nullptr;
+    }
+
+    loop *loop_;
+    int fd_;
+    int mask_;
+    int result_;
+    bool pending_;
+    std::coroutine_handle<> handle_;
+};
+
+
+/*
+ * Suspends for ms milliseconds. Destroying a suspended coroutine cancels
+ * the timer it waits on.
+ */
+class sleep_awaitable {
+public:
+    sleep_awaitable(loop &l, int64_t ms) noexcept
+        : ev_(l.get()), ms_(ms), node_(nullptr) {}
+
+    ~sleep_awaitable()
+    {
+        if (node_) {
+            ngr_event_del_timer(ev_, node_);
+        }
+    }
+
+    sleep_awaitable(const sleep_awaitable &) = delete;
+    sleep_awaitable &operator=(const sleep_awaitable &) = delete;
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h) noexcept
+    {
+        handle_ = h;
+        node_ = ngr_event_add_timer(ev_, ms_, &sleep_awaitable::fire, this,
+                                    nullptr);
+
+        /* resume right away if no timer could be allocated */
+        return node_ != nullptr;
+    }
+
+    void await_resume() const noexcept {}
+
+private:
+    static uint64_t fire(ngr_event_t *, void *data) noexcept
+    {
+        sleep_awaitable *self = static_cast<sleep_awaitable *>(data);
+
+        /* the loop frees the node once this returns 0 */
+        self->node_ = nullptr;
+        self->handle_.resume();
+
+        return 0;
+    }
+
+    ngr_event_t *ev_;
+    int64_t ms_;
+    ngr_event_timer_t *node_;
+    std::coroutine_handle<> handle_;
+};
+
+
+inline io_awaitable readable(loop &l, int fd) noexcept
+{
+    return io_awaitable(l, fd, NGR_EVENT_READABLE);
+}
+
+inline io_awaitable writable(loop &l, int fd) noexcept
+{
+    return io_awaitable(l, fd, NGR_EVENT_WRITABLE);
+}
+
+inline sleep_awaitable sleep(loop &l, int64_t ms) noexcept
+{
+    return sleep_awaitable(l, ms);
+}
+
+
+} /* namespace ngr */
+
+#endif
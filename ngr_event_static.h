@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2012-2013, Liexusong <liexusong at qq dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Compile time specialized event loop.
+ *
+ * NGR_EVENT_STATIC_DEFINE(name, io_handler, timer_handler) generates a
+ * loop type name_t and static inline functions around it, with the epoll
+ * backend, a binary heap timer engine and both handlers fixed at compile
+ * time, so the compiler can inline the whole dispatch path. The handlers
+ * have the signatures:
+ *
+ *   void io_handler(name_t *lp, int fd, void *data, int mask);
+ *   uint64_t timer_handler(name_t *lp, void *data);
+ *
+ * Both handlers must be static functions of the including file. Like
+ * ngr_event_create_timer(), a timer handler returning a positive timeout
+ * is rescheduled. There is one io handler per loop, use the data pointer
+ * to tell connections apart.
+ */
+
+#ifndef _NGR_EVENT_STATIC_H
+#define _NGR_EVENT_STATIC_H
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "ngr_event.h"
+
+#ifndef HAVE_EPOLL
+# error "ngr_event_static.h requires epoll"
+#endif
+
+#include <sys/epoll.h>
+
+
+typedef struct ngr_event_static_node_s {
+    int fd;
+    int mask;
+    void *data;
+} ngr_event_static_node_t;
+
+
+typedef struct ngr_event_static_timer_s {
+    int64_t key;
+    void *data;
+} ngr_event_static_timer_t;
+
+
+static inline int64_t ngr_event_static_time()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
+#define NGR_EVENT_STATIC_DEFINE(name, io_handler, timer_handler)              \
+                                                                              \
+typedef struct name##_s name##_t;                                             \
+                                                                              \
+static void io_handler(name##_t *lp, int fd, void *data, int mask);           \
+static uint64_t timer_handler(name##_t *lp, void *data);                      \
+                                                                              \
+struct name##_s {                                                             \
+    int epfd;                                                                 \
+    int max_events;                                                           \
+    ngr_event_static_node_t *nodes;                                           \
+    struct epoll_event *events;                                               \
+    ngr_event_static_timer_t *timers;   /* binary min heap */                 \
+    int ntimers;                                                              \
+    int max_timers;                                                           \
+    int stop;                                                                 \
+};                                                                            \
+                                                                              \
+static inline int name##_init(name##_t *lp, int max_events)                   \
+{                                                                             \
+    int i;                                                                    \
+                                                                              \
+    if (max_events <= 0) max_events = NGR_DEFAULT_EVENTS;                     \
+                                                                              \
+    lp->max_events = max_events;                                              \
+    lp->ntimers = 0;                                                          \
+    lp->max_timers = 0;                                                       \
+    lp->timers = NULL;                                                        \
+    lp->stop = 0;                                                             \
+                                                                              \
+    lp->nodes = malloc(max_events * sizeof(ngr_event_static_node_t));         \
+    lp->events = malloc(max_events * sizeof(struct epoll_event));             \
+    lp->epfd = epoll_create(1024);                                            \
+                                                                              \
+    if (!lp->nodes || !lp->events || lp->epfd == -1) {                        \
+        free(lp->nodes);                                                      \
+        free(lp->events);                                                     \
+        if (lp->epfd != -1) close(lp->epfd);                                  \
+        return -1;                                                            \
+    }                                                                         \
+                                                                              \
+    for (i = 0; i < max_events; i++) {                                        \
+        lp->nodes[i].fd = i;                                                  \
+        lp->nodes[i].mask = NGR_EVENT_NONE;                                   \
+    }                                                                         \
+                                                                              \
+    return 0;                                                                 \
+}                                                                             \
+                                                                              \
+static inline void name##_free(name##_t *lp)                                  \
+{                                                                             \
+    close(lp->epfd);                                                          \
+    free(lp->nodes);                                                          \
+    free(lp->events);                                                         \
+    free(lp->timers);                                                         \
+}                                                                             \
+                                                                              \
+static inline int name##_ctl(name##_t *lp, int fd, int mask, int old)         \
+{                                                                             \
+    struct epoll_event ee;                                                    \
+    int op;                                                                   \
+                                                                              \
+    ee.events = 0;                                                            \
+    if (mask & NGR_EVENT_READABLE) ee.events |= EPOLLIN;                      \
+    if (mask & NGR_EVENT_WRITABLE) ee.events |= EPOLLOUT;                     \
+    ee.data.ptr = &lp->nodes[fd];                                             \
+                                                                              \
+    if (mask == NGR_EVENT_NONE) {                                             \
+        op = EPOLL_CTL_DEL;                                                   \
+    } else {                                                                  \
+        op = old == NGR_EVENT_NONE ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;           \
+    }                                                                         \
+                                                                              \
+    return epoll_ctl(lp->epfd, op, fd, &ee);                                  \
+}                                                                             \
+                                                                              \
+static inline int name##_add(name##_t *lp, int fd, int mask, void *data)      \
+{                                                                             \
+    ngr_event_static_node_t *node;                                            \
+                                                                              \
+    if (fd >= lp->max_events) return -1;                                      \
+                                                                              \
+    node = &lp->nodes[fd];                                                    \
+                                                                              \
+    if (name##_ctl(lp, fd, node->mask | mask, node->mask) == -1) return -1;   \
+                                                                              \
+    node->mask |= mask;                                                       \
+    node->data = data;                                                        \
+                                                                              \
+    return 0;                                                                 \
+}                                                                             \
+                                                                              \
+static inline void name##_del(name##_t *lp, int fd, int mask)                 \
+{                                                                             \
+    ngr_event_static_node_t *node;                                            \
+                                                                              \
+    if (fd >= lp->max_events) return;                                         \
+                                                                              \
+    node = &lp->nodes[fd];                                                    \
+                                                                              \
+    if (node->mask == NGR_EVENT_NONE) return;                                 \
+                                                                              \
+    (void)name##_ctl(lp, fd, node->mask & ~mask, node->mask);                 \
+    node->mask &= ~mask;                                                      \
+}                                                                             \
+                                                                              \
+static inline void name##_timer_up(name##_t *lp, int i)                       \
+{                                                                             \
+    ngr_event_static_timer_t t = lp->timers[i];                               \
+                                                                              \
+    while (i > 0 && lp->timers[(i - 1) / 2].key > t.key) {                    \
+        lp->timers[i] = lp->timers[(i - 1) / 2];                              \
+        i = (i - 1) / 2;                                                      \
+    }                                                                         \
+                                                                              \
+    lp->timers[i] = t;                                                        \
+}                                                                             \
+                                                                              \
+static inline void name##_timer_down(name##_t *lp, int i)                     \
+{                                                                             \
+    ngr_event_static_timer_t t = lp->timers[i];                               \
+    int child;                                                                \
+                                                                              \
+    while ((child = 2 * i + 1) < lp->ntimers) {                               \
+        if (child + 1 < lp->ntimers                                           \
+            && lp->timers[child + 1].key < lp->timers[child].key)             \
+        {                                                                     \
+            child++;                                                          \
+        }                                                                     \
+        if (t.key <= lp->timers[child].key) break;                            \
+        lp->timers[i] = lp->timers[child];                                    \
+        i = child;                                                            \
+    }                                                                         \
+                                                                              \
+    lp->timers[i] = t;                                                        \
+}                                                                             \
+                                                                              \
+static inline int name##_timer(name##_t *lp, int64_t timeout, void *data)     \
+{                                                                             \
+    ngr_event_static_timer_t *timers;                                         \
+                                                                              \
+    if (lp->ntimers == lp->max_timers) {                                      \
+        int size = lp->max_timers ? lp->max_timers * 2 : 64;                  \
+                                                                              \
+        timers = realloc(lp->timers, size * sizeof(*timers));                 \
+        if (timers == NULL) return -1;                                        \
+                                                                              \
+        lp->timers = timers;                                                  \
+        lp->max_timers = size;                                                \
+    }                                                                         \
+                                                                              \
+    lp->timers[lp->ntimers].key = ngr_event_static_time() + timeout;          \
+    lp->timers[lp->ntimers].data = data;                                      \
+    name##_timer_up(lp, lp->ntimers++);                                       \
+                                                                              \
+    return 0;                                                                 \
+}                                                                             \
+                                                                              \
+static inline int name##_process_timers(name##_t *lp)                         \
+{                                                                             \
+    int64_t now = ngr_event_static_time();                                    \
+    uint64_t timeout;                                                         \
+    int processed = 0;                                                        \
+                                                                              \
+    while (lp->ntimers > 0 && lp->timers[0].key <= now) {                     \
+                                                                              \
+        timeout = timer_handler(lp, lp->timers[0].data);                      \
+                                                                              \
+        if (timeout > 0) { /* reschedule in place */                          \
+            lp->timers[0].key = ngr_event_static_time() + timeout;            \
+        } else {                                                              \
+            lp->timers[0] = lp->timers[--lp->ntimers];                        \
+        }                                                                     \
+                                                                              \
+        if (lp->ntimers > 0) name##_timer_down(lp, 0);                        \
+                                                                              \
+        processed++;                                                          \
+    }                                                                         \
+                                                                              \
+    return processed;                                                         \
+}                                                                             \
+                                                                              \
+static inline int name##_process(name##_t *lp, int dont_wait)                 \
+{                                                                             \
+    ngr_event_static_node_t *node;                                            \
+    struct epoll_event *e;                                                    \
+    int timeout, n, j, mask;                                                  \
+                                                                              \
+    if (lp->ntimers > 0) {                                                    \
+        int64_t remain = lp->timers[0].key - ngr_event_static_time();         \
+        timeout = remain > 0 ? (int)remain : 0;                               \
+    } else {                                                                  \
+        timeout = dont_wait ? 0 : -1;                                         \
+    }                                                                         \
+                                                                              \
+    n = epoll_wait(lp->epfd, lp->events, lp->max_events, timeout);           \
+                                                                              \
+    for (j = 0; j < n; j++) {                                                 \
+        e = lp->events + j;                                                   \
+        node = e->data.ptr;                                                   \
+                                                                              \
+        if (j + NGR_PREFETCH_DISTANCE < n) {                                  \
+            ngr_prefetch(lp->events[j + NGR_PREFETCH_DISTANCE].data.ptr);     \
+        }                                                                     \
+                                                                              \
+        mask = 0;                                                             \
+        if (e->events & EPOLLIN)  mask |= NGR_EVENT_READABLE;                 \
+        if (e->events & EPOLLOUT) mask |= NGR_EVENT_WRITABLE;                 \
+                                                                              \
+        if (node->mask & mask) {                                              \
+            io_handler(lp, node->fd, node->data, mask & node->mask);          \
+        }                                                                     \
+    }                                                                         \
+                                                                              \
+    if (n < 0) n = 0;                                                         \
+                                                                              \
+    return n + name##_process_timers(lp);                                     \
+}                                                                             \
+                                                                              \
+static inline void name##_stop(name##_t *lp)                                  \
+{                                                                             \
+    lp->stop = 1;                                                             \
+}                                                                             \
+                                                                              \
+static inline void name##_loop(name##_t *lp)                                  \
+{                                                                             \
+    while (!lp->stop) {                                                       \
+        (void)name##_process(lp, 0);                                          \
+    }                                                                         \
+}
+
+#endif
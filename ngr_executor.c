@@ -0,0 +1,573 @@
+/*
+ * Copyright (c) 2012-2013, Liexusong <liexusong at qq dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "ngr_executor.h"
+
+
+static int64_t ngr_executor_current_usec()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+static ngr_executor_task_t *ngr_executor_pop(ngr_executor_worker_t *w)
+{
+    ngr_executor_task_t *task;
+
+    pthread_mutex_lock(&w->lock);
+
+    task = w->head;
+    if (task) {
+        w->head = task->next;
+        if (w->head) {
+            w->head->prev = NULL;
+        } else {
+            w->tail = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&w->lock);
+
+    return task;
+}
+
+
+static ngr_executor_task_t *ngr_executor_steal(ngr_executor_worker_t *w)
+{
+    ngr_executor_task_t *task;
+
+    if (pthread_mutex_trylock(&w->lock) != 0) { /* busy, try another one */
+        return NULL;
+    }
+
+    task = w->tail;
+    if (task) {
+        w->tail = task->prev;
+        if (w->tail) {
+            w->tail->next = NULL;
+        } else {
+            w->head = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&w->lock);
+
+    return task;
+}
+
+
+/*
+ * The owner loop may be busy and its channel full, the continuation then
+ * waits in the overflow list of the loop. The empty message makes the
+ * loop look at the list. When it can't be sent either, the channel is
+ * still full and the loop looks at the list with its next message anyway.
+ */
+static void ngr_executor_complete(ngr_executor_task_t *task)
+{
+    ngr_executor_loop_t *lp = task->owner;
+
+    if (ngr_channel_send(lp->channel, task) == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&lp->overflow_lock);
+    task->next = lp->overflow;
+    lp->overflow = task;
+    atomic_store(&lp->overflowed, 1);
+    pthread_mutex_unlock(&lp->overflow_lock);
+
+    (void)ngr_channel_send(lp->channel, NULL);
+}
+
+
+/* runs the continuations waiting in the overflow list, in the loop thread */
+static void ngr_executor_overflow(ngr_event_t *ev, ngr_executor_loop_t *lp)
+{
+    ngr_executor_task_t *batch, *task, *next;
+
+    if (atomic_load(&lp->overflowed) == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&lp->overflow_lock);
+    batch = lp->overflow;
+    lp->overflow = NULL;
+    atomic_store(&lp->overflowed, 0);
+    pthread_mutex_unlock(&lp->overflow_lock);
+
+    /* the list is newest first, reverse it to complete in order */
+    for (task = batch, batch = NULL; task; task = next) {
+        next = task->next;
+        task->next = batch;
+        batch = task;
+    }
+
+    for (task = batch; task; task = next) {
+        next = task->next;
+        task->done(ev, task->data);
+        free(task);
+    }
+}
+
+
+static void *ngr_executor_worker(void *arg)
+{
+    ngr_executor_worker_t *self = arg;
+    ngr_executor_t *ex = self->ex;
+    ngr_executor_task_t *task;
+    int i, id = self - ex->workers;
+
+    for ( ;; ) {
+
+        task = ngr_executor_pop(self);
+
+        for (i = 1; task == NULL && i < ex->nworkers; i++) {
+            task = ngr_executor_steal(&ex->workers[(id + i) % ex->nworkers]);
+            if (task) self->stolen++;
+        }
+
+        if (task) {
+            atomic_fetch_sub(&ex->pending, 1);
+
+            task->work(task->data);
+            self->executed++;
+
+            if (task->done) {
+                ngr_executor_complete(task);
+            } else {
+                free(task);
+            }
+
+            continue;
+        }
+
+        pthread_mutex_lock(&ex->lock);
+
+        if (atomic_load(&ex->pending) == 0) {
+            if (ex->exiting) {
+                pthread_mutex_unlock(&ex->lock);
+                break;
+            }
+
+            ex->sleeping++;
+            pthread_cond_wait(&ex->cond, &ex->lock);
+            ex->sleeping--;
+        }
+
+        pthread_mutex_unlock(&ex->lock);
+    }
+
+    return NULL;
+}
+
+
+static int ngr_executor_register(ngr_event_t *ev, ngr_executor_task_t *task)
+{
+    int rc;
+
+    if (task->batch_handler) {
+        rc = ngr_event_create_io_batch_event(ev, task->fd, task->mask,
+                 task->batch_handler, task->data);
+
+    } else if (task->rev_handler == task->wev_handler
+        || !(task->mask & NGR_EVENT_READABLE)
+        || !(task->mask & NGR_EVENT_WRITABLE))
+    {
+        rc = ngr_event_create_io_event(ev, task->fd, task->mask,
+                 (task->mask & NGR_EVENT_READABLE) ? task->rev_handler
+                                                   : task->wev_handler,
+                 task->data);
+    } else {
+        rc = ngr_event_create_io_event(ev, task->fd, NGR_EVENT_READABLE,
+                 task->rev_handler, task->data);
+        if (rc == 0) {
+            rc = ngr_event_create_io_event(ev, task->fd, NGR_EVENT_WRITABLE,
+                     task->wev_handler, task->data);
+        }
+    }
+
+    if (rc == 0) {
+        ngr_event_set_priority(ev, task->fd, task->priority);
+    } else {
+        ngr_event_del_io_event(ev, task->fd, task->mask);
+    }
+
+    return rc;
+}
+
+
+/*
+ * Runs in the loop which received the message: either the continuation of
+ * a finished task, or a fd migrated from another loop.
+ */
+static void ngr_executor_receive(ngr_event_t *ev, ngr_channel_t *ch,
+    void *msg, void *data)
+{
+    ngr_executor_loop_t *lp = data;
+    ngr_executor_task_t *task = msg;
+
+    ngr_executor_overflow(ev, lp);
+
+    if (task == NULL) { /* only a look at the overflow list */
+        return;
+    }
+
+    if (task->fd == -1) {
+        task->done(ev, task->data);
+        free(task);
+        return;
+    }
+
+    if (ngr_executor_register(ev, task) == 0) {
+        free(task);
+        return;
+    }
+
+    /* send it back where it came from, or give up on the connection */
+    if (task->owner == lp
+        || ngr_channel_send(task->owner->channel, task) == -1)
+    {
+        close(task->fd);
+        free(task);
+    }
+}
+
+
+ngr_executor_t *ngr_executor_new(int threads)
+{
+    ngr_executor_t *ex;
+    int i;
+
+    if (threads <= 0) {
+        threads = NGR_EXECUTOR_DEFAULT_THREADS;
+    }
+
+    ex = calloc(1, sizeof(*ex));
+    if (ex == NULL) {
+        return NULL;
+    }
+
+    ex->workers = calloc(threads, sizeof(ngr_executor_worker_t));
+    if (ex->workers == NULL) {
+        free(ex);
+        return NULL;
+    }
+
+    atomic_init(&ex->next, 0);
+    atomic_init(&ex->pending, 0);
+    pthread_mutex_init(&ex->lock, NULL);
+    pthread_cond_init(&ex->cond, NULL);
+    pthread_mutex_init(&ex->loops_lock, NULL);
+
+    for (i = 0; i < threads; i++) {
+        ex->workers[i].ex = ex;
+        pthread_mutex_init(&ex->workers[i].lock, NULL);
+    }
+
+    /* workers index the array, publish the count before starting them */
+    ex->nworkers = threads;
+
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&ex->workers[i].thread, NULL, ngr_executor_worker,
+                &ex->workers[i]) != 0)
+        {
+            break;
+        }
+    }
+
+    if (i < threads) {
+        pthread_mutex_lock(&ex->lock);
+        ex->exiting = 1;
+        pthread_cond_broadcast(&ex->cond);
+        pthread_mutex_unlock(&ex->lock);
+
+        while (i-- > 0) {
+            pthread_join(ex->workers[i].thread, NULL);
+        }
+
+        free(ex->workers);
+        free(ex);
+        return NULL;
+    }
+
+    return ex;
+}
+
+
+/*
+ * Runs the queued tasks and stops the workers. The continuations of the
+ * last tasks are left in the loop channels: call ngr_executor_detach()
+ * from every attached loop afterwards, which runs them.
+ */
+void ngr_executor_destroy(ngr_executor_t *ex)
+{
+    int i;
+
+    pthread_mutex_lock(&ex->lock);
+    ex->exiting = 1;
+    pthread_cond_broadcast(&ex->cond);
+    pthread_mutex_unlock(&ex->lock);
+
+    for (i = 0; i < ex->nworkers; i++) {
+        pthread_join(ex->workers[i].thread, NULL);
+        pthread_mutex_destroy(&ex->workers[i].lock);
+    }
+
+    pthread_mutex_destroy(&ex->lock);
+    pthread_cond_destroy(&ex->cond);
+    pthread_mutex_destroy(&ex->loops_lock);
+    free(ex->workers);
+    free(ex);
+}
+
+
+/* call from the loop thread, before submitting from it */
+ngr_executor_loop_t *ngr_executor_attach(ngr_executor_t *ex, ngr_event_t *ev)
+{
+    ngr_executor_loop_t *lp;
+
+    lp = calloc(1, sizeof(*lp));
+    if (lp == NULL) {
+        return NULL;
+    }
+
+    lp->ex = ex;
+    lp->ev = ev;
+    atomic_init(&lp->load, 0);
+    atomic_init(&lp->overflowed, 0);
+
+    lp->channel = ngr_channel_new(ev, NGR_EXECUTOR_CHANNEL_SIZE,
+                                  NGR_CHANNEL_MPSC, ngr_executor_receive, lp);
+    if (lp->channel == NULL) {
+        free(lp);
+        return NULL;
+    }
+
+    pthread_mutex_init(&lp->overflow_lock, NULL);
+
+    pthread_mutex_lock(&ex->loops_lock);
+
+    if (ex->nloops == NGR_EXECUTOR_MAX_LOOPS) {
+        pthread_mutex_unlock(&ex->loops_lock);
+        ngr_channel_destroy(lp->channel);
+        pthread_mutex_destroy(&lp->overflow_lock);
+        free(lp);
+        return NULL;
+    }
+
+    ex->loops[ex->nloops++] = lp;
+
+    pthread_mutex_unlock(&ex->loops_lock);
+
+    return lp;
+}
+
+
+/*
+ * Call from the loop thread once ngr_executor_destroy() returned, runs
+ * the continuations still queued for the loop and frees its state.
+ */
+void ngr_executor_detach(ngr_executor_loop_t *lp)
+{
+    (void)ngr_channel_drain(lp->channel);
+    ngr_executor_overflow(lp->ev, lp);
+
+    ngr_channel_destroy(lp->channel);
+    pthread_mutex_destroy(&lp->overflow_lock);
+    free(lp);
+}
+
+
+/*
+ * Offload work to the executor, done (if any) is called back in the loop
+ * of lp once the work finished.
+ */
+int ngr_executor_submit(ngr_executor_loop_t *lp,
+    ngr_executor_work_handler *work, ngr_executor_done_handler *done,
+    void *data)
+{
+    ngr_executor_t *ex = lp->ex;
+    ngr_executor_worker_t *w;
+    ngr_executor_task_t *task;
+
+    task = malloc(sizeof(*task));
+    if (task == NULL) {
+        return -1;
+    }
+
+    task->work = work;
+    task->done = done;
+    task->data = data;
+    task->owner = lp;
+    task->fd = -1;
+    task->next = NULL;
+
+    w = &ex->workers[atomic_fetch_add(&ex->next, 1) % ex->nworkers];
+
+    pthread_mutex_lock(&w->lock);
+    task->prev = w->tail;
+    if (w->tail) {
+        w->tail->next = task;
+    } else {
+        w->head = task;
+    }
+    w->tail = task;
+    pthread_mutex_unlock(&w->lock);
+
+    atomic_fetch_add(&ex->pending, 1);
+
+    pthread_mutex_lock(&ex->lock);
+    if (ex->sleeping > 0) {
+        pthread_cond_signal(&ex->cond);
+    }
+    pthread_mutex_unlock(&ex->lock);
+
+    return 0;
+}
+
+
+/*
+ * Move a fd registration to another loop, call from the loop which owns
+ * the fd. The handlers and data go along, timers the connection created
+ * on the old loop stay there.
+ */
+int ngr_executor_migrate(ngr_executor_loop_t *from, ngr_executor_loop_t *to,
+    int fd)
+{
+    ngr_event_node_t *node;
+    ngr_executor_task_t *task;
+
+    if (from == to || fd >= from->ev->max_events
+        || fd >= to->ev->max_events)
+    {
+        return -1;
+    }
+
+    node = &from->ev->events[fd];
+
+    if (node->mask == NGR_EVENT_NONE || node->pinned) {
+        return -1;
+    }
+
+    task = calloc(1, sizeof(*task));
+    if (task == NULL) {
+        return -1;
+    }
+
+    task->owner = from;
+    task->fd = fd;
+    task->mask = node->mask;
+    task->priority = node->priority;
+    task->rev_handler = node->rev_handler;
+    task->wev_handler = node->wev_handler;
+    task->batch_handler = node->batch_handler;
+    task->data = node->data;
+
+    ngr_event_del_io_event(from->ev, fd, task->mask);
+
+    if (ngr_channel_send(to->channel, task) == -1) { /* keep it here */
+        (void)ngr_executor_register(from->ev, task);
+        free(task);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Call periodically from the loop thread (e.g. from a timer). Publishes
+ * the loop load and, when it exceeds the least loaded loop by
+ * NGR_EXECUTOR_IMBALANCE, moves its most active connection there.
+ * Returns 1 when a connection was migrated.
+ */
+int ngr_executor_rebalance(ngr_executor_loop_t *lp)
+{
+    ngr_executor_t *ex = lp->ex;
+    ngr_executor_loop_t *target = NULL;
+    ngr_event_t *ev = lp->ev;
+    ngr_event_node_t *node;
+    int64_t now, busy;
+    uint64_t hottest = 0;
+    int load, min_load = 1000, fd = -1, j;
+
+    now = ngr_executor_current_usec();
+    busy = ev->stats.busy_time;
+
+    if (lp->last_time == 0 || now == lp->last_time) {
+        lp->last_time = now;
+        lp->last_busy = busy;
+        return 0;
+    }
+
+    load = (int)((busy - lp->last_busy) * 1000 / (now - lp->last_time));
+    atomic_store(&lp->load, load);
+
+    lp->last_time = now;
+    lp->last_busy = busy;
+
+    pthread_mutex_lock(&ex->loops_lock);
+    for (j = 0; j < ex->nloops; j++) {
+        if (ex->loops[j] != lp && atomic_load(&ex->loops[j]->load) < min_load) {
+            min_load = atomic_load(&ex->loops[j]->load);
+            target = ex->loops[j];
+        }
+    }
+    pthread_mutex_unlock(&ex->loops_lock);
+
+    /* pick the busiest connection since the last call, reset the counts */
+    for (j = 0; j <= ev->max_fd; j++) {
+        node = &ev->events[j];
+
+        if (node->mask != NGR_EVENT_NONE && !node->pinned
+            && node->dispatched > hottest)
+        {
+            hottest = node->dispatched;
+            fd = j;
+        }
+
+        node->dispatched = 0;
+    }
+
+    if (target == NULL || fd == -1
+        || load - min_load < NGR_EXECUTOR_IMBALANCE)
+    {
+        return 0;
+    }
+
+    return ngr_executor_migrate(lp, target, fd) == 0 ? 1 : 0;
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2012-2013, Liexusong <liexusong at qq dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _NGR_EXECUTOR_H
+#define _NGR_EXECUTOR_H
+
+#include <pthread.h>
+#include "ngr_event.h"
+#include "ngr_channel.h"
+
+
+#define NGR_EXECUTOR_DEFAULT_THREADS  4
+#define NGR_EXECUTOR_MAX_LOOPS        64
+#define NGR_EXECUTOR_CHANNEL_SIZE     4096
+#define NGR_EXECUTOR_IMBALANCE        200   /* per mille of busy time */
+
+typedef struct ngr_executor_s ngr_executor_t;
+typedef struct ngr_executor_loop_s ngr_executor_loop_t;
+typedef struct ngr_executor_task_s ngr_executor_task_t;
+
+/* runs in a worker thread */
+typedef void ngr_executor_work_handler(void *data);
+/* continuation, runs in the loop which submitted the task */
+typedef void ngr_executor_done_handler(ngr_event_t *ev, void *data);
+
+
+struct ngr_executor_task_s {
+    ngr_executor_work_handler *work;
+    ngr_executor_done_handler *done;
+    void *data;
+    ngr_executor_loop_t *owner;
+    ngr_executor_task_t *next;
+    ngr_executor_task_t *prev;
+
+    /* connection migration */
+    int fd;
+    int mask;
+    int priority;
+    ngr_event_io_event_handler *rev_handler;
+    ngr_event_io_event_handler *wev_handler;
+    ngr_event_io_batch_handler *batch_handler;
+};
+
+
+typedef struct ngr_executor_worker_s {
+    ngr_executor_t *ex;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    ngr_executor_task_t *head;    /* the owner pops here */
+    ngr_executor_task_t *tail;    /* thieves steal here */
+    uint64_t executed;
+    uint64_t stolen;
+} ngr_executor_worker_t;
+
+
+struct ngr_executor_loop_s {
+    ngr_executor_t *ex;
+    ngr_event_t *ev;
+    ngr_channel_t *channel;       /* continuations and migrated fds */
+    pthread_mutex_t overflow_lock;
+    ngr_executor_task_t *overflow; /* continuations the channel refused */
+    atomic_int overflowed;
+    atomic_int load;              /* per mille of time spent in handlers */
+    int64_t last_time;            /* usec, at the last rebalance */
+    int64_t last_busy;
+};
+
+
+struct ngr_executor_s {
+    int nworkers;
+    ngr_executor_worker_t *workers;
+    atomic_uint next;             /* round robin submission */
+    atomic_int pending;           /* queued tasks not picked up yet */
+    pthread_mutex_t lock;         /* protects sleeping workers */
+    pthread_cond_t cond;
+    int sleeping;
+    int exiting;
+    pthread_mutex_t loops_lock;
+    ngr_executor_loop_t *loops[NGR_EXECUTOR_MAX_LOOPS];
+    int nloops;
+};
+
+
+ngr_executor_t *ngr_executor_new(int threads);
+void ngr_executor_destroy(ngr_executor_t *ex);
+ngr_executor_loop_t *ngr_executor_attach(ngr_executor_t *ex, ngr_event_t *ev);
+void ngr_executor_detach(ngr_executor_loop_t *lp);
+int ngr_executor_submit(ngr_executor_loop_t *lp,
+    ngr_executor_work_handler *work, ngr_executor_done_handler *done,
+    void *data);
+int ngr_executor_migrate(ngr_executor_loop_t *from, ngr_executor_loop_t *to,
+    int fd);
+int ngr_executor_rebalance(ngr_executor_loop_t *lp);
+
+#endif
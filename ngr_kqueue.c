@@ -9,21 +9,24 @@ struct ngr_event_lib_context {
 
 static int ngr_event_lib_init(ngr_event_t *ev)
 {
-    struct ngr_event_lib_context *ctx = malloc(sizeof(*ctx));
+    struct ngr_event_lib_context *ctx;
+
+    ctx = ngr_event_alloc(ev->node, sizeof(*ctx));
     if (!ctx) {
         return -1;
     }
 
-    ctx->events = malloc(sizeof(struct kevent) * ev->max_events);
+    ctx->events = ngr_event_alloc(ev->node,
+                                  sizeof(struct kevent) * ev->max_events);
     if (!ctx->events) {
-        free(ctx);
+        ngr_event_free(ctx);
         return -1;
     }
 
     ctx->kqfd = kqueue();
     if (ctx->kqfd == -1) {
-        free(ctx->events);
-        free(ctx);
+        ngr_event_free(ctx->events);
+        ngr_event_free(ctx);
         return -1;
     }
 
@@ -36,22 +39,32 @@ static void ngr_event_lib_free_context(ngr_event_t *ev)
     struct ngr_event_lib_context *ctx = ev->ctx;
 
     close(ctx->kqfd);
-    free(ctx->events);
-    free(ctx);
+    ngr_event_free(ctx->events);
+    ngr_event_free(ctx);
+}
+
+/*
+ * udata carries the generation of the fd registration, so events of a fd
+ * closed and reused within one poll are told apart.
+ */
+static inline void *ngr_event_lib_udata(ngr_event_t *ev, int fd)
+{
+    return (void *)(uintptr_t)ev->events[fd].gen;
 }
 
 static int ngr_event_lib_add_event(ngr_event_t *ev, int fd, int mask)
 {
     struct ngr_event_lib_context *ctx = ev->ctx;
+    void *udata = ngr_event_lib_udata(ev, fd);
     struct kevent ke;
 
     if (mask & NGR_EVENT_READABLE) {
-        EV_SET(&ke, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+        EV_SET(&ke, fd, EVFILT_READ, EV_ADD, 0, 0, udata);
         if (kevent(ctx->kqfd, &ke, 1, NULL, 0, NULL) == -1) return -1;
     }
 
     if (mask & NGR_EVENT_WRITABLE) {
-        EV_SET(&ke, fd, EVFILT_WRITE, EV_ADD, 0, 0, NULL);
+        EV_SET(&ke, fd, EVFILT_WRITE, EV_ADD, 0, 0, udata);
         if (kevent(ctx->kqfd, &ke, 1, NULL, 0, NULL) == -1) return -1;
     }
     return 0;
@@ -73,6 +86,70 @@ static void ngr_event_lib_del_event(ngr_event_t *ev, int fd, int mask)
     }
 }
 
+static void ngr_event_lib_toggle(ngr_event_t *ev, int fd, int mask,
+    int flag)
+{
+    struct ngr_event_lib_context *ctx = ev->ctx;
+    void *udata = ngr_event_lib_udata(ev, fd);
+    struct kevent ke;
+
+    if (mask & NGR_EVENT_READABLE) {
+        EV_SET(&ke, fd, EVFILT_READ, flag, 0, 0, udata);
+        kevent(ctx->kqfd, &ke, 1, NULL, 0, NULL);
+    }
+
+    if (mask & NGR_EVENT_WRITABLE) {
+        EV_SET(&ke, fd, EVFILT_WRITE, flag, 0, 0, udata);
+        kevent(ctx->kqfd, &ke, 1, NULL, 0, NULL);
+    }
+}
+
+static void ngr_event_lib_pause(ngr_event_t *ev, int fd, int mask)
+{
+    ngr_event_lib_toggle(ev, fd, mask, EV_DISABLE);
+}
+
+static void ngr_event_lib_resume(ngr_event_t *ev, int fd, int mask)
+{
+    ngr_event_lib_toggle(ev, fd, mask, EV_ENABLE);
+}
+
+static void ngr_event_lib_signal_nop(int signo)
+{
+}
+
+static int ngr_event_lib_add_signal(ngr_event_t *ev, int signo)
+{
+    struct ngr_event_lib_context *ctx = ev->ctx;
+    struct kevent ke;
+
+    /*
+     * EVFILT_SIGNAL still sees ignored signals, and they don't kill us.
+     * An ignored SIGCHLD makes the kernel reap the children though, it
+     * gets a handler doing nothing instead.
+     */
+    signal(signo, signo == SIGCHLD ? ngr_event_lib_signal_nop : SIG_IGN);
+
+    EV_SET(&ke, signo, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+    if (kevent(ctx->kqfd, &ke, 1, NULL, 0, NULL) == -1) {
+        signal(signo, SIG_DFL);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void ngr_event_lib_del_signal(ngr_event_t *ev, int signo)
+{
+    struct ngr_event_lib_context *ctx = ev->ctx;
+    struct kevent ke;
+
+    EV_SET(&ke, signo, EVFILT_SIGNAL, EV_DELETE, 0, 0, NULL);
+    kevent(ctx->kqfd, &ke, 1, NULL, 0, NULL);
+
+    signal(signo, SIG_DFL);
+}
+
 static int ngr_event_lib_poll(ngr_event_t *ev, struct timeval *tvp)
 {
     struct ngr_event_lib_context *ctx = ev->ctx;
@@ -94,22 +171,55 @@ static int ngr_event_lib_poll(ngr_event_t *ev, struct timeval *tvp)
     if (retval > 0) {
         int j;
         
-        numevents = retval;
-        for(j = 0; j < numevents; j++) {
-            int mask = 0;
+        for(j = 0; j < retval; j++) {
             struct kevent *e = ctx->events + j;
 
-            if (e->filter == EVFILT_READ)  mask |= NGR_EVENT_READABLE;
-            if (e->filter == EVFILT_WRITE) mask |= NGR_EVENT_WRITABLE;
+            if (e->filter == EVFILT_SIGNAL) { /* data is the delivery count */
+                ev->signals[e->ident].count += e->data;
+                ev->signal_pending = 1;
+                continue;
+            }
+
+            if (numevents != j) { /* close the gap left by signals */
+                ctx->events[numevents] = *e;
+            }
 
-            ev->fired[j].fd = e->ident; 
-            ev->fired[j].mask = mask;           
+            numevents++;
         }
     }
 
     return numevents;
 }
 
+static int ngr_event_lib_precise(ngr_event_t *ev)
+{
+    return 1; /* timeouts are passed through unrounded */
+}
+
+static int ngr_event_lib_busy_poll(ngr_event_t *ev, int64_t usec)
+{
+    return -1; /* kqueue has no busy poll knob */
+}
+
+/* the node is indexed by ident, stale events are dropped */
+static inline ngr_event_node_t *ngr_event_lib_fired(ngr_event_t *ev, int j,
+    int *mask)
+{
+    struct ngr_event_lib_context *ctx = ev->ctx;
+    struct kevent *e = ctx->events + j;
+    ngr_event_node_t *node = &ev->events[e->ident];
+
+    if ((uintptr_t)e->udata != (uintptr_t)node->gen) {
+        return NULL;
+    }
+
+    *mask = 0;
+    if (e->filter == EVFILT_READ)  *mask |= NGR_EVENT_READABLE;
+    if (e->filter == EVFILT_WRITE) *mask |= NGR_EVENT_WRITABLE;
+
+    return node;
+}
+
 char *ngr_event_lib_name(void)
 {
     return "kqueue";
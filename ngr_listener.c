@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2012-2013, Liexusong <liexusong at qq dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE  /* accept4 */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "ngr_listener.h"
+
+
+static int ngr_listener_accept(int fd)
+{
+#ifdef SOCK_NONBLOCK
+    return accept4(fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+    int s = accept(fd, NULL, NULL);
+
+    if (s != -1) {
+        fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+        fcntl(s, F_SETFD, FD_CLOEXEC);
+    }
+
+    return s;
+#endif
+}
+
+
+static void ngr_listener_handle(ngr_event_t *ev, int fd, void *data,
+    int mask);
+
+
+static int ngr_listener_watch(ngr_listener_t *ls)
+{
+    if (ngr_event_create_io_event(ls->ev, ls->fd, NGR_EVENT_READABLE,
+            ngr_listener_handle, ls) == -1)
+    {
+        return -1;
+    }
+
+    /* new connections go ahead of bulk transfers */
+    ngr_event_set_priority(ls->ev, ls->fd, NGR_EVENT_PRIORITY_HIGH);
+    ngr_event_pin(ls->ev, ls->fd);
+
+    return 0;
+}
+
+
+static uint64_t ngr_listener_resume(ngr_event_t *ev, void *data)
+{
+    ngr_listener_t *ls = data;
+
+    if (ls->reserve == -1) {
+        ls->reserve = open("/dev/null", O_RDONLY|O_CLOEXEC);
+    }
+
+    if (ls->reserve == -1 || ngr_listener_watch(ls) == -1) {
+        return NGR_LISTENER_BACKOFF; /* still out of fds */
+    }
+
+    ls->backoff = NULL;
+
+    return 0;
+}
+
+
+/*
+ * Out of fds the listening socket stays readable, and the loop would spin
+ * on it. The reserve fd is given up to accept and close the waiting
+ * connections, without one the listener is paused for a while.
+ */
+static void ngr_listener_shed(ngr_listener_t *ls)
+{
+    int s, n = 0;
+
+    if (ls->reserve != -1) {
+        close(ls->reserve);
+
+        while (n++ < ls->budget && (s = ngr_listener_accept(ls->fd)) != -1) {
+            close(s);
+            ls->dropped++;
+        }
+
+        ls->reserve = open("/dev/null", O_RDONLY|O_CLOEXEC);
+        if (ls->reserve != -1) {
+            return;
+        }
+    }
+
+    ngr_event_del_io_event(ls->ev, ls->fd, NGR_EVENT_READABLE);
+
+    ls->backoff = ngr_event_add_timer(ls->ev, NGR_LISTENER_BACKOFF,
+                                      ngr_listener_resume, ls, NULL);
+}
+
+
+static void ngr_listener_handle(ngr_event_t *ev, int fd, void *data,
+    int mask)
+{
+    ngr_listener_t *ls = data;
+    int s, n = 0;
+
+    /*
+     * Connections over the budget stay in the backlog, the listening
+     * socket is reported again on the next loop iteration.
+     */
+    while (n < ls->budget) {
+
+        s = ngr_listener_accept(fd);
+
+        if (s == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+
+            if (errno == EMFILE || errno == ENFILE) {
+                ls->errors++;
+                ngr_listener_shed(ls);
+
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                ls->errors++;  /* retry next loop */
+            }
+
+            break;
+        }
+
+        ls->fds[n++] = s;
+    }
+
+    if (n == 0) {
+        return;
+    }
+
+    if (n == ls->budget) {
+        ls->exhausted++;
+    }
+
+    ls->accepted += n;
+    ls->batches++;
+
+    ls->handler(ev, ls, ls->fds, n, ls->data);
+}
+
+
+ngr_listener_t *ngr_listener_new(ngr_event_t *ev, int fd, int budget,
+    ngr_listener_handler *handler, void *data)
+{
+    ngr_listener_t *ls;
+
+    if (budget <= 0) {
+        budget = NGR_LISTENER_DEFAULT_BUDGET;
+    }
+
+    ls = calloc(1, sizeof(*ls));
+    if (ls == NULL) {
+        return NULL;
+    }
+
+    ls->fds = malloc(budget * sizeof(int));
+    if (ls->fds == NULL) {
+        free(ls);
+        return NULL;
+    }
+
+    ls->ev = ev;
+    ls->fd = fd;
+    ls->budget = budget;
+    ls->handler = handler;
+    ls->data = data;
+
+    ls->reserve = open("/dev/null", O_RDONLY|O_CLOEXEC);
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    if (ngr_listener_watch(ls) == -1) {
+        if (ls->reserve != -1) close(ls->reserve);
+        free(ls->fds);
+        free(ls);
+        return NULL;
+    }
+
+    return ls;
+}
+
+
+void ngr_listener_destroy(ngr_listener_t *ls)
+{
+    ngr_event_del_io_event(ls->ev, ls->fd, NGR_EVENT_READABLE);
+
+    if (ls->backoff) {
+        ngr_event_del_timer(ls->ev, ls->backoff);
+    }
+
+    if (ls->reserve != -1) {
+        close(ls->reserve);
+    }
+
+    free(ls->fds);
+    free(ls);
+}
+
+
+/*
+ * Register accepted connections with the same handler, one event lib call
+ * per fd. data[j] becomes the data of fds[j], a NULL data array registers
+ * them all with NULL. The fds which could not be registered are closed
+ * and removed from both arrays, returns the number of registered fds.
+ */
+int ngr_listener_register(ngr_event_t *ev, int *fds, int nfds, int mask,
+    ngr_event_io_event_handler *handler, void **data)
+{
+    int j, n = 0;
+
+    for (j = 0; j < nfds; j++) {
+        if (ngr_event_create_io_event(ev, fds[j], mask, handler,
+                                      data ? data[j] : NULL) == -1)
+        {
+            close(fds[j]);
+            continue;
+        }
+
+        if (data) data[n] = data[j];
+        fds[n++] = fds[j];
+    }
+
+    return n;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2012-2013, Liexusong <liexusong at qq dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _NGR_LISTENER_H
+#define _NGR_LISTENER_H
+
+#include "ngr_event.h"
+
+
+#define NGR_LISTENER_DEFAULT_BUDGET  64
+#define NGR_LISTENER_BACKOFF         100   /* msec paused when out of fds */
+
+typedef struct ngr_listener_s ngr_listener_t;
+
+/*
+ * Receives every connection accepted in one loop iteration. The fds are
+ * nonblocking and close-on-exec, the handler owns them.
+ */
+typedef void ngr_listener_handler(ngr_event_t *ev, ngr_listener_t *ls,
+    int *fds, int nfds, void *data);
+
+
+struct ngr_listener_s {
+    ngr_event_t *ev;
+    int fd;
+    int budget;              /* max accepts per loop iteration */
+    int *fds;                /* batch of accepted fds, budget entries */
+    ngr_listener_handler *handler;
+    void *data;
+    int reserve;             /* spare fd given up to shed connections */
+    ngr_event_timer_t *backoff;
+
+    uint64_t accepted;
+    uint64_t batches;
+    uint64_t exhausted;      /* batches which hit the budget */
+    uint64_t errors;
+    uint64_t dropped;        /* connections closed for lack of fds */
+};
+
+
+ngr_listener_t *ngr_listener_new(ngr_event_t *ev, int fd, int budget,
+    ngr_listener_handler *handler, void *data);
+void ngr_listener_destroy(ngr_listener_t *ls);
+int ngr_listener_register(ngr_event_t *ev, int *fds, int nfds, int mask,
+    ngr_event_io_event_handler *handler, void **data);
+
+#endif
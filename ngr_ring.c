@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2012-2013, Liexusong <liexusong at qq dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE  /* memfd_create */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "ngr_ring.h"
+
+
+static int ngr_ring_file(size_t size)
+{
+    int fd;
+
+#ifdef MFD_CLOEXEC
+    fd = memfd_create("ngr_ring", MFD_CLOEXEC);
+#else
+    char path[] = "/tmp/ngr_ring.XXXXXX";
+
+    fd = mkstemp(path);
+    if (fd != -1) unlink(path);
+#endif
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (ftruncate(fd, size) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+/*
+ * Reserve twice the size of address space, then map the same file over
+ * both halves. size is rounded up to the page size.
+ */
+int ngr_ring_init(ngr_ring_t *ring, size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    char *base;
+    int fd;
+
+    size = (size + page - 1) / page * page;
+    if (size == 0) size = page;
+
+    fd = ngr_ring_file(size);
+    if (fd == -1) {
+        return -1;
+    }
+
+    base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    if (mmap(base, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED,
+             fd, 0) == MAP_FAILED
+        || mmap(base + size, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED,
+                fd, 0) == MAP_FAILED)
+    {
+        munmap(base, 2 * size);
+        close(fd);
+        return -1;
+    }
+
+    close(fd); /* the mappings keep the file */
+
+    ring->base = base;
+    ring->size = size;
+    ring->head = 0;
+    ring->used = 0;
+
+    return 0;
+}
+
+
+void ngr_ring_destroy(ngr_ring_t *ring)
+{
+    if (ring->base) {
+        munmap(ring->base, 2 * ring->size);
+        ring->base = NULL;
+    }
+}
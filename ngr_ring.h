@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2012-2013, Liexusong <liexusong at qq dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _NGR_RING_H
+#define _NGR_RING_H
+
+#include <stddef.h>
+
+
+/*
+ * A byte ring mapped twice back to back, data and free space are always
+ * contiguous in memory so readers never see a wrapped frame.
+ */
+typedef struct ngr_ring_s {
+    char *base;
+    size_t size;     /* page multiple, each mapping is size bytes */
+    size_t head;     /* offset of the first byte, below size */
+    size_t used;
+} ngr_ring_t;
+
+
+int ngr_ring_init(ngr_ring_t *ring, size_t size);
+void ngr_ring_destroy(ngr_ring_t *ring);
+
+
+static inline char *ngr_ring_data(ngr_ring_t *ring)
+{
+    return ring->base + ring->head;
+}
+
+static inline size_t ngr_ring_used(ngr_ring_t *ring)
+{
+    return ring->used;
+}
+
+static inline char *ngr_ring_tail(ngr_ring_t *ring)
+{
+    return ring->base + ring->head + ring->used;
+}
+
+static inline size_t ngr_ring_space(ngr_ring_t *ring)
+{
+    return ring->size - ring->used;
+}
+
+static inline void ngr_ring_produce(ngr_ring_t *ring, size_t n)
+{
+    ring->used += n;
+}
+
+static inline void ngr_ring_consume(ngr_ring_t *ring, size_t n)
+{
+    ring->used -= n;
+
+    if (ring->used == 0) { /* restart at the front, keeps the tlb warm */
+        ring->head = 0;
+        return;
+    }
+
+    ring->head += n;
+    if (ring->head >= ring->size) ring->head -= ring->size;
+}
+
+#endif
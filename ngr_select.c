@@ -1,28 +1,77 @@
 
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <sys/select.h>
 
 struct ngr_event_lib_context {
     fd_set  rfds,  wfds;
     fd_set _rfds, _wfds;
+    ngr_event_fired_t *fired;
+    int sigpipe[2];         /* self-pipe of the signals this loop owns */
 };
 
+/*
+ * Signal dispositions are per process, so a signal belongs to one loop.
+ * The handler writes it to the self-pipe of that loop, -1 when not owned.
+ */
+static volatile sig_atomic_t ngr_event_sigfd[NSIG];
+static int ngr_event_sigfd_init = 0;
+
+static void ngr_event_lib_del_signal(ngr_event_t *ev, int signo);
+
 static int ngr_event_lib_init(ngr_event_t *ev)
 {
-    struct ngr_event_lib_context *ctx = malloc(sizeof(*ctx));
+    struct ngr_event_lib_context *ctx;
+
+    ctx = ngr_event_alloc(ev->node, sizeof(*ctx));
 
     if (!ctx) return -1;
 
+    ctx->fired = ngr_event_alloc(ev->node,
+                                 sizeof(ngr_event_fired_t) * ev->max_events);
+    if (!ctx->fired) {
+        ngr_event_free(ctx);
+        return -1;
+    }
+
     FD_ZERO(&ctx->rfds);
     FD_ZERO(&ctx->wfds);
 
+    ctx->sigpipe[0] = ctx->sigpipe[1] = -1;
+
+    if (!ngr_event_sigfd_init) {
+        int signo;
+
+        for (signo = 0; signo < NSIG; signo++) {
+            ngr_event_sigfd[signo] = -1;
+        }
+
+        ngr_event_sigfd_init = 1;
+    }
+
     ev->ctx = ctx;
     return 0;
 }
 
 static void ngr_event_lib_free_context(ngr_event_t *ev)
 {
-    free(ev->ctx);
+    struct ngr_event_lib_context *ctx = ev->ctx;
+    int signo;
+
+    if (ctx->sigpipe[0] != -1) {
+        for (signo = 1; signo < NSIG; signo++) { /* give them back */
+            if (ngr_event_sigfd[signo] == ctx->sigpipe[1]) {
+                ngr_event_lib_del_signal(ev, signo);
+            }
+        }
+
+        close(ctx->sigpipe[0]);
+        close(ctx->sigpipe[1]);
+    }
+
+    ngr_event_free(ctx->fired);
+    ngr_event_free(ctx);
 }
 
 static int ngr_event_lib_add_event(ngr_event_t *ev, int fd, int mask)
@@ -43,6 +92,16 @@ static void ngr_event_lib_del_event(ngr_event_t *ev, int fd, int mask)
     if (mask & NGR_EVENT_WRITABLE) FD_CLR(fd, &ctx->wfds);
 }
 
+static void ngr_event_lib_pause(ngr_event_t *ev, int fd, int mask)
+{
+    ngr_event_lib_del_event(ev, fd, mask);
+}
+
+static void ngr_event_lib_resume(ngr_event_t *ev, int fd, int mask)
+{
+    (void)ngr_event_lib_add_event(ev, fd, mask);
+}
+
 static int ngr_event_lib_poll(ngr_event_t *ev, struct timeval *tvp)
 {
     struct ngr_event_lib_context *ctx = ev->ctx;
@@ -67,14 +126,123 @@ static int ngr_event_lib_poll(ngr_event_t *ev, struct timeval *tvp)
 
             if (mask == 0) continue; /* !events */
 
-            ev->fired[numevents].fd = j;
-            ev->fired[numevents].mask = mask;
+            ctx->fired[numevents].fd = j;
+            ctx->fired[numevents].mask = mask;
+            ctx->fired[numevents].gen = ev->events[j].gen;
             numevents++;
         }
     }
     return numevents;
 }
 
+static void ngr_event_lib_sigpipe_write(int signo)
+{
+    int saved = errno;
+    int fd = ngr_event_sigfd[signo];
+    unsigned char c = (unsigned char)signo;
+
+    if (fd != -1) {
+        (void)write(fd, &c, 1);
+    }
+
+    errno = saved;
+}
+
+static void ngr_event_lib_signal_handler(ngr_event_t *ev, int fd, void *data,
+    int mask)
+{
+    unsigned char buf[256];
+    ssize_t n;
+    int j;
+
+    /* drain every queued signal, the loop dispatches them coalesced */
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (j = 0; j < n; j++) {
+            ev->signals[buf[j]].count++;
+        }
+        ev->signal_pending = 1;
+    }
+}
+
+/* a signal owned by another loop is refused */
+static int ngr_event_lib_add_signal(ngr_event_t *ev, int signo)
+{
+    struct ngr_event_lib_context *ctx = ev->ctx;
+    struct sigaction sa;
+
+    if (ngr_event_sigfd[signo] != -1) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    if (ctx->sigpipe[0] == -1) {
+        if (pipe(ctx->sigpipe) == -1) return -1;
+
+        fcntl(ctx->sigpipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(ctx->sigpipe[1], F_SETFL, O_NONBLOCK);
+        fcntl(ctx->sigpipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(ctx->sigpipe[1], F_SETFD, FD_CLOEXEC);
+
+        if (ngr_event_create_io_event(ev, ctx->sigpipe[0],
+                NGR_EVENT_READABLE, ngr_event_lib_signal_handler, NULL) == -1)
+        {
+            close(ctx->sigpipe[0]);
+            close(ctx->sigpipe[1]);
+            ctx->sigpipe[0] = ctx->sigpipe[1] = -1;
+            return -1;
+        }
+
+        ngr_event_set_priority(ev, ctx->sigpipe[0], NGR_EVENT_PRIORITY_HIGH);
+        ngr_event_pin(ev, ctx->sigpipe[0]);
+    }
+
+    ngr_event_sigfd[signo] = ctx->sigpipe[1];
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = ngr_event_lib_sigpipe_write;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+
+    if (sigaction(signo, &sa, NULL) == -1) {
+        ngr_event_sigfd[signo] = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void ngr_event_lib_del_signal(ngr_event_t *ev, int signo)
+{
+    signal(signo, SIG_DFL);
+    ngr_event_sigfd[signo] = -1;
+}
+
+static int ngr_event_lib_precise(ngr_event_t *ev)
+{
+    return 1; /* timeouts are passed through unrounded */
+}
+
+static int ngr_event_lib_busy_poll(ngr_event_t *ev, int64_t usec)
+{
+    return -1;
+}
+
+/* fired entries record the generation seen by the poll */
+static inline ngr_event_node_t *ngr_event_lib_fired(ngr_event_t *ev, int j,
+    int *mask)
+{
+    struct ngr_event_lib_context *ctx = ev->ctx;
+    ngr_event_node_t *node = &ev->events[ctx->fired[j].fd];
+
+    if (ctx->fired[j].gen != node->gen) {
+        return NULL;
+    }
+
+    *mask = ctx->fired[j].mask;
+
+    return node;
+}
+
 char *ngr_event_lib_name(void)
 {
     return "select";
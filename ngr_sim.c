@@ -0,0 +1,300 @@
+
+/*
+ * In memory event lib for load tests, selected with -DNGR_EVENT_SIM. No
+ * fd is ever polled: readiness is injected with ngr_sim_inject() at times
+ * of a virtual clock, and instead of sleeping the clock jumps straight to
+ * the next injected event or timer. A recorded trace replays as fast as
+ * the dispatch path can go, with the same timer order on every run.
+ */
+
+
+typedef struct ngr_sim_event_s {
+    int64_t at;          /* virtual usec */
+    uint64_t seq;        /* injection order, breaks ties */
+    int fd;
+    int mask;
+} ngr_sim_event_t;
+
+struct ngr_event_lib_context {
+    ngr_sim_event_t *queue;      /* min heap on at, seq */
+    int nqueue;
+    int queue_size;
+    uint64_t seq;
+    ngr_event_fired_t *fired;
+    int *slot;                   /* fired index + 1 of a fd in this poll */
+    uint64_t delivered;
+    uint64_t dropped;            /* injected for fds nobody watches */
+    volatile sig_atomic_t woken; /* ngr_event_wakeup() called */
+};
+
+/* the virtual clock, shared by every loop of the process */
+static int64_t ngr_sim_clock = 0;
+
+static int ngr_event_lib_init(ngr_event_t *ev)
+{
+    struct ngr_event_lib_context *ctx;
+
+    ctx = ngr_event_alloc(ev->node, sizeof(*ctx));
+
+    if (!ctx) return -1;
+
+    ctx->fired = ngr_event_alloc(ev->node,
+                                 sizeof(ngr_event_fired_t) * ev->max_events);
+    ctx->slot = ngr_event_alloc(ev->node, ev->max_events * sizeof(int));
+    if (!ctx->fired || !ctx->slot) {
+        ngr_event_free(ctx->fired);
+        ngr_event_free(ctx->slot);
+        ngr_event_free(ctx);
+        return -1;
+    }
+
+    ev->ctx = ctx;
+    return 0;
+}
+
+static void ngr_event_lib_free_context(ngr_event_t *ev)
+{
+    struct ngr_event_lib_context *ctx = ev->ctx;
+
+    free(ctx->queue);
+    ngr_event_free(ctx->fired);
+    ngr_event_free(ctx->slot);
+    ngr_event_free(ctx);
+}
+
+static int ngr_event_lib_add_event(ngr_event_t *ev, int fd, int mask)
+{
+    return 0; /* the node mask is all the sim needs */
+}
+
+static void ngr_event_lib_del_event(ngr_event_t *ev, int fd, int mask)
+{
+}
+
+static void ngr_event_lib_pause(ngr_event_t *ev, int fd, int mask)
+{
+}
+
+/* a held back fd is still ready, as a level triggered poll would see */
+static void ngr_event_lib_resume(ngr_event_t *ev, int fd, int mask)
+{
+    ngr_sim_inject(ev, ngr_sim_clock, fd, mask);
+}
+
+static int ngr_sim_before(ngr_sim_event_t *a, ngr_sim_event_t *b)
+{
+    return a->at < b->at || (a->at == b->at && a->seq < b->seq);
+}
+
+static void ngr_sim_pop(struct ngr_event_lib_context *ctx)
+{
+    ngr_sim_event_t last = ctx->queue[--ctx->nqueue];
+    int i = 0, child;
+
+    while ((child = 2 * i + 1) < ctx->nqueue) {
+        if (child + 1 < ctx->nqueue
+            && ngr_sim_before(&ctx->queue[child + 1], &ctx->queue[child]))
+        {
+            child++;
+        }
+
+        if (!ngr_sim_before(&ctx->queue[child], &last)) break;
+
+        ctx->queue[i] = ctx->queue[child];
+        i = child;
+    }
+
+    ctx->queue[i] = last;
+}
+
+static int ngr_event_lib_poll(ngr_event_t *ev, struct timeval *tvp)
+{
+    struct ngr_event_lib_context *ctx = ev->ctx;
+    ngr_sim_event_t *e;
+    ngr_event_node_t *node;
+    int64_t deadline = -1;
+    int j, mask, numevents = 0;
+
+    if (ev->signal_pending) { /* injected signals, dispatch them first */
+        return 0;
+    }
+
+    /* the wakeup fd became readable, queued from the loop thread */
+    if (ctx->woken) {
+        ctx->woken = 0;
+        (void)ngr_sim_inject(ev, ngr_sim_clock, ev->wakeup[0],
+                             NGR_EVENT_READABLE);
+    }
+
+    if (ctx->nqueue == 0 || ctx->queue[0].at > ngr_sim_clock) {
+
+        if (tvp) {
+            deadline = ngr_sim_clock
+                     + (int64_t)tvp->tv_sec * 1000000 + tvp->tv_usec;
+        }
+
+        if (ctx->nqueue > 0 && (deadline == -1 || ctx->queue[0].at < deadline))
+        {
+            deadline = ctx->queue[0].at;
+        }
+
+        if (deadline == -1) { /* nothing will ever happen, replay is over */
+            ev->stop = 1;
+            return 0;
+        }
+
+        ngr_sim_clock = deadline; /* sleep in no time */
+    }
+
+    while (ctx->nqueue > 0 && ctx->queue[0].at <= ngr_sim_clock
+           && numevents < ev->max_events)
+    {
+        e = &ctx->queue[0];
+
+        mask = 0;
+        if (e->fd < ev->max_events) {
+            node = &ev->events[e->fd];
+            mask = e->mask & node->mask & ~node->throttled;
+        }
+
+        if (mask == 0) {
+            ctx->dropped++;
+
+        } else if (ctx->slot[e->fd]) { /* merged, as a real poll would */
+            ctx->fired[ctx->slot[e->fd] - 1].mask |= mask;
+            ctx->delivered++;
+
+        } else {
+            ctx->fired[numevents].fd = e->fd;
+            ctx->fired[numevents].mask = mask;
+            ctx->fired[numevents].gen = node->gen;
+            ctx->slot[e->fd] = ++numevents;
+            ctx->delivered++;
+        }
+
+        ngr_sim_pop(ctx);
+    }
+
+    for (j = 0; j < numevents; j++) {
+        ctx->slot[ctx->fired[j].fd] = 0;
+    }
+
+    return numevents;
+}
+
+static int ngr_event_lib_add_signal(ngr_event_t *ev, int signo)
+{
+    return 0; /* delivered by ngr_sim_signal() only */
+}
+
+static void ngr_event_lib_del_signal(ngr_event_t *ev, int signo)
+{
+}
+
+static int ngr_event_lib_precise(ngr_event_t *ev)
+{
+    return 1;
+}
+
+static int ngr_event_lib_busy_poll(ngr_event_t *ev, int64_t usec)
+{
+    return -1;
+}
+
+/* fired entries record the generation seen by the poll */
+static inline ngr_event_node_t *ngr_event_lib_fired(ngr_event_t *ev, int j,
+    int *mask)
+{
+    struct ngr_event_lib_context *ctx = ev->ctx;
+    ngr_event_node_t *node = &ev->events[ctx->fired[j].fd];
+
+    if (ctx->fired[j].gen != node->gen) {
+        return NULL;
+    }
+
+    *mask = ctx->fired[j].mask;
+
+    return node;
+}
+
+char *ngr_event_lib_name(void)
+{
+    return "sim";
+}
+
+/* only sets a flag, so it is safe from any thread and signal handler */
+static void ngr_sim_wakeup(ngr_event_t *ev)
+{
+    struct ngr_event_lib_context *ctx = ev->ctx;
+
+    ctx->woken = 1;
+}
+
+/*
+ * Make fd ready for mask at virtual time at (usec), times already past
+ * are delivered by the next poll. Events for fds which aren't watched
+ * for mask by then are dropped, fds out of the loop range are refused.
+ */
+int ngr_sim_inject(ngr_event_t *ev, int64_t at, int fd, int mask)
+{
+    struct ngr_event_lib_context *ctx = ev->ctx;
+    ngr_sim_event_t e, *queue;
+    int i, parent;
+
+    if (fd < 0 || fd >= ev->max_events) {
+        return -1;
+    }
+
+    if (ctx->nqueue == ctx->queue_size) {
+        int size = ctx->queue_size ? ctx->queue_size * 2 : 1024;
+
+        queue = realloc(ctx->queue, size * sizeof(ngr_sim_event_t));
+        if (queue == NULL) {
+            return -1;
+        }
+
+        ctx->queue = queue;
+        ctx->queue_size = size;
+    }
+
+    e.at = at;
+    e.seq = ctx->seq++;
+    e.fd = fd;
+    e.mask = mask;
+
+    for (i = ctx->nqueue++; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (!ngr_sim_before(&e, &ctx->queue[parent])) break;
+        ctx->queue[i] = ctx->queue[parent];
+    }
+
+    ctx->queue[i] = e;
+
+    return 0;
+}
+
+void ngr_sim_signal(ngr_event_t *ev, int signo)
+{
+    if (ev->signals && signo > 0 && signo < NSIG) {
+        ev->signals[signo].count++;
+        ev->signal_pending = 1;
+    }
+}
+
+int64_t ngr_sim_now(void)
+{
+    return ngr_sim_clock;
+}
+
+/* the clock only moves forward */
+void ngr_sim_advance(int64_t usec)
+{
+    if (usec > 0) ngr_sim_clock += usec;
+}
+
+int ngr_sim_pending(ngr_event_t *ev)
+{
+    struct ngr_event_lib_context *ctx = ev->ctx;
+
+    return ctx->nqueue;
+}
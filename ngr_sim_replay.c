@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2012-2013, Liexusong <liexusong at qq dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Replay the io and timer records of a ngr_trace file against the
+ * simulated event lib, as fast as the loop can dispatch them, and report
+ * the per event cost of the dispatch and timer layers:
+ *
+ *   ngr_sim_replay loop.trace [rounds]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "ngr_event.h"
+
+
+static uint64_t io_events;
+static uint64_t timer_events;
+
+
+static void replay_io_handler(ngr_event_t *ev, int fd, void *data, int mask)
+{
+    io_events++;
+}
+
+
+static uint64_t replay_timer_handler(ngr_event_t *ev, void *data)
+{
+    timer_events++;
+    return 0;
+}
+
+
+static int64_t replay_nsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+int main(int argc, char *argv[])
+{
+    ngr_trace_header_t header;
+    ngr_trace_record_t record;
+    ngr_trace_record_t *records;
+    uint64_t first, i, n = 0, total;
+    int64_t t0, span, at, start, elapsed;
+    ngr_event_t *ev;
+    int rounds = 1, r, skipped = 0;
+    FILE *fp;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <trace file> [rounds]\n", argv[0]);
+        exit(-1);
+    }
+
+    if (argc > 2) {
+        rounds = atoi(argv[2]);
+        if (rounds <= 0) rounds = 1;
+    }
+
+    fp = fopen(argv[1], "rb");
+    if (!fp) {
+        fprintf(stderr, "can not open %s\n", argv[1]);
+        exit(-1);
+    }
+
+    if (fread(&header, sizeof(header), 1, fp) != 1
+        || header.magic != NGR_TRACE_MAGIC
+        || header.version != NGR_TRACE_VERSION
+        || header.capacity == 0)
+    {
+        fprintf(stderr, "%s is not a trace file\n", argv[1]);
+        exit(-1);
+    }
+
+    first = header.head > header.capacity ? header.head - header.capacity : 0;
+
+    records = malloc((header.head - first) * sizeof(record) + 1);
+    if (records == NULL) {
+        fprintf(stderr, "can not allocate %llu records\n",
+                (unsigned long long)(header.head - first));
+        exit(-1);
+    }
+
+    for (i = first; i < header.head; i++) {
+
+        if (fseek(fp, sizeof(header) + (i & (header.capacity - 1))
+                      * sizeof(record), SEEK_SET) != 0
+            || fread(&record, sizeof(record), 1, fp) != 1)
+        {
+            break;
+        }
+
+        if (record.phase == NGR_TRACE_IO || record.phase == NGR_TRACE_TIMER) {
+            records[n++] = record;
+        }
+    }
+
+    fclose(fp);
+
+    if (n == 0) {
+        fprintf(stderr, "%s has no io or timer records\n", argv[1]);
+        exit(-1);
+    }
+
+    ev = ngr_event_new(0);
+    if (!ev) {
+        fprintf(stderr, "can not create event object\n");
+        exit(-1);
+    }
+
+    t0 = records[0].ts;
+    span = (records[n - 1].ts - t0) / 1000 + 1;  /* usec */
+
+    /* the recorded fds, but never the ones the loop uses itself */
+    for (i = 0; i < n; i++) {
+        int fd = (int)records[i].id;
+
+        if (records[i].phase != NGR_TRACE_IO) continue;
+
+        if (fd < 0 || fd >= ev->max_events
+            || (ev->events[fd].mask != NGR_EVENT_NONE
+                && ev->events[fd].rev_handler != replay_io_handler))
+        {
+            records[i].phase = 0;
+            skipped++;
+            continue;
+        }
+
+        if (ev->events[fd].mask == NGR_EVENT_NONE) {
+            ngr_event_create_io_event(ev, fd, NGR_EVENT_READABLE,
+                                      replay_io_handler, NULL);
+        }
+    }
+
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < n; i++) {
+            at = ngr_sim_now() + r * span + (records[i].ts - t0) / 1000;
+
+            if (records[i].phase == NGR_TRACE_IO) {
+                ngr_sim_inject(ev, at, (int)records[i].id,
+                               NGR_EVENT_READABLE);
+
+            } else if (records[i].phase == NGR_TRACE_TIMER) {
+                ngr_event_create_timer(ev, (at - ngr_sim_now()) / 1000,
+                                       replay_timer_handler, NULL, NULL);
+            }
+        }
+    }
+
+    start = replay_nsec();
+    ngr_event_loop(ev); /* returns once nothing is left to replay */
+    elapsed = replay_nsec() - start;
+
+    printf("records  %10llu (%d io records skipped)\n",
+           (unsigned long long)n, skipped);
+    printf("io       %10llu events\n", (unsigned long long)io_events);
+    printf("timers   %10llu events, lateness max %lld usec\n",
+           (unsigned long long)timer_events,
+           (long long)ev->stats.timer_lateness_max);
+    printf("virtual  %10lld usec\n", (long long)ngr_sim_now());
+    total = io_events + timer_events;
+    printf("wall     %10lld usec %8.2f ns/event\n", (long long)elapsed / 1000,
+           (double)elapsed / (total ? total : 1));
+
+    ngr_event_destroy(ev);
+    free(records);
+
+    return 0;
+}
@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 2012-2013, Liexusong <liexusong at qq dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE  /* memmem */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ngr_stream.h"
+
+
+/*
+ * Hand the complete frames in the ring to the frame handler. Returns -1
+ * when the handler destroyed the stream, EMSGSIZE when the next frame
+ * can't fit in the ring, 0 when more input is needed.
+ */
+static int ngr_stream_parse(ngr_stream_t *st)
+{
+    ngr_ring_t *ring = &st->ring;
+    char *p, *q, *frame;
+    size_t len, flen, skip, i;
+
+    for ( ;; ) {
+        p = ngr_ring_data(ring);
+        len = ngr_ring_used(ring);
+
+        if (st->framing == NGR_STREAM_LENGTH) {
+
+            if (len < st->prefix) {
+                break;
+            }
+
+            for (flen = 0, i = 0; i < st->prefix; i++) {
+                flen = (flen << 8) | (unsigned char)p[i];
+            }
+
+            if (flen > ring->size - st->prefix) {
+                return EMSGSIZE;
+            }
+
+            if (len - st->prefix < flen) {
+                break;
+            }
+
+            frame = p + st->prefix;
+            skip = st->prefix + flen;
+
+        } else {
+
+            q = memmem(p + st->scanned, len - st->scanned,
+                       st->delim, st->delim_len);
+
+            if (q == NULL) { /* don't search the same bytes again */
+                if (len >= st->delim_len) {
+                    st->scanned = len - st->delim_len + 1;
+                }
+
+                break;
+            }
+
+            frame = p;
+            flen = q - p;
+            skip = flen + st->delim_len;
+            st->scanned = 0;
+        }
+
+        /* consumed up front, the view stays mapped until the next read */
+        ngr_ring_consume(ring, skip);
+        st->frames++;
+
+        if (st->handler(st->ev, st, frame, flen, st->data) == -1) {
+            return -1;
+        }
+    }
+
+    if (ngr_ring_space(ring) == 0) { /* the ring is full of one frame */
+        return EMSGSIZE;
+    }
+
+    return 0;
+}
+
+
+static void ngr_stream_handle(ngr_event_t *ev, int fd, void *data, int mask)
+{
+    ngr_stream_t *st = data;
+    ngr_ring_t *ring = &st->ring;
+    size_t want;
+    ssize_t n;
+    int i, rc, eof = 0, err = 0;
+
+    for (i = 0; i < st->reads; i++) {
+
+        want = ngr_ring_space(ring);
+        if (want == 0) {
+            break;
+        }
+
+        if (want > st->read_size) want = st->read_size;
+
+        n = read(fd, ngr_ring_tail(ring), want);
+        st->read_calls++;
+
+        if (n > 0) {
+            ngr_ring_produce(ring, n);
+            st->received += n;
+
+            if ((size_t)n < want) { /* drained, skip the EAGAIN round */
+                break;
+            }
+
+            continue;
+        }
+
+        if (n == 0) {
+            eof = 1;
+
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK
+                   && errno != EINTR)
+        {
+            err = errno;
+        }
+
+        break;
+    }
+
+    rc = ngr_stream_parse(st);
+    if (rc == -1) {
+        return;
+    }
+
+    if (err == 0 && rc != 0) {
+        err = rc;
+    }
+
+    if (!eof && err == 0) {
+        return;
+    }
+
+    if (st->close_handler) {
+        st->close_handler(ev, st, err, st->data);
+    } else {
+        ngr_stream_destroy(st);
+        ngr_event_close_fd(ev, fd);
+    }
+}
+
+
+/*
+ * Reads fd into a mirrored ring of size bytes and cuts it into frames,
+ * 4 byte length prefixed by default. A NULL close handler closes the fd
+ * and destroys the stream.
+ */
+ngr_stream_t *ngr_stream_new(ngr_event_t *ev, int fd, size_t size,
+    ngr_stream_frame_handler *handler, ngr_stream_close_handler *close_handler,
+    void *data)
+{
+    ngr_stream_t *st;
+
+    if (size == 0) {
+        size = NGR_STREAM_DEFAULT_SIZE;
+    }
+
+    st = calloc(1, sizeof(*st));
+    if (st == NULL) {
+        return NULL;
+    }
+
+    if (ngr_ring_init(&st->ring, size) == -1) {
+        free(st);
+        return NULL;
+    }
+
+    st->ev = ev;
+    st->fd = fd;
+    st->framing = NGR_STREAM_LENGTH;
+    st->prefix = 4;
+    st->read_size = NGR_STREAM_DEFAULT_READ;
+    st->reads = NGR_STREAM_DEFAULT_READS;
+    st->handler = handler;
+    st->close_handler = close_handler;
+    st->data = data;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    if (ngr_event_create_io_event(ev, fd, NGR_EVENT_READABLE,
+            ngr_stream_handle, st) == -1)
+    {
+        ngr_ring_destroy(&st->ring);
+        free(st);
+        return NULL;
+    }
+
+    return st;
+}
+
+
+/* the fd is left open, it belongs to the caller */
+void ngr_stream_destroy(ngr_stream_t *st)
+{
+    ngr_event_del_io_event(st->ev, st->fd, NGR_EVENT_READABLE);
+    ngr_ring_destroy(&st->ring);
+    free(st);
+}
+
+
+int ngr_stream_set_length(ngr_stream_t *st, size_t prefix)
+{
+    if (prefix == 0 || prefix > 8) {
+        return -1;
+    }
+
+    st->framing = NGR_STREAM_LENGTH;
+    st->prefix = prefix;
+
+    return 0;
+}
+
+
+int ngr_stream_set_delimiter(ngr_stream_t *st, const char *delim, size_t len)
+{
+    if (len == 0 || len > NGR_STREAM_MAX_DELIMITER) {
+        return -1;
+    }
+
+    memcpy(st->delim, delim, len);
+    st->delim_len = len;
+    st->scanned = 0;
+    st->framing = NGR_STREAM_DELIMITER;
+
+    return 0;
+}
+
+
+/* read_size bytes per read call, at most reads calls per readable event */
+void ngr_stream_set_read_size(ngr_stream_t *st, size_t read_size, int reads)
+{
+    st->read_size = read_size > 0 ? read_size : NGR_STREAM_DEFAULT_READ;
+    st->reads = reads > 0 ? reads : NGR_STREAM_DEFAULT_READS;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2012-2013, Liexusong <liexusong at qq dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _NGR_STREAM_H
+#define _NGR_STREAM_H
+
+#include "ngr_event.h"
+#include "ngr_ring.h"
+
+
+#define NGR_STREAM_DEFAULT_SIZE    65536  /* ring bytes, the max frame */
+#define NGR_STREAM_DEFAULT_READ    16384  /* bytes per read call */
+#define NGR_STREAM_DEFAULT_READS   4      /* read calls per readable event */
+#define NGR_STREAM_MAX_DELIMITER   8
+
+#define NGR_STREAM_LENGTH     0  /* big endian length prefix */
+#define NGR_STREAM_DELIMITER  1
+
+typedef struct ngr_stream_s ngr_stream_t;
+
+/*
+ * Receives one complete frame, the view points into the input ring and
+ * is valid until the handler returns. Returns -1 when the handler has
+ * destroyed the stream, 0 to go on.
+ */
+typedef int ngr_stream_frame_handler(ngr_event_t *ev, ngr_stream_t *st,
+    char *frame, size_t len, void *data);
+
+/* end of file (err is 0), read error or a frame larger than the ring */
+typedef void ngr_stream_close_handler(ngr_event_t *ev, ngr_stream_t *st,
+    int err, void *data);
+
+
+struct ngr_stream_s {
+    ngr_event_t *ev;
+    int fd;
+    ngr_ring_t ring;
+    int framing;
+    size_t prefix;                 /* length prefix bytes, 1 to 8 */
+    char delim[NGR_STREAM_MAX_DELIMITER];
+    size_t delim_len;
+    size_t scanned;                /* bytes searched for the delimiter */
+    size_t read_size;
+    int reads;
+    ngr_stream_frame_handler *handler;
+    ngr_stream_close_handler *close_handler;
+    void *data;
+
+    uint64_t received;
+    uint64_t frames;
+    uint64_t read_calls;
+};
+
+
+ngr_stream_t *ngr_stream_new(ngr_event_t *ev, int fd, size_t size,
+    ngr_stream_frame_handler *handler, ngr_stream_close_handler *close_handler,
+    void *data);
+void ngr_stream_destroy(ngr_stream_t *st);
+int ngr_stream_set_length(ngr_stream_t *st, size_t prefix);
+int ngr_stream_set_delimiter(ngr_stream_t *st, const char *delim, size_t len);
+void ngr_stream_set_read_size(ngr_stream_t *st, size_t read_size, int reads);
+
+#endif
@@ -0,0 +1,505 @@
+/*
+ * Copyright (c) 2012-2013, Liexusong <liexusong at qq dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "ngr_thread.h"
+
+#ifdef HAVE_EPOLL
+#include <sys/eventfd.h>
+#endif
+
+
+static int64_t ngr_thread_current_usec()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+static void ngr_thread_notify(ngr_thread_pool_t *pool)
+{
+#ifdef HAVE_EPOLL
+    uint64_t one = 1;
+
+    (void)write(pool->notify[1], &one, sizeof(one));
+#else
+    char c = 0;
+
+    (void)write(pool->notify[1], &c, 1);
+#endif
+}
+
+
+static void *ngr_thread_worker(void *arg)
+{
+    ngr_thread_pool_t *pool = arg;
+    ngr_thread_task_t *task;
+    int wakeup;
+
+    pthread_mutex_lock(&pool->lock);
+
+    for ( ;; ) {
+
+        while (pool->head == NULL && !pool->exiting) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+
+        if (pool->head == NULL) { /* exiting and nothing left */
+            break;
+        }
+
+        task = pool->head;
+        pool->head = task->next;
+        if (pool->head == NULL) pool->tail = NULL;
+        pool->stats.depth--;
+
+        pthread_mutex_unlock(&pool->lock);
+
+        task->started = ngr_thread_current_usec();
+        task->handler(task);
+        task->finished = ngr_thread_current_usec();
+
+        pthread_mutex_lock(&pool->lock);
+
+        pool->stats.wait_time += task->started - task->queued;
+        pool->stats.run_time += task->finished - task->started;
+
+        /* only the first completion of a batch has to wake up the loop */
+        wakeup = (pool->done == NULL);
+
+        task->next = pool->done;
+        pool->done = task;
+
+        if (wakeup) {
+            ngr_thread_notify(pool);
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+
+static void ngr_thread_complete(ngr_event_t *ev, int fd, void *data, int mask)
+{
+    ngr_thread_pool_t *pool = data;
+    ngr_thread_task_t *batch, *task, *next;
+    int64_t now, latency;
+    char buf[64];
+
+    while (read(fd, buf, sizeof(buf)) > 0) {
+        /* void */
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    batch = pool->done;
+    pool->done = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (batch == NULL) {
+        return;
+    }
+
+    /* the done list is newest first, reverse it to complete in order */
+    for (task = batch, batch = NULL; task; task = next) {
+        next = task->next;
+        task->next = batch;
+        batch = task;
+    }
+
+    now = ngr_thread_current_usec();
+
+    /* the stats are read under the lock by ngr_thread_pool_stats() */
+    pthread_mutex_lock(&pool->lock);
+
+    pool->stats.batches++;
+
+    for (task = batch; task; task = task->next) {
+        latency = now - task->queued;
+
+        pool->stats.completed++;
+        if (latency > pool->stats.latency_max) {
+            pool->stats.latency_max = latency;
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    for (task = batch; task; task = next) {
+        next = task->next;
+
+        if (task->done) {
+            task->done(ev, task);
+        }
+
+        free(task);
+    }
+}
+
+
+ngr_thread_pool_t *ngr_thread_pool_new(ngr_event_t *ev, int threads)
+{
+    ngr_thread_pool_t *pool;
+    int i;
+
+    if (threads <= 0) {
+        threads = NGR_THREAD_DEFAULT_THREADS;
+    }
+
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->ev = ev;
+
+    pool->threads = malloc(threads * sizeof(pthread_t));
+    if (pool->threads == NULL) {
+        free(pool);
+        return NULL;
+    }
+
+#ifdef HAVE_EPOLL
+    pool->notify[0] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    pool->notify[1] = pool->notify[0];
+    if (pool->notify[0] == -1) {
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+#else
+    if (pipe(pool->notify) == -1) {
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+
+    fcntl(pool->notify[0], F_SETFL, O_NONBLOCK);
+    fcntl(pool->notify[1], F_SETFL, O_NONBLOCK);
+#endif
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    if (ngr_event_create_io_event(ev, pool->notify[0], NGR_EVENT_READABLE,
+            ngr_thread_complete, pool) == -1)
+    {
+        goto failed;
+    }
+
+    ngr_event_pin(ev, pool->notify[0]);
+
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, ngr_thread_worker,
+                pool) != 0)
+        {
+            break;
+        }
+        pool->nthreads++;
+    }
+
+    if (pool->nthreads == 0) {
+        ngr_event_del_io_event(ev, pool->notify[0], NGR_EVENT_READABLE);
+        goto failed;
+    }
+
+    return pool;
+
+failed:
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    close(pool->notify[0]);
+    if (pool->notify[1] != pool->notify[0]) close(pool->notify[1]);
+    free(pool->threads);
+    free(pool);
+
+    return NULL;
+}
+
+
+/*
+ * Waits for the queued tasks to run, completions which were not dispatched
+ * by the loop yet are dropped without calling their done handler.
+ */
+void ngr_thread_pool_destroy(ngr_thread_pool_t *pool)
+{
+    ngr_thread_task_t *task;
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->exiting = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    while (pool->done) {
+        task = pool->done;
+        pool->done = task->next;
+        if (task->res) freeaddrinfo(task->res);
+        free(task->host);
+        free(task->service);
+        free(task);
+    }
+
+    ngr_event_del_io_event(pool->ev, pool->notify[0], NGR_EVENT_READABLE);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    close(pool->notify[0]);
+    if (pool->notify[1] != pool->notify[0]) close(pool->notify[1]);
+    free(pool->threads);
+    free(pool);
+}
+
+
+static ngr_thread_task_t *ngr_thread_task_alloc(
+    ngr_thread_task_handler *handler, ngr_thread_done_handler *done,
+    void *data)
+{
+    ngr_thread_task_t *task;
+
+    task = calloc(1, sizeof(*task));
+    if (task == NULL) {
+        return NULL;
+    }
+
+    task->handler = handler;
+    task->done = done;
+    task->data = data;
+    task->fd = -1;
+
+    return task;
+}
+
+
+static int ngr_thread_task_post(ngr_thread_pool_t *pool,
+    ngr_thread_task_t *task)
+{
+    task->queued = ngr_thread_current_usec();
+    task->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->exiting) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+
+    if (pool->tail) {
+        pool->tail->next = task;
+    } else {
+        pool->head = task;
+    }
+    pool->tail = task;
+
+    pool->stats.depth++;
+    if (pool->stats.depth > pool->stats.max_depth) {
+        pool->stats.max_depth = pool->stats.depth;
+    }
+
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+
+int ngr_thread_post(ngr_thread_pool_t *pool, ngr_thread_task_handler *handler,
+    ngr_thread_done_handler *done, void *data)
+{
+    ngr_thread_task_t *task;
+
+    task = ngr_thread_task_alloc(handler, done, data);
+    if (task == NULL) {
+        return -1;
+    }
+
+    if (ngr_thread_task_post(pool, task) == -1) {
+        free(task);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static void ngr_thread_pread_handler(ngr_thread_task_t *task)
+{
+    task->result = pread(task->fd, task->buf, task->len, task->offset);
+    task->err = task->result == -1 ? errno : 0;
+}
+
+
+static void ngr_thread_pwrite_handler(ngr_thread_task_t *task)
+{
+    task->result = pwrite(task->fd, task->buf, task->len, task->offset);
+    task->err = task->result == -1 ? errno : 0;
+}
+
+
+static void ngr_thread_fsync_handler(ngr_thread_task_t *task)
+{
+    task->result = fsync(task->fd);
+    task->err = task->result == -1 ? errno : 0;
+}
+
+
+static void ngr_thread_io_done(ngr_event_t *ev, ngr_thread_task_t *task)
+{
+    ngr_thread_io_handler *handler = task->callback;
+
+    handler(ev, task->result, task->err, task->data);
+}
+
+
+static int ngr_thread_post_io(ngr_thread_pool_t *pool,
+    ngr_thread_task_handler *op, int fd, void *buf, size_t len,
+    off_t offset, ngr_thread_io_handler *handler, void *data)
+{
+    ngr_thread_task_t *task;
+
+    task = ngr_thread_task_alloc(op, ngr_thread_io_done, data);
+    if (task == NULL) {
+        return -1;
+    }
+
+    task->fd = fd;
+    task->buf = buf;
+    task->len = len;
+    task->offset = offset;
+    task->callback = handler;
+
+    if (ngr_thread_task_post(pool, task) == -1) {
+        free(task);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int ngr_thread_pread(ngr_thread_pool_t *pool, int fd, void *buf, size_t len,
+    off_t offset, ngr_thread_io_handler *handler, void *data)
+{
+    return ngr_thread_post_io(pool, ngr_thread_pread_handler, fd, buf, len,
+                              offset, handler, data);
+}
+
+
+int ngr_thread_pwrite(ngr_thread_pool_t *pool, int fd, void *buf, size_t len,
+    off_t offset, ngr_thread_io_handler *handler, void *data)
+{
+    return ngr_thread_post_io(pool, ngr_thread_pwrite_handler, fd, buf, len,
+                              offset, handler, data);
+}
+
+
+int ngr_thread_fsync(ngr_thread_pool_t *pool, int fd,
+    ngr_thread_io_handler *handler, void *data)
+{
+    return ngr_thread_post_io(pool, ngr_thread_fsync_handler, fd, NULL, 0,
+                              0, handler, data);
+}
+
+
+static void ngr_thread_resolve_task(ngr_thread_task_t *task)
+{
+    /* buf points to the hints, NULL when the caller gave none */
+    task->err = getaddrinfo(task->host, task->service, task->buf,
+                            &task->res);
+}
+
+
+static void ngr_thread_resolve_done(ngr_event_t *ev, ngr_thread_task_t *task)
+{
+    ngr_thread_resolve_handler *handler = task->callback;
+
+    /* the handler owns the result and must freeaddrinfo() it */
+    handler(ev, task->err ? NULL : task->res, task->err, task->data);
+
+    free(task->host);
+    free(task->service);
+}
+
+
+int ngr_thread_getaddrinfo(ngr_thread_pool_t *pool, const char *host,
+    const char *service, const struct addrinfo *hints,
+    ngr_thread_resolve_handler *handler, void *data)
+{
+    ngr_thread_task_t *task;
+
+    task = ngr_thread_task_alloc(ngr_thread_resolve_task,
+                                 ngr_thread_resolve_done, data);
+    if (task == NULL) {
+        return -1;
+    }
+
+    task->callback = handler;
+
+    if (hints) {
+        task->hints = *hints;
+        task->buf = &task->hints;
+    }
+
+    if ((host && (task->host = strdup(host)) == NULL)
+        || (service && (task->service = strdup(service)) == NULL)
+        || ngr_thread_task_post(pool, task) == -1)
+    {
+        free(task->host);
+        free(task->service);
+        free(task);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void ngr_thread_pool_stats(ngr_thread_pool_t *pool,
+    ngr_thread_pool_stats_t *stats)
+{
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
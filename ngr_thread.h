@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2012-2013, Liexusong <liexusong at qq dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _NGR_THREAD_H
+#define _NGR_THREAD_H
+
+#include <pthread.h>
+#include <netdb.h>
+#include "ngr_event.h"
+
+
+#define NGR_THREAD_DEFAULT_THREADS  4
+
+typedef struct ngr_thread_pool_s ngr_thread_pool_t;
+typedef struct ngr_thread_task_s ngr_thread_task_t;
+
+/* runs in a worker thread */
+typedef void ngr_thread_task_handler(ngr_thread_task_t *task);
+/* runs in the loop thread after the task finished */
+typedef void ngr_thread_done_handler(ngr_event_t *ev, ngr_thread_task_t *task);
+
+typedef void ngr_thread_io_handler(ngr_event_t *ev, ssize_t n, int err,
+    void *data);
+typedef void ngr_thread_resolve_handler(ngr_event_t *ev, struct addrinfo *res,
+    int err, void *data);
+
+
+struct ngr_thread_task_s {
+    ngr_thread_task_handler *handler;
+    ngr_thread_done_handler *done;
+    void *data;
+    int64_t queued;          /* usec, when the task was posted */
+    int64_t started;         /* usec, when a worker picked it up */
+    int64_t finished;        /* usec, when its handler returned */
+
+    /* arguments and results of the builtin operations */
+    int fd;
+    void *buf;
+    size_t len;
+    off_t offset;
+    ssize_t result;
+    int err;
+    char *host;
+    char *service;
+    struct addrinfo hints;
+    struct addrinfo *res;
+    void *callback;
+
+    ngr_thread_task_t *next;
+};
+
+
+typedef struct ngr_thread_pool_stats_s {
+    int depth;               /* tasks waiting for a worker */
+    int max_depth;
+    uint64_t completed;
+    uint64_t batches;        /* completion batches dispatched by the loop */
+    int64_t wait_time;       /* usec, total time queued before running */
+    int64_t run_time;        /* usec, total time running in workers */
+    int64_t latency_max;     /* usec, worst post to completion latency */
+} ngr_thread_pool_stats_t;
+
+
+struct ngr_thread_pool_s {
+    ngr_event_t *ev;
+    int nthreads;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    ngr_thread_task_t *head;     /* pending tasks */
+    ngr_thread_task_t *tail;
+    ngr_thread_task_t *done;     /* finished tasks, newest first */
+    int notify[2];               /* notify[0] is watched by the loop */
+    ngr_thread_pool_stats_t stats;
+    ngr_uint8_t exiting:1;
+};
+
+
+ngr_thread_pool_t *ngr_thread_pool_new(ngr_event_t *ev, int threads);
+void ngr_thread_pool_destroy(ngr_thread_pool_t *pool);
+int ngr_thread_post(ngr_thread_pool_t *pool, ngr_thread_task_handler *handler,
+    ngr_thread_done_handler *done, void *data);
+int ngr_thread_pread(ngr_thread_pool_t *pool, int fd, void *buf, size_t len,
+    off_t offset, ngr_thread_io_handler *handler, void *data);
+int ngr_thread_pwrite(ngr_thread_pool_t *pool, int fd, void *buf, size_t len,
+    off_t offset, ngr_thread_io_handler *handler, void *data);
+int ngr_thread_fsync(ngr_thread_pool_t *pool, int fd,
+    ngr_thread_io_handler *handler, void *data);
+int ngr_thread_getaddrinfo(ngr_thread_pool_t *pool, const char *host,
+    const char *service, const struct addrinfo *hints,
+    ngr_thread_resolve_handler *handler, void *data);
+void ngr_thread_pool_stats(ngr_thread_pool_t *pool,
+    ngr_thread_pool_stats_t *stats);
+
+#endif
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2012-2013, Liexusong <liexusong at qq dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "ngr_trace.h"
+
+
+/*
+ * Map a ring of records (rounded up to a power of 2) backed by path.
+ * Attach it to a loop with ngr_event_set_trace().
+ */
+ngr_trace_t *ngr_trace_open(const char *path, int records)
+{
+    ngr_trace_t *trace;
+    uint64_t capacity;
+    void *addr;
+
+    if (records <= 0) {
+        records = NGR_TRACE_DEFAULT_RECORDS;
+    }
+
+    for (capacity = 1; capacity < (uint64_t)records; capacity <<= 1) {
+        /* void */
+    }
+
+    trace = malloc(sizeof(*trace));
+    if (trace == NULL) {
+        return NULL;
+    }
+
+    trace->size = sizeof(ngr_trace_header_t)
+                  + capacity * sizeof(ngr_trace_record_t);
+
+    trace->fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (trace->fd == -1) {
+        free(trace);
+        return NULL;
+    }
+
+    if (ftruncate(trace->fd, trace->size) == -1) {
+        goto failed;
+    }
+
+    addr = mmap(NULL, trace->size, PROT_READ|PROT_WRITE, MAP_SHARED,
+                trace->fd, 0);
+    if (addr == MAP_FAILED) {
+        goto failed;
+    }
+
+    trace->header = addr;
+    trace->records = (ngr_trace_record_t *)(trace->header + 1);
+    trace->mask = capacity - 1;
+
+    memset(trace->header, 0, sizeof(ngr_trace_header_t));
+    trace->header->magic = NGR_TRACE_MAGIC;
+    trace->header->version = NGR_TRACE_VERSION;
+    trace->header->capacity = capacity;
+
+    return trace;
+
+failed:
+
+    close(trace->fd);
+    free(trace);
+
+    return NULL;
+}
+
+
+/* detach it from its loop first */
+void ngr_trace_close(ngr_trace_t *trace)
+{
+    munmap(trace->header, trace->size);
+    close(trace->fd);
+    free(trace);
+}
+
+
+const char *ngr_trace_phase_name(uint32_t phase)
+{
+    switch (phase) {
+    case NGR_TRACE_POLL:   return "poll";
+    case NGR_TRACE_IO:     return "io";
+    case NGR_TRACE_BATCH:  return "batch";
+    case NGR_TRACE_SIGNAL: return "signal";
+    case NGR_TRACE_TIMER:  return "timer";
+    }
+
+    return "unknown";
+}
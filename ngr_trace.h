@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2012-2013, Liexusong <liexusong at qq dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Loop activity tracer. Fixed size records go to a ring buffer mapped
+ * from a file, so a dump survives the process and can be converted with
+ * ngr_trace_dump. The loop only pays a pointer check per phase while no
+ * tracer is attached, and nothing at all when built with
+ * -DNGR_EVENT_NO_TRACE.
+ */
+
+#ifndef _NGR_TRACE_H
+#define _NGR_TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+
+#define NGR_TRACE_MAGIC    0x6e677274  /* "ngrt" */
+#define NGR_TRACE_VERSION  1
+#define NGR_TRACE_DEFAULT_RECORDS  (1 << 16)
+
+#define NGR_TRACE_POLL    1   /* id: events returned */
+#define NGR_TRACE_IO      2   /* id: fd */
+#define NGR_TRACE_BATCH   3   /* id: fds in the batch */
+#define NGR_TRACE_SIGNAL  4   /* id: signo */
+#define NGR_TRACE_TIMER   5   /* id: timer address */
+
+typedef struct ngr_trace_record_s {
+    int64_t ts;              /* nsec, CLOCK_MONOTONIC */
+    int64_t duration;        /* nsec */
+    int64_t id;
+    uint32_t phase;
+    uint32_t reserved;
+} ngr_trace_record_t;
+
+
+typedef struct ngr_trace_header_s {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;       /* records, a power of 2 */
+    uint64_t head;           /* records written so far */
+    uint64_t reserved;
+} ngr_trace_header_t;
+
+
+typedef struct ngr_trace_s {
+    ngr_trace_header_t *header;
+    ngr_trace_record_t *records;
+    uint64_t mask;
+    size_t size;             /* mapping size */
+    int fd;
+} ngr_trace_t;
+
+
+static inline int64_t ngr_trace_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static inline void ngr_trace_write(ngr_trace_t *trace, uint32_t phase,
+    int64_t id, int64_t start)
+{
+    ngr_trace_record_t *r;
+    uint64_t head = trace->header->head;
+
+    r = &trace->records[head & trace->mask];
+    r->ts = start;
+    r->duration = ngr_trace_now() - start;
+    r->id = id;
+    r->phase = phase;
+    r->reserved = 0;
+
+    trace->header->head = head + 1;
+}
+
+
+#ifndef NGR_EVENT_NO_TRACE
+
+#define ngr_trace_begin(ev)                                                   \
+    ((ev)->trace ? ngr_trace_now() : 0)
+
+/* a tracer attached since ngr_trace_begin() has no start to measure */
+#define ngr_trace_end(ev, phase, id, start)                                   \
+    do {                                                                      \
+        if ((ev)->trace && (start) != 0) {                                    \
+            ngr_trace_write((ev)->trace, phase, (int64_t)(id), start);        \
+        }                                                                     \
+    } while (0)
+
+#else
+
+#define ngr_trace_begin(ev)                  0
+#define ngr_trace_end(ev, phase, id, start)  (void)(start)
+
+#endif
+
+
+ngr_trace_t *ngr_trace_open(const char *path, int records);
+void ngr_trace_close(ngr_trace_t *trace);
+const char *ngr_trace_phase_name(uint32_t phase);
+
+#endif
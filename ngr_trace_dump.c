@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2012-2013, Liexusong <liexusong at qq dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Convert a ring buffer written by ngr_trace to Chrome trace event JSON,
+ * which chrome://tracing and Perfetto open directly:
+ *
+ *   ngr_trace_dump loop.trace > loop.json
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "ngr_trace.h"
+
+
+int main(int argc, char *argv[])
+{
+    ngr_trace_header_t header;
+    ngr_trace_record_t record;
+    uint64_t first, i;
+    FILE *fp;
+    int pid = 1, comma = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <trace file> [pid]\n", argv[0]);
+        exit(-1);
+    }
+
+    if (argc > 2) {
+        pid = atoi(argv[2]);
+    }
+
+    fp = fopen(argv[1], "rb");
+    if (!fp) {
+        fprintf(stderr, "can not open %s\n", argv[1]);
+        exit(-1);
+    }
+
+    if (fread(&header, sizeof(header), 1, fp) != 1
+        || header.magic != NGR_TRACE_MAGIC
+        || header.version != NGR_TRACE_VERSION
+        || header.capacity == 0)
+    {
+        fprintf(stderr, "%s is not a trace file\n", argv[1]);
+        exit(-1);
+    }
+
+    /* the ring keeps the last capacity records */
+    first = header.head > header.capacity ? header.head - header.capacity : 0;
+
+    printf("{\"traceEvents\":[\n");
+
+    for (i = first; i < header.head; i++) {
+
+        if (fseek(fp, sizeof(header) + (i & (header.capacity - 1))
+                      * sizeof(record), SEEK_SET) != 0
+            || fread(&record, sizeof(record), 1, fp) != 1)
+        {
+            break;
+        }
+
+        printf("%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":1,"
+               "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"id\":%" PRId64 "}}",
+               comma ? ",\n" : "", ngr_trace_phase_name(record.phase), pid,
+               record.ts / 1000.0, record.duration / 1000.0, record.id);
+        comma = 1;
+    }
+
+    printf("\n],\"displayTimeUnit\":\"ns\"}\n");
+
+    fclose(fp);
+
+    return 0;
+}
@@ -0,0 +1,459 @@
+/*
+ * Copyright (c) 2012-2013, Liexusong <liexusong at qq dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "ngr_upstream.h"
+
+
+static void ngr_upstream_link(ngr_upstream_list_t *list,
+    ngr_upstream_conn_t *c)
+{
+    c->prev = list->last;
+    c->next = NULL;
+
+    if (list->last) list->last->next = c;
+    else list->first = c;
+
+    list->last = c;
+    list->count++;
+}
+
+
+static void ngr_upstream_unlink(ngr_upstream_list_t *list,
+    ngr_upstream_conn_t *c)
+{
+    if (c->prev) c->prev->next = c->next;
+    else list->first = c->next;
+
+    if (c->next) c->next->prev = c->prev;
+    else list->last = c->prev;
+
+    list->count--;
+}
+
+
+/* close a connection of the pool, the fd included */
+static void ngr_upstream_free(ngr_upstream_t *up, ngr_upstream_conn_t *c)
+{
+    ngr_event_close_fd(up->ev, c->fd);
+
+    up->conns[c->fd] = NULL;
+    up->nconns--;
+
+    free(c);
+}
+
+
+/* a readable idle connection was closed by the peer or is out of sync */
+static void ngr_upstream_idle_handler(ngr_event_t *ev, int fd, void *data,
+    int mask)
+{
+    ngr_upstream_t *up = data;
+    ngr_upstream_conn_t *c = up->conns[fd];
+
+    ngr_upstream_unlink(&up->idle, c);
+    ngr_upstream_free(up, c);
+    up->evicted++;
+}
+
+
+static void ngr_upstream_idle(ngr_upstream_t *up, ngr_upstream_conn_t *c)
+{
+    ngr_event_del_io_event(up->ev, c->fd,
+                           NGR_EVENT_READABLE|NGR_EVENT_WRITABLE);
+
+    if (up->idle.count >= up->max_idle
+        || ngr_event_create_io_event(up->ev, c->fd, NGR_EVENT_READABLE,
+               ngr_upstream_idle_handler, up) == -1)
+    {
+        ngr_upstream_free(up, c);
+        return;
+    }
+
+    /* idle sockets are the pool's, a drain doesn't wait for them */
+    ngr_event_pin(up->ev, c->fd);
+
+    c->state = NGR_UPSTREAM_IDLE;
+    c->since = up->ticks;
+    c->handler = NULL;
+    c->data = NULL;
+
+    ngr_upstream_link(&up->idle, c);
+}
+
+
+static void ngr_upstream_ready(ngr_upstream_t *up, ngr_upstream_conn_t *c)
+{
+    up->fails = 0;
+    up->down = 0;
+
+    if (c->handler == NULL) { /* health probe, straight to the idle list */
+        ngr_upstream_idle(up, c);
+        return;
+    }
+
+    c->state = NGR_UPSTREAM_BUSY;
+    c->handler(up->ev, up, c->fd, 0, c->data);
+}
+
+
+static void ngr_upstream_failed(ngr_upstream_t *up, ngr_upstream_conn_t *c,
+    int err)
+{
+    ngr_upstream_handler *handler = c->handler;
+    void *data = c->data;
+
+    ngr_upstream_free(up, c);
+
+    if (++up->fails >= NGR_UPSTREAM_MAX_FAILS) {
+        up->down = 1;
+    }
+
+    if (handler) {
+        handler(up->ev, up, -1, err, data);
+    }
+}
+
+
+static void ngr_upstream_connect_handler(ngr_event_t *ev, int fd, void *data,
+    int mask)
+{
+    ngr_upstream_t *up = data;
+    ngr_upstream_conn_t *c = up->conns[fd];
+    socklen_t len = sizeof(int);
+    int err = 0;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+        err = errno;
+    }
+
+    ngr_upstream_unlink(&up->connecting, c);
+    ngr_event_del_io_event(ev, fd, NGR_EVENT_WRITABLE);
+
+    if (err) {
+        ngr_upstream_failed(up, c, err);
+    } else {
+        ngr_upstream_ready(up, c);
+    }
+}
+
+
+static int ngr_upstream_connect(ngr_upstream_t *up,
+    ngr_upstream_handler *handler, void *data)
+{
+    ngr_upstream_conn_t *c;
+    int fd, err;
+
+#ifdef SOCK_NONBLOCK
+    fd = socket(up->addr.ss_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+#else
+    fd = socket(up->addr.ss_family, SOCK_STREAM, 0);
+    if (fd != -1) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (fd >= up->ev->max_events) {
+        close(fd);
+        errno = EMFILE;
+        return -1;
+    }
+
+    c = malloc(sizeof(*c));
+    if (c == NULL) {
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    c->fd = fd;
+    c->handler = handler;
+    c->data = data;
+
+    up->conns[fd] = c;
+    up->nconns++;
+    up->connects++;
+
+    if (connect(fd, (struct sockaddr *)&up->addr, up->addrlen) == 0) {
+        ngr_upstream_ready(up, c); /* unix sockets connect at once */
+        return 0;
+    }
+
+    err = errno;
+
+    if (err != EINPROGRESS
+        || ngr_event_create_io_event(up->ev, fd, NGR_EVENT_WRITABLE,
+               ngr_upstream_connect_handler, up) == -1)
+    {
+        ngr_upstream_free(up, c);
+
+        /* refused at once, counts like a failed async connect */
+        if (err != EINPROGRESS && ++up->fails >= NGR_UPSTREAM_MAX_FAILS) {
+            up->down = 1;
+        }
+
+        errno = err == EINPROGRESS ? ENOMEM : err;
+        return -1;
+    }
+
+    c->state = NGR_UPSTREAM_CONNECTING;
+    c->since = up->ticks;
+
+    ngr_upstream_link(&up->connecting, c);
+
+    return 0;
+}
+
+
+/*
+ * One periodic timer for every pool: connect timeouts and idle eviction
+ * only look at the oldest entries of their lists, so a tick costs the
+ * number of connections which expire in it.
+ */
+static void ngr_upstream_tick(ngr_event_t *ev, int ticks, void *data)
+{
+    ngr_upstream_t *up = data;
+    ngr_upstream_conn_t *c, *next;
+
+    up->ticks += ticks;
+
+    while ((c = up->connecting.first) != NULL
+           && up->ticks - c->since >= up->connect_ticks)
+    {
+        ngr_upstream_unlink(&up->connecting, c);
+        up->timeouts++;
+        ngr_upstream_failed(up, c, ETIMEDOUT);
+    }
+
+    while ((c = up->idle.first) != NULL
+           && up->ticks - c->since >= up->idle_ticks)
+    {
+        ngr_upstream_unlink(&up->idle, c);
+        ngr_upstream_free(up, c);
+        up->evicted++;
+    }
+
+    if (up->ticks - up->checked < up->check_ticks) {
+        return;
+    }
+
+    up->checked = up->ticks;
+
+    if (up->check) {
+        for (c = up->idle.first; c; c = next) {
+            next = c->next;
+
+            if (up->check(ev, up, c->fd, up->check_data) == -1) {
+                ngr_upstream_unlink(&up->idle, c);
+                ngr_upstream_free(up, c);
+                up->evicted++;
+            }
+        }
+    }
+
+    /* a down upstream gets one probe per check interval */
+    if (up->down && up->connecting.count == 0
+        && up->nconns < up->max_conns)
+    {
+        (void)ngr_upstream_connect(up, NULL, NULL);
+    }
+}
+
+
+ngr_upstream_t *ngr_upstream_new(ngr_event_t *ev, const struct sockaddr *addr,
+    socklen_t addrlen, int max_conns, int max_idle)
+{
+    ngr_upstream_t *up;
+
+    if (addrlen > sizeof(struct sockaddr_storage) || max_conns <= 0) {
+        return NULL;
+    }
+
+    up = calloc(1, sizeof(*up));
+    if (up == NULL) {
+        return NULL;
+    }
+
+    up->conns = calloc(ev->max_events, sizeof(ngr_upstream_conn_t *));
+    if (up->conns == NULL) {
+        free(up);
+        return NULL;
+    }
+
+    up->ev = ev;
+    memcpy(&up->addr, addr, addrlen);
+    up->addrlen = addrlen;
+    up->max_conns = max_conns;
+    up->max_idle = max_idle < 0 ? 0 : max_idle;
+
+    ngr_upstream_set_timeouts(up, 0, 0, 0);
+
+    up->periodic = ngr_event_add_periodic(ev, NGR_UPSTREAM_TICK,
+        NGR_EVENT_PERIODIC_SKIP, ngr_upstream_tick, up, NULL);
+    if (up->periodic == NULL) {
+        free(up->conns);
+        free(up);
+        return NULL;
+    }
+
+    return up;
+}
+
+
+/*
+ * Not from a handler of this upstream. Busy connections stay open, they
+ * belong to their handlers.
+ */
+void ngr_upstream_destroy(ngr_upstream_t *up)
+{
+    int fd;
+
+    ngr_event_del_periodic(up->ev, up->periodic);
+
+    for (fd = 0; fd < up->ev->max_events; fd++) {
+        ngr_upstream_conn_t *c = up->conns[fd];
+
+        if (c == NULL) continue;
+
+        if (c->state == NGR_UPSTREAM_BUSY) {
+            free(c);
+        } else {
+            ngr_upstream_free(up, c);
+        }
+    }
+
+    free(up->conns);
+    free(up);
+}
+
+
+/* msec, 0 keeps the default, rounded up to whole ticks */
+void ngr_upstream_set_timeouts(ngr_upstream_t *up, int64_t connect_timeout,
+    int64_t idle_timeout, int64_t check_interval)
+{
+    if (connect_timeout <= 0) connect_timeout = NGR_UPSTREAM_CONNECT_TIMEOUT;
+    if (idle_timeout <= 0) idle_timeout = NGR_UPSTREAM_IDLE_TIMEOUT;
+    if (check_interval <= 0) check_interval = NGR_UPSTREAM_CHECK_INTERVAL;
+
+    up->connect_ticks = (connect_timeout + NGR_UPSTREAM_TICK - 1)
+                      / NGR_UPSTREAM_TICK;
+    up->idle_ticks = (idle_timeout + NGR_UPSTREAM_TICK - 1)
+                   / NGR_UPSTREAM_TICK;
+    up->check_ticks = (check_interval + NGR_UPSTREAM_TICK - 1)
+                    / NGR_UPSTREAM_TICK;
+}
+
+
+void ngr_upstream_set_check(ngr_upstream_t *up,
+    ngr_upstream_check_handler *check, void *data)
+{
+    up->check = check;
+    up->check_data = data;
+}
+
+
+/*
+ * Hand a connection to handler: the most recently used idle one, else a
+ * new connect. Returns -1 with errno EAGAIN when max_conns are open and
+ * ECONNREFUSED while the upstream is down.
+ */
+int ngr_upstream_get(ngr_upstream_t *up, ngr_upstream_handler *handler,
+    void *data)
+{
+    ngr_upstream_conn_t *c = up->idle.last;
+
+    if (c != NULL) {
+        ngr_upstream_unlink(&up->idle, c);
+        ngr_event_del_io_event(up->ev, c->fd, NGR_EVENT_READABLE);
+
+        c->state = NGR_UPSTREAM_BUSY;
+        c->handler = handler;
+        c->data = data;
+        up->reused++;
+
+        handler(up->ev, up, c->fd, 0, data);
+        return 0;
+    }
+
+    if (up->down) {
+        errno = ECONNREFUSED;
+        return -1;
+    }
+
+    if (up->nconns >= up->max_conns) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return ngr_upstream_connect(up, handler, data);
+}
+
+
+/*
+ * Give a busy connection back for reuse, its io events are removed. The
+ * response must have been read completely.
+ */
+void ngr_upstream_put(ngr_upstream_t *up, int fd)
+{
+    ngr_upstream_conn_t *c;
+
+    if (fd < 0 || fd >= up->ev->max_events) return;
+
+    c = up->conns[fd];
+
+    if (c == NULL || c->state != NGR_UPSTREAM_BUSY) return;
+
+    ngr_upstream_idle(up, c);
+}
+
+
+/* a busy connection which can't be reused, the fd is closed */
+void ngr_upstream_close(ngr_upstream_t *up, int fd)
+{
+    ngr_upstream_conn_t *c;
+
+    if (fd < 0 || fd >= up->ev->max_events) return;
+
+    c = up->conns[fd];
+
+    if (c == NULL || c->state != NGR_UPSTREAM_BUSY) return;
+
+    ngr_upstream_free(up, c);
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2012-2013, Liexusong <liexusong at qq dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _NGR_UPSTREAM_H
+#define _NGR_UPSTREAM_H
+
+#include <sys/socket.h>
+#include "ngr_event.h"
+
+
+#define NGR_UPSTREAM_TICK             100    /* msec, timeout resolution */
+#define NGR_UPSTREAM_CONNECT_TIMEOUT  3000   /* msec */
+#define NGR_UPSTREAM_IDLE_TIMEOUT     60000  /* msec */
+#define NGR_UPSTREAM_CHECK_INTERVAL   5000   /* msec */
+#define NGR_UPSTREAM_MAX_FAILS        3      /* failed connects to be down */
+
+#define NGR_UPSTREAM_CONNECTING  1
+#define NGR_UPSTREAM_IDLE        2
+#define NGR_UPSTREAM_BUSY        3
+
+typedef struct ngr_upstream_s ngr_upstream_t;
+typedef struct ngr_upstream_conn_s ngr_upstream_conn_t;
+
+/*
+ * Receives a connected fd, or -1 and the errno of a failed connect. The
+ * fd belongs to the handler until ngr_upstream_put() or
+ * ngr_upstream_close(). A reused connection is handed over before
+ * ngr_upstream_get() returns.
+ */
+typedef void ngr_upstream_handler(ngr_event_t *ev, ngr_upstream_t *up,
+    int fd, int err, void *data);
+
+/* runs for every idle connection each check interval, -1 drops it */
+typedef int ngr_upstream_check_handler(ngr_event_t *ev, ngr_upstream_t *up,
+    int fd, void *data);
+
+
+struct ngr_upstream_conn_s {
+    int fd;
+    int state;
+    uint64_t since;                /* tick the state began */
+    ngr_upstream_handler *handler; /* NULL for health probes */
+    void *data;
+    ngr_upstream_conn_t *prev;
+    ngr_upstream_conn_t *next;
+};
+
+
+typedef struct ngr_upstream_list_s {
+    ngr_upstream_conn_t *first;    /* oldest */
+    ngr_upstream_conn_t *last;
+    int count;
+} ngr_upstream_list_t;
+
+
+struct ngr_upstream_s {
+    ngr_event_t *ev;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int max_conns;
+    int max_idle;
+    int nconns;                    /* connecting, idle and busy */
+    ngr_upstream_conn_t **conns;   /* indexed by fd */
+    ngr_upstream_list_t connecting;
+    ngr_upstream_list_t idle;      /* reused from the last */
+
+    /* timeouts counted in ticks of the shared periodic timer */
+    ngr_event_periodic_t *periodic;
+    uint64_t ticks;
+    uint64_t connect_ticks;
+    uint64_t idle_ticks;
+    uint64_t check_ticks;
+    uint64_t checked;              /* tick of the last check */
+    ngr_upstream_check_handler *check;
+    void *check_data;
+
+    int fails;                     /* consecutive failed connects */
+    int down;
+
+    uint64_t connects;
+    uint64_t reused;
+    uint64_t timeouts;
+    uint64_t evicted;
+};
+
+
+ngr_upstream_t *ngr_upstream_new(ngr_event_t *ev, const struct sockaddr *addr,
+    socklen_t addrlen, int max_conns, int max_idle);
+void ngr_upstream_destroy(ngr_upstream_t *up);
+void ngr_upstream_set_timeouts(ngr_upstream_t *up, int64_t connect_timeout,
+    int64_t idle_timeout, int64_t check_interval);
+void ngr_upstream_set_check(ngr_upstream_t *up,
+    ngr_upstream_check_handler *check, void *data);
+int ngr_upstream_get(ngr_upstream_t *up, ngr_upstream_handler *handler,
+    void *data);
+void ngr_upstream_put(ngr_upstream_t *up, int fd);
+void ngr_upstream_close(ngr_upstream_t *up, int fd);
+
+#endif
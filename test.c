@@ -1,22 +1,1909 @@
+#define _GNU_SOURCE  /* CPU_ISSET */
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include "ngr_event.h"
+#include "ngr_thread.h"
+#include "ngr_listener.h"
+#include "ngr_dgram.h"
+#include "ngr_channel.h"
+#include "ngr_executor.h"
+#include "ngr_ring.h"
+#include "ngr_stream.h"
+#include "ngr_upstream.h"
+
+static int failures = 0;
+
+#define check(expr)                                                      \
+    do {                                                                 \
+        if (!(expr)) {                                                   \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+            failures++;                                                  \
+        }                                                                \
+    } while (0)
+
+
+static int64_t now_msec()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
+static uint64_t wake_handler(ngr_event_t *ev, void *data)
+{
+    return 0;
+}
+
+
+/* run the loop for about msec milliseconds */
+static void run_for(ngr_event_t *ev, int64_t msec)
+{
+    int64_t end = now_msec() + msec;
+
+    /* keeps the poll from blocking past the end */
+    ngr_event_create_timer(ev, msec, wake_handler, NULL, NULL);
+
+    while (now_msec() < end) {
+        ngr_event_process_events(ev, 0);
+    }
+}
+
+
+/* a nonblocking unix socket pair, sv[1] is written to make sv[0] ready */
+static int make_pair(int sv[2])
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        return -1;
+    }
+
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) | O_NONBLOCK);
+
+    return 0;
+}
+
+
+static void close_pair(int sv[2])
+{
+    close(sv[0]);
+    close(sv[1]);
+}
+
+
+/* a nonblocking listening socket on a loopback port, stored in addr */
+static int make_listener(struct sockaddr_in *addr)
+{
+    socklen_t len = sizeof(*addr);
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(fd, (struct sockaddr *)addr, sizeof(*addr)) == -1
+        || listen(fd, 128) == -1
+        || getsockname(fd, (struct sockaddr *)addr, &len) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    return fd;
+}
+
+
+static int connect_to(struct sockaddr_in *addr)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (connect(fd, (struct sockaddr *)addr, sizeof(*addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    return fd;
+}
+
+
+static int timer_called;
 
 uint64_t timer_handler(ngr_event_t *ev, void *data)
 {
-    printf("This is timer called\n");
-    return 1000;
+    timer_called++;
+    return timer_called < 3 ? 10 : 0;
 }
 
-int main(int argc, char *argv[])
+
+static void test_timer()
 {
     ngr_event_t *ev = ngr_event_new(0);
-    if (!ev) {
-        printf("can not create event object\n");
-        exit(-1);
+
+    ngr_event_create_timer(ev, 10, &timer_handler, NULL, NULL);
+    run_for(ev, 100);
+
+    check(timer_called == 3);
+
+    ngr_event_destroy(ev);
+}
+
+
+static int periodic_runs, periodic_destroyed;
+static ngr_event_periodic_t *periodic_other;
+
+static void periodic_destroy(void *data)
+{
+    periodic_destroyed++;
+}
+
+
+static void periodic_count(ngr_event_t *ev, int ticks, void *data)
+{
+    periodic_runs++;
+}
+
+
+static void periodic_del_self(ngr_event_t *ev, int ticks, void *data)
+{
+    periodic_runs++;
+    ngr_event_del_periodic(ev, *(ngr_event_periodic_t **)data);
+}
+
+
+static void periodic_del_other(ngr_event_t *ev, int ticks, void *data)
+{
+    periodic_runs++;
+
+    if (periodic_other) {
+        ngr_event_del_periodic(ev, periodic_other);
+        periodic_other = NULL;
     }
 
-    ngr_event_create_timer(ev, 1000, &timer_handler, NULL, NULL);
-    ngr_event_loop(ev);
+    ngr_event_del_periodic(ev, *(ngr_event_periodic_t **)data);
+}
+
+
+static void test_periodic_del()
+{
+    ngr_event_t *ev = ngr_event_new(0);
+    ngr_event_periodic_t *a, *b;
+
+    /* the last member deleted outside of a tick frees the bucket */
+    a = ngr_event_add_periodic(ev, 10, NGR_EVENT_PERIODIC_SKIP,
+                               periodic_count, NULL, periodic_destroy);
+    b = ngr_event_add_periodic(ev, 10, NGR_EVENT_PERIODIC_SKIP,
+                               periodic_count, NULL, periodic_destroy);
+    check(a && b && a->bucket == b->bucket);
+
+    ngr_event_del_periodic(ev, a);
+    ngr_event_del_periodic(ev, b);
+    check(ev->buckets == NULL);
+    check(periodic_destroyed == 2);
+
+    /* the last member deletes itself from the bucket tick */
+    periodic_runs = 0;
+    a = ngr_event_add_periodic(ev, 10, NGR_EVENT_PERIODIC_SKIP,
+                               periodic_del_self, &a, NULL);
+    run_for(ev, 50);
+    check(periodic_runs == 1);
+    check(ev->buckets == NULL);
+
+    /* a member deletes the other one and then itself from the tick */
+    periodic_runs = 0;
+    periodic_destroyed = 0;
+    periodic_other = ngr_event_add_periodic(ev, 10,
+        NGR_EVENT_PERIODIC_CATCH_UP, periodic_count, NULL, periodic_destroy);
+    a = ngr_event_add_periodic(ev, 10, NGR_EVENT_PERIODIC_CATCH_UP,
+                               periodic_del_other, &a, NULL);
+    run_for(ev, 50);
+    check(periodic_runs == 1);
+    check(periodic_destroyed == 1);
+    check(ev->buckets == NULL);
+
+    /* a new periodic after that gets a bucket of its own */
+    periodic_runs = 0;
+    a = ngr_event_add_periodic(ev, 10, NGR_EVENT_PERIODIC_SKIP,
+                               periodic_count, NULL, NULL);
+    run_for(ev, 55);
+    check(periodic_runs >= 3);
+
+    ngr_event_destroy(ev);
+}
+
+
+typedef struct {
+    int calls;
+    int ticks;
+    int64_t at[32];      /* msec of each call */
+} periodic_log_t;
+
+static void periodic_record(ngr_event_t *ev, int ticks, void *data)
+{
+    periodic_log_t *log = data;
+
+    if (log->calls < 32) log->at[log->calls] = now_msec();
+
+    log->calls++;
+    log->ticks += ticks;
+}
+
+
+/* a handler slower than a poll round, the schedule must not slip */
+static void periodic_slow(ngr_event_t *ev, int ticks, void *data)
+{
+    periodic_record(ev, ticks, data);
+    usleep(4000);
+}
+
+
+static void test_periodic_rate()
+{
+    ngr_event_t *ev = ngr_event_new(0);
+    periodic_log_t slow, skip, catch_up;
+    ngr_event_periodic_t *p, *q;
+    int64_t end;
+
+    /* 20 periods after the first run, not 20 periods plus handler time */
+    memset(&slow, 0, sizeof(slow));
+    p = ngr_event_add_periodic(ev, 10, NGR_EVENT_PERIODIC_SKIP,
+                               periodic_slow, &slow, NULL);
+
+    end = now_msec() + 400;
+    while (slow.calls < 21 && now_msec() < end) {
+        ngr_event_process_events(ev, 0);
+    }
+
+    check(slow.calls == 21 && slow.ticks == 21);
+    check(slow.at[20] - slow.at[0] >= 195 && slow.at[20] - slow.at[0] <= 205);
+    ngr_event_del_periodic(ev, p);
+
+    /* stalled past five periods */
+    memset(&skip, 0, sizeof(skip));
+    memset(&catch_up, 0, sizeof(catch_up));
+    p = ngr_event_add_periodic(ev, 10, NGR_EVENT_PERIODIC_SKIP,
+                               periodic_record, &skip, NULL);
+    q = ngr_event_add_periodic(ev, 10, NGR_EVENT_PERIODIC_CATCH_UP,
+                               periodic_record, &catch_up, NULL);
+
+    usleep(55000);
+    ngr_event_process_events(ev, 1);
+
+    /* skip runs once and reports the ticks, catch up replays them */
+    check(skip.calls == 1);
+    check(skip.ticks >= 5 && skip.ticks <= 6);
+    check(catch_up.calls >= 5 && catch_up.calls <= 6);
+    check(catch_up.ticks == catch_up.calls);
+
+    /* both are back on their schedule afterwards */
+    memset(&skip, 0, sizeof(skip));
+    memset(&catch_up, 0, sizeof(catch_up));
+    run_for(ev, 52);
+    check(skip.calls >= 4 && skip.calls <= 6 && skip.ticks == skip.calls);
+    check(catch_up.calls >= 4 && catch_up.calls <= 6);
+
+    ngr_event_del_periodic(ev, p);
+    ngr_event_del_periodic(ev, q);
+    ngr_event_destroy(ev);
+}
+
+
+static int order[8], norder;
+
+static void record_read(ngr_event_t *ev, int fd, void *data, int mask)
+{
+    char buf[16];
+
+    (void)read(fd, buf, sizeof(buf));
+
+    if (norder < 8) order[norder++] = (int)(intptr_t)data;
+}
+
+
+static void test_priority()
+{
+    ngr_event_t *ev = ngr_event_new(0);
+    int low[2], normal[2], high[2];
+
+    make_pair(low);
+    make_pair(normal);
+    make_pair(high);
+
+    /* priorities only apply to registered fds */
+    check(ngr_event_set_priority(ev, low[0], NGR_EVENT_PRIORITY_LOW) == -1);
+    check(ngr_event_set_priority(ev, -1, NGR_EVENT_PRIORITY_LOW) == -1);
+
+    ngr_event_create_io_event(ev, low[0], NGR_EVENT_READABLE, record_read,
+                              (void *)NGR_EVENT_PRIORITY_LOW);
+    ngr_event_create_io_event(ev, normal[0], NGR_EVENT_READABLE, record_read,
+                              (void *)NGR_EVENT_PRIORITY_NORMAL);
+    ngr_event_create_io_event(ev, high[0], NGR_EVENT_READABLE, record_read,
+                              (void *)NGR_EVENT_PRIORITY_HIGH);
+
+    check(ngr_event_set_priority(ev, low[0], NGR_EVENT_PRIORITY_LOW) == 0);
+    check(ngr_event_set_priority(ev, high[0], NGR_EVENT_PRIORITY_HIGH) == 0);
+    check(ngr_event_set_priority(ev, high[0], 42) == -1);
+
+    (void)write(low[1], "x", 1);
+    (void)write(normal[1], "x", 1);
+    (void)write(high[1], "x", 1);
+
+    norder = 0;
+    check(ngr_event_process_events(ev, 1) == 3);
+    check(norder == 3);
+    check(order[0] == NGR_EVENT_PRIORITY_HIGH);
+    check(order[1] == NGR_EVENT_PRIORITY_NORMAL);
+    check(order[2] == NGR_EVENT_PRIORITY_LOW);
+
+    /* over the budget events stay ready for the next call */
+    ngr_event_set_budget(ev, 1);
+
+    (void)write(low[1], "x", 1);
+    (void)write(high[1], "x", 1);
+
+    norder = 0;
+    check(ngr_event_process_events(ev, 1) == 1);
+    check(norder == 1 && order[0] == NGR_EVENT_PRIORITY_HIGH);
+    check(ngr_event_process_events(ev, 1) == 1);
+    check(norder == 2 && order[1] == NGR_EVENT_PRIORITY_LOW);
+
+    ngr_event_destroy(ev);
+
+    close_pair(low);
+    close_pair(normal);
+    close_pair(high);
+}
+
+
+static int ready_counts[4];
+
+/* leaves the byte unread, the fd stays ready */
+static void count_ready(ngr_event_t *ev, int fd, void *data, int mask)
+{
+    ready_counts[(intptr_t)data]++;
+}
+
+
+static void test_budget()
+{
+    ngr_event_t *ev = ngr_event_new(0);
+    int sv[4][2], j, ok = 1;
+
+    for (j = 0; j < 4; j++) {
+        make_pair(sv[j]);
+        ngr_event_create_io_event(ev, sv[j][0], NGR_EVENT_READABLE,
+                                  count_ready, (void *)(intptr_t)j);
+        (void)write(sv[j][1], "x", 1);
+    }
+
+    /* one dispatch per call, the ready fds of a class take turns */
+    ngr_event_set_budget(ev, 1);
+
+    for (j = 0; j < 1000; j++) {
+        ngr_event_process_events(ev, 1);
+    }
+
+    for (j = 0; j < 4; j++) {
+        if (ready_counts[j] != 250) ok = 0;
+        close_pair(sv[j]);
+    }
+
+    check(ok);
+
+    ngr_event_destroy(ev);
+}
+
+
+static void test_busy_poll()
+{
+    ngr_event_t *ev = ngr_event_new(0);
+    int64_t spun;
+
+    check(ngr_event_set_busy_poll(ev, -1, 0) == -1);
+    check(ngr_event_set_busy_poll(ev, 2000, 0) == 0);
+
+    /* nothing fires, the whole window is spun before blocking */
+    ngr_event_create_timer(ev, 5, wake_handler, NULL, NULL);
+    ngr_event_process_events(ev, 0);
+    check(ev->stats.spin_time >= 2000);
+    check(ev->stats.spin_miss == 1);
+
+    check(ngr_event_set_busy_poll(ev, 0, 0) == 0);
+
+    spun = ev->stats.spin_time;
+    ngr_event_create_timer(ev, 5, wake_handler, NULL, NULL);
+    ngr_event_process_events(ev, 0);
+    check(ev->stats.spin_time == spun);
+
+    ngr_event_destroy(ev);
+}
+
+
+static int signal_count, child_status, child_done;
+
+static void signal_handler(ngr_event_t *ev, int signo, int count, void *data)
+{
+    signal_count += count;
+}
+
+
+static void child_handler(ngr_event_t *ev, pid_t pid, int status,
+    void *data)
+{
+    child_status = status;
+    child_done++;
+}
+
+
+static void test_signal()
+{
+    ngr_event_t *ev = ngr_event_new(0), *ev2;
+
+    check(ngr_event_create_signal(ev, 0, signal_handler, NULL) == -1);
+    check(ngr_event_create_signal(ev, SIGUSR1, signal_handler, NULL) == 0);
+
+    raise(SIGUSR1);
+    raise(SIGUSR1);
+    run_for(ev, 20);
+    check(signal_count >= 1 && signal_count <= 2);
+
+    /* the select self-pipe can route a signal to one loop only */
+    if (strcmp(ngr_event_lib_name(), "select") == 0) {
+        ev2 = ngr_event_new(0);
+        check(ngr_event_create_signal(ev2, SIGUSR1, signal_handler,
+                                      NULL) == -1);
+        check(ngr_event_create_signal(ev2, SIGUSR2, signal_handler,
+                                      NULL) == 0);
+
+        signal_count = 0;
+        raise(SIGUSR2);
+        run_for(ev, 10);
+        check(signal_count == 0);
+        run_for(ev2, 10);
+        check(signal_count == 1);
+
+        ngr_event_destroy(ev2);
+    }
+
+    ngr_event_del_signal(ev, SIGUSR1);
+    ngr_event_destroy(ev);
+}
+
+
+static void test_child()
+{
+    ngr_event_t *ev = ngr_event_new(0);
+    pid_t pid;
+    int status;
+
+    pid = fork();
+    if (pid == 0) {
+        _exit(3);
+    }
+
+    check(ngr_event_create_child(ev, pid, child_handler, NULL) == 0);
+    run_for(ev, 100);
+    check(child_done == 1);
+    check(WIFEXITED(child_status) && WEXITSTATUS(child_status) == 3);
+
+    /* reaped behind the loop back, the watch ends with an unknown status */
+    pid = fork();
+    if (pid == 0) {
+        _exit(0);
+    }
+
+    check(ngr_event_create_child(ev, pid, child_handler, NULL) == 0);
+    check(waitpid(pid, &status, 0) == pid);
+
+    if (ev->children->fd == -1) { /* no pidfd, nothing tells the loop */
+        raise(SIGCHLD);
+    }
+
+    run_for(ev, 50);
+    check(child_done == 2);
+    check(child_status == -1);
+    check(ev->children == NULL);
+    check(ngr_event_process_events(ev, 1) == 0); /* nothing left ready */
+
+    ngr_event_destroy(ev);
+}
+
+
+static int tasks_done, resolved;
+static ssize_t pread_result;
+
+static void sleep_task(ngr_thread_task_t *task)
+{
+    usleep(20000);
+}
+
+
+static void sleep_done(ngr_event_t *ev, ngr_thread_task_t *task)
+{
+    tasks_done++;
+}
+
+
+static void pread_done(ngr_event_t *ev, ssize_t n, int err, void *data)
+{
+    pread_result = n;
+}
+
+
+static void resolve_done(ngr_event_t *ev, struct addrinfo *res, int err,
+    void *data)
+{
+    resolved = (res != NULL);
+
+    if (res) freeaddrinfo(res);
+}
+
+
+static void test_thread_pool()
+{
+    ngr_event_t *ev = ngr_event_new(0);
+    ngr_thread_pool_t *pool = ngr_thread_pool_new(ev, 2);
+    ngr_thread_pool_stats_t stats;
+    char buf[16], path[] = "/tmp/ngr_test.XXXXXX";
+    int fd;
+
+    check(ngr_thread_post(pool, sleep_task, sleep_done, NULL) == 0);
+
+    /* completions waiting for the loop don't count as run time */
+    usleep(100000);
+    run_for(ev, 20);
+
+    ngr_thread_pool_stats(pool, &stats);
+    check(tasks_done == 1);
+    check(stats.completed == 1);
+    check(stats.run_time >= 20000 && stats.run_time < 80000);
+    check(stats.latency_max >= 100000);
+
+    fd = mkstemp(path);
+    unlink(path);
+    (void)write(fd, "hello", 5);
+
+    check(ngr_thread_pread(pool, fd, buf, sizeof(buf), 1, pread_done,
+                           NULL) == 0);
+    run_for(ev, 50);
+    check(pread_result == 4 && memcmp(buf, "ello", 4) == 0);
+    close(fd);
+
+    /* no hints at all, not zeroed ones */
+    check(ngr_thread_getaddrinfo(pool, "localhost", NULL, NULL,
+                                 resolve_done, NULL) == 0);
+    run_for(ev, 200);
+    check(resolved);
+
+    ngr_thread_pool_destroy(pool);
+    ngr_event_destroy(ev);
+}
+
+
+static int accepted;
+
+static void accept_handler(ngr_event_t *ev, ngr_listener_t *ls, int *fds,
+    int nfds, void *data)
+{
+    int j;
+
+    accepted += nfds;
+
+    for (j = 0; j < nfds; j++) {
+        close(fds[j]);
+    }
+}
+
+
+static void test_listener()
+{
+    ngr_event_t *ev = ngr_event_new(0);
+    struct sockaddr_in addr;
+    struct rlimit saved, rl;
+    ngr_listener_t *ls;
+    int lfd, clients[4], fillers[64], nfillers = 0, j;
+
+    lfd = make_listener(&addr);
+    ls = ngr_listener_new(ev, lfd, 2, accept_handler, NULL);
+    check(ls != NULL);
+
+    /* over the budget connections are accepted on the next pass */
+    for (j = 0; j < 3; j++) {
+        clients[j] = connect_to(&addr);
+    }
+
+    ngr_event_process_events(ev, 1);
+    check(accepted == 2 && ls->exhausted == 1);
+    ngr_event_process_events(ev, 1);
+    check(accepted == 3);
+
+    for (j = 0; j < 3; j++) {
+        close(clients[j]);
+    }
+
+    /* out of fds the waiting connections are shed, the loop doesn't spin */
+    for (j = 0; j < 4; j++) {
+        clients[j] = connect_to(&addr);
+    }
+
+    getrlimit(RLIMIT_NOFILE, &saved);
+    rl = saved;
+    rl.rlim_cur = 64;
+    setrlimit(RLIMIT_NOFILE, &rl);
+
+    while (nfillers < 64 && (fillers[nfillers] = dup(lfd)) != -1) {
+        nfillers++;
+    }
+
+    ngr_event_process_events(ev, 1);
+    check(accepted == 3);
+    check(ls->dropped == 2);  /* the budget of one shedding pass */
+    ngr_event_process_events(ev, 1);
+    check(ls->dropped == 4);
+    check(ngr_event_process_events(ev, 1) == 0);
+    check(ls->reserve != -1);
+
+    for (j = 0; j < nfillers; j++) {
+        close(fillers[j]);
+    }
+
+    setrlimit(RLIMIT_NOFILE, &saved);
+
+    for (j = 0; j < 4; j++) {
+        close(clients[j]);
+    }
+
+    ngr_listener_destroy(ls);
+    ngr_event_destroy(ev);
+    close(lfd);
+}
+
+
+static int datagrams;
+
+static void echo_handler(ngr_event_t *ev, ngr_dgram_t *dg,
+    ngr_dgram_packet_t *packets, int npackets, void *data)
+{
+    int j;
+
+    for (j = 0; j < npackets; j++) {
+        datagrams++;
+        ngr_dgram_send(dg, packets[j].data, packets[j].len, packets[j].addr,
+                       packets[j].addrlen);
+    }
+}
+
+
+static void test_dgram()
+{
+    ngr_event_t *ev = ngr_event_new(0);
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    ngr_dgram_t *dg;
+    char buf[16];
+    int sfd, cfd, j, n;
+
+    sfd = socket(AF_INET, SOCK_DGRAM, 0);
+    cfd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(sfd, (struct sockaddr *)&addr, sizeof(addr));
+    getsockname(sfd, (struct sockaddr *)&addr, &len);
+
+    dg = ngr_dgram_new(ev, sfd, 8, 0, echo_handler, NULL);
+    check(dg != NULL);
+
+    for (j = 0; j < 5; j++) {
+        buf[0] = '0' + j;
+        sendto(cfd, buf, 1, 0, (struct sockaddr *)&addr, sizeof(addr));
+    }
+
+    /* all of them are received and echoed in one batch */
+    ngr_event_process_events(ev, 1);
+    check(datagrams == 5);
+    check(dg->received == 5 && dg->recv_calls == 1);
+    check(dg->sent == 5 && dg->squeued == 0);
+
+    for (j = 0; j < 5; j++) {
+        n = recv(cfd, buf, sizeof(buf), MSG_DONTWAIT);
+        check(n == 1 && buf[0] == '0' + j);
+    }
+
+    ngr_dgram_destroy(dg);
+    ngr_event_destroy(ev);
+    close(sfd);
+    close(cfd);
+}
+
+
+#define PRODUCERS  4
+#define MESSAGES   10000
+
+static int64_t channel_sum, channel_count;
+
+static void channel_handler(ngr_event_t *ev, ngr_channel_t *ch, void *msg,
+    void *data)
+{
+    channel_sum += (intptr_t)msg;
+    channel_count++;
+}
+
+
+static void *producer(void *arg)
+{
+    ngr_channel_t *ch = arg;
+    intptr_t j;
+
+    for (j = 1; j <= MESSAGES; j++) {
+        while (ngr_channel_send(ch, (void *)j) == -1) {
+            sched_yield(); /* full, let the consumer catch up */
+        }
+    }
+
+    return NULL;
+}
+
+
+static void run_until(ngr_event_t *ev, int64_t *counter, int64_t want,
+    int64_t msec)
+{
+    int64_t end = now_msec() + msec;
+
+    while (*counter < want && now_msec() < end) {
+        ngr_event_create_timer(ev, 10, wake_handler, NULL, NULL);
+        ngr_event_process_events(ev, 0);
+    }
+}
+
+
+static void test_channel()
+{
+    ngr_event_t *ev = ngr_event_new(0);
+    pthread_t threads[PRODUCERS];
+    ngr_channel_t *ch;
+    int j;
+
+    /* a full ring refuses messages */
+    ch = ngr_channel_new(ev, 4, NGR_CHANNEL_SPSC, channel_handler, NULL);
+    check(ch != NULL);
+
+    for (j = 1; j <= 4; j++) {
+        check(ngr_channel_send(ch, (void *)(intptr_t)j) == 0);
+    }
+
+    check(ngr_channel_send(ch, (void *)5) == -1);
+
+    run_until(ev, &channel_count, 4, 100);
+    check(channel_count == 4 && channel_sum == 10);
+
+    ngr_channel_destroy(ch);
+
+    /* every message of every producer is received once */
+    channel_count = 0;
+    channel_sum = 0;
+
+    ch = ngr_channel_new(ev, 256, NGR_CHANNEL_MPSC, channel_handler, NULL);
+
+    for (j = 0; j < PRODUCERS; j++) {
+        pthread_create(&threads[j], NULL, producer, ch);
+    }
+
+    run_until(ev, &channel_count, PRODUCERS * MESSAGES, 5000);
+
+    for (j = 0; j < PRODUCERS; j++) {
+        pthread_join(threads[j], NULL);
+    }
+
+    check(channel_count == PRODUCERS * MESSAGES);
+    check(channel_sum == (int64_t)PRODUCERS * MESSAGES * (MESSAGES + 1) / 2);
+
+    ngr_channel_destroy(ch);
+    ngr_event_destroy(ev);
+}
+
+
+#define EXECUTOR_TASKS  (NGR_EXECUTOR_CHANNEL_SIZE * 3)
+
+static int64_t works_done, continuations;
+
+static void executor_work(void *data)
+{
+    __sync_fetch_and_add(&works_done, 1);
+}
+
+
+static void executor_done(ngr_event_t *ev, void *data)
+{
+    continuations++;
+}
+
+
+static void test_executor()
+{
+    ngr_event_t *ev = ngr_event_new(0);
+    ngr_executor_t *ex = ngr_executor_new(2);
+    ngr_executor_loop_t *lp = ngr_executor_attach(ex, ev);
+    int j;
+
+    check(lp != NULL);
+
+    check(ngr_executor_submit(lp, executor_work, executor_done, NULL) == 0);
+    run_until(ev, &continuations, 1, 1000);
+    check(works_done == 1 && continuations == 1);
+
+    /*
+     * More continuations than the channel holds while the loop is not
+     * running: the workers must not wait for the loop, and detaching the
+     * loop runs every one of them.
+     */
+    for (j = 1; j < EXECUTOR_TASKS; j++) {
+        ngr_executor_submit(lp, executor_work, executor_done, NULL);
+    }
+
+    ngr_executor_destroy(ex);
+    check(works_done == EXECUTOR_TASKS);
+
+    ngr_executor_detach(lp);
+    check(continuations == EXECUTOR_TASKS);
+
+    ngr_event_destroy(ev);
+}
+
+
+#define PAIRS  32
+
+static int hits[PAIRS], masks[PAIRS], writes;
+
+static void index_read(ngr_event_t *ev, int fd, void *data, int mask)
+{
+    int j = (int)(intptr_t)data;
+    char buf[16];
+
+    (void)read(fd, buf, sizeof(buf));
+
+    hits[j]++;
+    masks[j] = mask;
+}
+
+
+static void index_write(ngr_event_t *ev, int fd, void *data, int mask)
+{
+    writes++;
+}
+
+
+static void test_listener_register()
+{
+    ngr_event_t *ev = ngr_event_new(0);
+    int a[2], b[2], fds[3];
+    void *data[3];
+
+    make_pair(a);
+    make_pair(b);
+
+    fds[0] = a[0];
+    fds[1] = -1;         /* refused, dropped from both arrays */
+    fds[2] = b[0];
+    data[0] = (void *)0;
+    data[1] = (void *)5;
+    data[2] = (void *)1;
+
+    check(ngr_listener_register(ev, fds, 3, NGR_EVENT_READABLE, index_read,
+                                data) == 2);
+    check(fds[0] == a[0] && fds[1] == b[0]);
+    check(data[0] == (void *)0 && data[1] == (void *)1);
+
+    /* each fd is dispatched with its own data */
+    memset(hits, 0, sizeof(hits));
+    (void)write(b[1], "x", 1);
+    ngr_event_process_events(ev, 1);
+    check(hits[0] == 0 && hits[1] == 1);
+    memset(hits, 0, sizeof(hits));
+
+    ngr_event_close_fd(ev, a[0]);
+    ngr_event_close_fd(ev, b[0]);
+    close(a[1]);
+    close(b[1]);
+    ngr_event_destroy(ev);
+}
+
+
+static void test_dispatch()
+{
+    ngr_event_t *ev = ngr_event_new(0);
+    int pairs[PAIRS][2], j, ok = 1;
+
+    /* more fired events than the prefetch window, each dispatched once */
+    for (j = 0; j < PAIRS; j++) {
+        make_pair(pairs[j]);
+        ngr_event_create_io_event(ev, pairs[j][0], NGR_EVENT_READABLE,
+                                  index_read, (void *)(intptr_t)j);
+        (void)write(pairs[j][1], "x", 1);
+    }
+
+    check(ngr_event_process_events(ev, 1) == PAIRS);
+
+    for (j = 0; j < PAIRS; j++) {
+        if (hits[j] != 1 || masks[j] != NGR_EVENT_READABLE) ok = 0;
+    }
+
+    check(ok);
+
+    /* one handler for both directions is called once */
+    memset(hits, 0, sizeof(hits));
+    ngr_event_create_io_event(ev, pairs[0][0], NGR_EVENT_WRITABLE,
+                              index_read, (void *)0);
+    (void)write(pairs[0][1], "x", 1);
+
+    ngr_event_process_events(ev, 1);
+    check(hits[0] == 1);
+    check(masks[0] == (NGR_EVENT_READABLE|NGR_EVENT_WRITABLE));
+
+    /* different handlers are both called */
+    ngr_event_create_io_event(ev, pairs[0][0], NGR_EVENT_WRITABLE,
+                              index_write, (void *)0);
+    (void)write(pairs[0][1], "x", 1);
+
+    ngr_event_process_events(ev, 1);
+    check(hits[0] == 2 && writes == 1);
+
+    for (j = 0; j < PAIRS; j++) {
+        close_pair(pairs[j]);
+    }
+
+    ngr_event_destroy(ev);
+}
+
+
+static int batch_calls[2], batch_fds[2];
+
+static void batch_handler(ngr_event_t *ev, ngr_event_ready_t *ready,
+    int nready)
+{
+    int j, which = (int)(intptr_t)ready[0].data;
+    char buf[16];
+
+    for (j = 0; j < nready; j++) {
+        (void)read(ready[j].fd, buf, sizeof(buf));
+    }
+
+    batch_calls[which]++;
+    batch_fds[which] += nready;
+}
+
+
+static void batch_handler2(ngr_event_t *ev, ngr_event_ready_t *ready,
+    int nready)
+{
+    batch_handler(ev, ready, nready);
+}
+
+
+static void test_batch()
+{
+    ngr_event_t *ev = ngr_event_new(0);
+    int pairs[6][2], j;
+
+    /* one call per handler with all of its ready fds */
+    for (j = 0; j < 6; j++) {
+        make_pair(pairs[j]);
+        ngr_event_create_io_batch_event(ev, pairs[j][0], NGR_EVENT_READABLE,
+            j < 4 ? batch_handler : batch_handler2,
+            (void *)(intptr_t)(j < 4 ? 0 : 1));
+        (void)write(pairs[j][1], "x", 1);
+    }
+
+    ngr_event_process_events(ev, 1);
+    check(batch_calls[0] == 1 && batch_fds[0] == 4);
+    check(batch_calls[1] == 1 && batch_fds[1] == 2);
+
+    /* a normal handler can't take over part of a batch registration */
+    check(ngr_event_create_io_event(ev, pairs[0][0], NGR_EVENT_WRITABLE,
+                                    index_write, (void *)0) == -1);
+
+    (void)write(pairs[0][1], "x", 1);
+    ngr_event_process_events(ev, 1);
+    check(batch_calls[0] == 2 && writes == 1);
+
+    /* nor the other way around */
+    ngr_event_create_io_event(ev, pairs[5][0],
+        NGR_EVENT_READABLE|NGR_EVENT_WRITABLE, index_read, (void *)0);
+    check(ngr_event_create_io_batch_event(ev, pairs[5][0],
+        NGR_EVENT_WRITABLE, batch_handler, (void *)0) == -1);
+
+    /* covering every direction replaces it */
+    check(ngr_event_create_io_event(ev, pairs[1][0],
+              NGR_EVENT_READABLE|NGR_EVENT_WRITABLE, index_read,
+              (void *)1) == 0);
+
+    memset(hits, 0, sizeof(hits));
+    (void)write(pairs[1][1], "x", 1);
+    ngr_event_process_events(ev, 1);
+    check(hits[1] == 1 && batch_calls[0] == 2);
+
+    for (j = 0; j < 6; j++) {
+        close_pair(pairs[j]);
+    }
+
+    ngr_event_destroy(ev);
+}
+
+
+#ifdef HAVE_EPOLL
+
+#include "ngr_event_static.h"
+
+static int static_io, static_order[3], static_timers;
+
+NGR_EVENT_STATIC_DEFINE(test_loop, test_static_io, test_static_timer)
+
+
+static void test_static_io(test_loop_t *lp, int fd, void *data, int mask)
+{
+    char buf[16];
+
+    (void)read(fd, buf, sizeof(buf));
+    static_io += (int)(intptr_t)data;
+}
+
+
+static uint64_t test_static_timer(test_loop_t *lp, void *data)
+{
+    if (static_timers < 3) {
+        static_order[static_timers] = (int)(intptr_t)data;
+    }
+
+    static_timers++;
+
+    return 0;
+}
+
+
+static void test_static()
+{
+    test_loop_t lp;
+    int64_t end;
+    int sv[2];
+
+    check(test_loop_init(&lp, 0) == 0);
+
+    make_pair(sv);
+    test_loop_add(&lp, sv[0], NGR_EVENT_READABLE, (void *)7);
+    (void)write(sv[1], "x", 1);
+
+    test_loop_process(&lp, 1);
+    check(static_io == 7);
+
+    test_loop_del(&lp, sv[0], NGR_EVENT_READABLE);
+    (void)write(sv[1], "x", 1);
+
+    test_loop_process(&lp, 1);
+    check(static_io == 7);
+
+    /* the heap fires timers in deadline order */
+    test_loop_timer(&lp, 30, (void *)3);
+    test_loop_timer(&lp, 10, (void *)1);
+    test_loop_timer(&lp, 20, (void *)2);
+
+    end = now_msec() + 200;
+    while (static_timers < 3 && now_msec() < end) {
+        test_loop_process(&lp, 0);
+    }
+
+    check(static_timers == 3);
+    check(static_order[0] == 1 && static_order[1] == 2
+          && static_order[2] == 3);
+
+    test_loop_free(&lp);
+    close_pair(sv);
+}
+
+#endif
+
+
+static int64_t fired_at;
+
+static uint64_t stamp_handler(ngr_event_t *ev, void *data)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    fired_at = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+    return 0;
+}
+
+
+/* polls until the timer fires, none of them may return early */
+static void check_timer_policy(ngr_event_t *ev, int64_t msec)
+{
+    struct timeval tv;
+    int64_t added;
+    int polls = 0;
+
+    gettimeofday(&tv, NULL);
+    added = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+    memset(&ev->stats, 0, sizeof(ev->stats));
+    fired_at = 0;
+
+    ngr_event_create_timer(ev, msec, stamp_handler, NULL, NULL);
+
+    while (fired_at == 0 && polls < 100) {
+        ngr_event_process_events(ev, 0);
+        polls++;
+    }
+
+    check(polls == 1);
+    check(fired_at >= added + msec * 1000);
+    check(ev->stats.timers_fired == 1);
+    check(ev->stats.early_wakeups == 0);
+    check(ev->stats.timer_lateness >= 0);
+    check(ev->stats.timer_lateness_max == ev->stats.timer_lateness);
+}
+
+
+static void test_timer_policy()
+{
+    ngr_event_t *ev = ngr_event_new(0);
+
+    check(ngr_event_set_timer_policy(ev, -1) == -1);
+    check(ev->timer_policy == NGR_EVENT_TIMER_ROUND_UP);
+
+    check_timer_policy(ev, 5);
+
+    if (ngr_event_set_timer_policy(ev, NGR_EVENT_TIMER_PRECISE) == 0) {
+        check_timer_policy(ev, 2);
+    }
+
+    ngr_event_destroy(ev);
+}
+
+
+static int drains;
+
+/* closes the connection passed as data, -1 leaves it to the timeout */
+static void drain_handler(ngr_event_t *ev, void *data)
+{
+    int fd = (int)(intptr_t)data;
+
+    drains++;
+
+    if (fd != -1) {
+        ngr_event_close_fd(ev, fd);
+    }
+}
+
+
+static void test_drain()
+{
+    ngr_event_t *ev = ngr_event_new(0);
+    int64_t start;
+    int sv[2];
+
+    check(ev->busy == 0);
+
+    make_pair(sv);
+    check(ngr_event_create_io_event(ev, sv[0], NGR_EVENT_READABLE,
+                                    record_read, NULL) == 0);
+    check(ev->busy == 1);
+
+    /* the loop returns once the last connection is gone */
+    ngr_event_set_drain_handler(ev, drain_handler, (void *)(intptr_t)sv[0]);
+    ngr_event_drain(ev, 0);
+    ngr_event_loop(ev);
+
+    check(drains == 1);
+    check(ev->busy == 0);
+    check(ev->draining == 0);
+    close(sv[1]);
+
+    /* and takes registrations again */
+    make_pair(sv);
+    check(ngr_event_create_io_event(ev, sv[0], NGR_EVENT_READABLE,
+                                    record_read, NULL) == 0);
+    check(ngr_event_create_io_event(ev, sv[1], NGR_EVENT_READABLE,
+                                    record_read, NULL) == 0);
+    check(ev->busy == 2);
+
+    /* pinned fds don't hold a drain back */
+    ngr_event_pin(ev, sv[1]);
+    check(ev->busy == 1);
+
+    /* a second drain gives up on the connection after its timeout */
+    ngr_event_set_drain_handler(ev, drain_handler, (void *)(intptr_t)-1);
+    start = now_msec();
+    ngr_event_drain(ev, 20);
+    ngr_event_loop(ev);
+
+    check(drains == 2);
+    check(now_msec() - start >= 20);
+    check(ev->busy == 1);
+    check(ev->draining == 0);
+    check(ngr_event_create_io_event(ev, sv[0], NGR_EVENT_WRITABLE,
+                                    index_write, NULL) == 0);
+
+    ngr_event_close_fd(ev, sv[0]);
+    ngr_event_close_fd(ev, sv[1]);
+    check(ev->busy == 0);
+
+    ngr_event_destroy(ev);
+}
+
+
+static ngr_trace_t *trace_attach;
+
+/* attaches the tracer while its own dispatch is being timed */
+static void attach_read(ngr_event_t *ev, int fd, void *data, int mask)
+{
+    record_read(ev, fd, data, mask);
+    ngr_event_set_trace(ev, trace_attach);
+}
+
+
+static void test_trace()
+{
+    char path[] = "/tmp/ngr_trace_XXXXXX";
+    ngr_event_t *ev = ngr_event_new(0);
+    ngr_trace_t *trace;
+    uint64_t i, head;
+    int sv[2], fd, found = 0;
+
+    fd = mkstemp(path);
+    check(fd != -1);
+    close(fd);
+
+    trace = ngr_trace_open(path, 64);
+    check(trace != NULL);
+    check(trace->mask == 63);
+
+    ngr_event_set_trace(ev, trace);
+
+    make_pair(sv);
+    norder = 0;
+    ngr_event_create_io_event(ev, sv[0], NGR_EVENT_READABLE, record_read,
+                              NULL);
+    (void)write(sv[1], "x", 1);
+    ngr_event_process_events(ev, 1);
+
+    head = trace->header->head;
+    check(norder == 1);
+    check(head >= 2);
+
+    for (i = 0; i < head; i++) {
+        if (trace->records[i].phase == NGR_TRACE_IO
+            && trace->records[i].id == sv[0])
+        {
+            found++;
+        }
+    }
+
+    check(found == 1);
+
+    /* a detached tracer records nothing */
+    ngr_event_set_trace(ev, NULL);
+    (void)write(sv[1], "x", 1);
+    ngr_event_process_events(ev, 1);
+
+    check(norder == 2);
+    check(trace->header->head == head);
+
+    /* attached by a handler, that dispatch isn't recorded */
+    trace_attach = trace;
+    ngr_event_create_io_event(ev, sv[0], NGR_EVENT_READABLE, attach_read,
+                              NULL);
+    (void)write(sv[1], "x", 1);
+    ngr_event_process_events(ev, 1);
+
+    check(norder == 3);
+    check(trace->header->head == head);
+    ngr_event_set_trace(ev, NULL);
+
+    ngr_event_destroy(ev);
+    ngr_trace_close(trace);
+    close_pair(sv);
+    unlink(path);
+}
+
+
+static void test_ring()
+{
+    ngr_ring_t ring;
+    size_t size;
+
+    check(ngr_ring_init(&ring, 100) == 0);
+
+    size = ring.size;
+    check(size >= 100 && size % sysconf(_SC_PAGESIZE) == 0);
+    check(ngr_ring_space(&ring) == size);
+
+    /* leave 10 bytes before the end, the next write wraps around */
+    ngr_ring_produce(&ring, size - 10);
+    ngr_ring_consume(&ring, size - 20);
+    check(ngr_ring_used(&ring) == 10);
+
+    memcpy(ngr_ring_tail(&ring), "0123456789abcdefghij", 20);
+    ngr_ring_produce(&ring, 20);
+
+    check(memcmp(ring.base, "abcdefghij", 10) == 0);
+    check(memcmp(ngr_ring_data(&ring) + 10, "0123456789abcdefghij", 20)
+          == 0);
+
+    ngr_ring_consume(&ring, 25);
+    check(ring.head == 5);
+    check(memcmp(ngr_ring_data(&ring), "fghij", 5) == 0);
+
+    /* an empty ring starts over at the front */
+    ngr_ring_consume(&ring, 5);
+    check(ring.head == 0 && ngr_ring_used(&ring) == 0);
+
+    ngr_ring_destroy(&ring);
+}
+
+
+static char stream_frames[4][16];
+static int stream_count, stream_closed, stream_err;
+
+static int stream_frame(ngr_event_t *ev, ngr_stream_t *st, char *frame,
+    size_t len, void *data)
+{
+    if (stream_count < 4 && len < 16) {
+        memcpy(stream_frames[stream_count], frame, len);
+        stream_frames[stream_count][len] = '\0';
+    }
+
+    stream_count++;
+
+    return 0;
+}
+
+
+static void stream_close(ngr_event_t *ev, ngr_stream_t *st, int err,
+    void *data)
+{
+    stream_closed++;
+    stream_err = err;
+
+    ngr_stream_destroy(st);
+}
+
+
+static void test_stream()
+{
+    ngr_event_t *ev = ngr_event_new(0);
+    ngr_stream_t *st;
+    int sv[2];
+
+    /* length prefixed, a frame split over two reads */
+    make_pair(sv);
+    st = ngr_stream_new(ev, sv[0], 0, stream_frame, stream_close, NULL);
+    check(st != NULL);
+
+    (void)write(sv[1], "\0\0\0\2hi\0\0\0\3abc\0\0\0\5wor", 20);
+    ngr_event_process_events(ev, 1);
+    check(stream_count == 2);
+    check(strcmp(stream_frames[0], "hi") == 0);
+    check(strcmp(stream_frames[1], "abc") == 0);
+
+    (void)write(sv[1], "ld", 2);
+    ngr_event_process_events(ev, 1);
+    check(stream_count == 3);
+    check(strcmp(stream_frames[2], "world") == 0);
+    check(st->received == 22 && st->frames == 3);
+
+    /* the peer closing is end of file */
+    close(sv[1]);
+    ngr_event_process_events(ev, 1);
+    check(stream_closed == 1 && stream_err == 0);
+    close(sv[0]);
+
+    /* delimited, the delimiter itself split over two reads */
+    stream_count = 0;
+    make_pair(sv);
+    st = ngr_stream_new(ev, sv[0], 0, stream_frame, stream_close, NULL);
+    check(ngr_stream_set_delimiter(st, "\r\n", 2) == 0);
+
+    (void)write(sv[1], "ab\r\ncd\r", 7);
+    ngr_event_process_events(ev, 1);
+    check(stream_count == 1);
+
+    (void)write(sv[1], "\n", 1);
+    ngr_event_process_events(ev, 1);
+    check(stream_count == 2);
+    check(strcmp(stream_frames[0], "ab") == 0);
+    check(strcmp(stream_frames[1], "cd") == 0);
+
+    /* a frame larger than the ring closes the stream */
+    check(ngr_stream_set_length(st, 9) == -1);
+    check(ngr_stream_set_length(st, 4) == 0);
+    (void)write(sv[1], "\x7f\0\0\0", 4);
+    ngr_event_process_events(ev, 1);
+    check(stream_closed == 2 && stream_err == EMSGSIZE);
+
+    close_pair(sv);
+    ngr_event_destroy(ev);
+}
+
+
+static int limit_writes;
+
+/* every write moves 100 bytes through the bucket passed as data */
+static void limit_write(ngr_event_t *ev, int fd, void *data, int mask)
+{
+    ngr_event_limit_consume(data, 100);
+    limit_writes++;
+}
+
+
+static void test_limit()
+{
+    ngr_event_t *ev = ngr_event_new(0);
+    ngr_event_limit_t lim;
+    int a[2], b[2];
+
+    check(ngr_event_limit_init(&lim, 0, 100) == -1);
+    check(ngr_event_limit_init(&lim, 2000, 100) == 0);
+    check(ngr_event_limit_avail(&lim) == 100);
+
+    make_pair(a);
+    make_pair(b);
+
+    check(ngr_event_set_limit(ev, a[1], NGR_EVENT_WRITABLE, &lim) == -1);
+    check(ngr_event_set_limit(ev, -1, NGR_EVENT_WRITABLE, &lim) == -1);
+
+    /* negative fds are ignored, not looked up */
+    ngr_event_pin(ev, -1);
+    ngr_event_del_io_event(ev, -1, NGR_EVENT_READABLE);
+    check(ev->busy == 0);
+
+    /* always writable, the bucket alone holds the fds back */
+    ngr_event_create_io_event(ev, a[1], NGR_EVENT_WRITABLE, limit_write,
+                              &lim);
+    ngr_event_create_io_event(ev, b[1], NGR_EVENT_WRITABLE, limit_write,
+                              &lim);
+    check(ngr_event_set_limit(ev, a[1], NGR_EVENT_WRITABLE, &lim) == 0);
+    check(ngr_event_set_limit(ev, b[1], NGR_EVENT_WRITABLE, &lim) == 0);
+
+    /* 100 bytes of burst and 200 of rate, shared by both fds */
+    run_for(ev, 100);
+    check(limit_writes >= 2 && limit_writes <= 8);
+    check(lim.throttled > 0);
+    check(ngr_event_limit_avail(&lim) < 100);
+
+    /* removing the limit resumes the paused fds */
+    ngr_event_set_limit(ev, a[1], NGR_EVENT_WRITABLE, NULL);
+    ngr_event_set_limit(ev, b[1], NGR_EVENT_WRITABLE, NULL);
+    limit_writes = 0;
+    run_for(ev, 20);
+    check(limit_writes > 100);
+
+    ngr_event_close_fd(ev, a[1]);
+    ngr_event_close_fd(ev, b[1]);
+    ngr_event_limit_free(ev, &lim);
+    close(a[0]);
+    close(b[0]);
+    ngr_event_destroy(ev);
+}
+
+
+/* the library's timers outlive a drain, their handles stay valid */
+static void test_drain_timers()
+{
+    ngr_event_t *ev = ngr_event_new(0);
+    ngr_event_periodic_t *p;
+    ngr_event_limit_t lim;
+    int sv[2];
+
+    periodic_runs = 0;
+    p = ngr_event_add_periodic(ev, 5, NGR_EVENT_PERIODIC_SKIP,
+                               periodic_count, NULL, NULL);
+    check(p != NULL);
+
+    /* a bucket in debt holds a resume timer */
+    ngr_event_limit_init(&lim, 1000, 10);
+    make_pair(sv);
+    ngr_event_create_io_event(ev, sv[1], NGR_EVENT_WRITABLE, limit_write,
+                              &lim);
+    ngr_event_set_limit(ev, sv[1], NGR_EVENT_WRITABLE, &lim);
+    ngr_event_process_events(ev, 1);
+    ngr_event_process_events(ev, 1);
+    check(lim.timer != NULL);
+    ngr_event_close_fd(ev, sv[1]);
+
+    ngr_event_drain(ev, 0);
+    ngr_event_loop(ev);
+    check(ev->draining == 0);
+
+    /* run again, the periodic still ticks */
+    periodic_runs = 0;
+    run_for(ev, 30);
+    check(periodic_runs > 0);
+
+    ngr_event_del_periodic(ev, p);
+    ngr_event_limit_free(ev, &lim);
+
+    close(sv[0]);
+    ngr_event_destroy(ev);
+}
+
+
+static int upstream_fd, upstream_err, upstream_calls;
+
+static void upstream_handler(ngr_event_t *ev, ngr_upstream_t *up, int fd,
+    int err, void *data)
+{
+    upstream_fd = fd;
+    upstream_err = err;
+    upstream_calls++;
+}
+
+
+static void test_upstream()
+{
+    ngr_event_t *ev = ngr_event_new(0);
+    struct sockaddr_in addr;
+    ngr_upstream_t *up;
+    int ls, fd, peer, i;
+
+    ls = make_listener(&addr);
+    check(ls != -1);
+
+    up = ngr_upstream_new(ev, (struct sockaddr *)&addr, sizeof(addr), 2, 1);
+    check(up != NULL);
+    ngr_upstream_set_timeouts(up, 0, 300, 0);
+
+    /* an async connect */
+    check(ngr_upstream_get(up, upstream_handler, NULL) == 0);
+    run_for(ev, 20);
+    check(upstream_calls == 1 && upstream_err == 0);
+    fd = upstream_fd;
+    check(fd != -1 && up->nconns == 1);
+
+    /* reused, handed over before ngr_upstream_get() returns */
+    ngr_upstream_put(up, fd);
+    check(up->idle.count == 1);
+    check(ngr_upstream_get(up, upstream_handler, NULL) == 0);
+    check(upstream_calls == 2 && upstream_fd == fd && up->reused == 1);
+
+    /* max_conns */
+    check(ngr_upstream_get(up, upstream_handler, NULL) == 0);
+    check(ngr_upstream_get(up, upstream_handler, NULL) == -1
+          && errno == EAGAIN);
+    run_for(ev, 20);
+    check(upstream_calls == 3 && up->nconns == 2);
+
+    /* an idle connection closed by the peer is evicted */
+    ngr_upstream_put(up, fd);
+    peer = accept(ls, NULL, NULL);
+    check(peer != -1);
+    close(peer);
+    run_for(ev, 20);
+    check(up->evicted == 1 && up->idle.count == 0 && up->nconns == 1);
+
+    /* and one left idle past its timeout */
+    ngr_upstream_put(up, upstream_fd);
+    run_for(ev, 500);
+    check(up->evicted == 2 && up->nconns == 0);
+
+    while ((peer = accept(ls, NULL, NULL)) != -1) {
+        close(peer);
+    }
+
+    ngr_upstream_destroy(up);
+
+    /* nobody listens any more, the upstream goes down */
+    close(ls);
+    up = ngr_upstream_new(ev, (struct sockaddr *)&addr, sizeof(addr), 4, 1);
+
+    /* refused at once or by the connect handler */
+    for (i = 0; i < NGR_UPSTREAM_MAX_FAILS; i++) {
+        upstream_err = 0;
+        if (ngr_upstream_get(up, upstream_handler, NULL) == 0) {
+            run_for(ev, 20);
+        } else {
+            upstream_err = errno;
+        }
+
+        check(upstream_err == ECONNREFUSED);
+    }
+
+    check(up->down == 1 && up->nconns == 0);
+    check(ngr_upstream_get(up, upstream_handler, NULL) == -1
+          && errno == ECONNREFUSED);
+
+    ngr_upstream_destroy(up);
+    ngr_event_destroy(ev);
+}
+
+
+static void *placement_thread(void *arg)
+{
+    ngr_event_t *ev;
+    cpu_set_t set;
+    int sv[2];
+
+    ev = ngr_event_new_on(0, 0);
+    check(ev != NULL);
+
+    if (ev == NULL) {
+        return NULL;
+    }
+
+    check(ev->cpu == 0 && ev->node >= -1);
+    check((uintptr_t)ev % NGR_CACHELINE_SIZE == 0);
+    check((uintptr_t)ev->events % NGR_CACHELINE_SIZE == 0);
+
+    /* the calling thread now runs on that cpu only */
+    check(sched_getaffinity(0, sizeof(set), &set) == 0);
+    check(CPU_COUNT(&set) == 1 && CPU_ISSET(0, &set));
+
+    timer_called = 0;
+    ngr_event_create_timer(ev, 5, &timer_handler, NULL, NULL);
+    run_for(ev, 50);
+    check(timer_called == 3);
+
+    ngr_event_destroy(ev);
+
+    /* tables of many pages are mapped on the node, and come zeroed */
+    ev = ngr_event_new_on(4096, 0);
+    check(ev != NULL);
+
+    if (ev == NULL) {
+        return NULL;
+    }
+
+    check(ev->events[4095].mask == NGR_EVENT_NONE);
+    check((uintptr_t)ev->events % NGR_CACHELINE_SIZE == 0);
+
+    make_pair(sv);
+    memset(hits, 0, sizeof(hits));
+    check(ngr_event_create_io_event(ev, sv[0], NGR_EVENT_READABLE,
+                                    index_read, NULL) == 0);
+    check(write(sv[1], "a", 1) == 1);
+    run_for(ev, 20);
+    check(hits[0] == 1);
+
+    ngr_event_close_fd(ev, sv[0]);
+    close(sv[1]);
+    memset(hits, 0, sizeof(hits));
+    ngr_event_destroy(ev);
+
+    return NULL;
+}
+
+
+static void test_placement()
+{
+    ngr_event_t *ev = ngr_event_new(0);
+    pthread_t tid;
+
+    check(ev->cpu == -1 && ev->node == -1);
+    ngr_event_destroy(ev);
+
+    errno = 0;
+    check(ngr_event_new_on(0, CPU_SETSIZE) == NULL && errno == EINVAL);
+
+    /* bound in a thread of its own, the other tests stay unpinned */
+    pthread_create(&tid, NULL, placement_thread, NULL);
+    pthread_join(tid, NULL);
+}
+
+
+static int reuse_old, reuse_new, reuse_fd;
+
+/* closes the other fd and takes its number for a new registration */
+static void reuse_close(ngr_event_t *ev, int fd, void *data, int mask)
+{
+    int *sv = data;
+    char buf[16];
+
+    (void)read(fd, buf, sizeof(buf));
+
+    if (sv[0] != -1) {
+        ngr_event_close_fd(ev, sv[0]);
+        close(sv[1]);
+
+        make_pair(sv);
+        reuse_fd = sv[0];
+        ngr_event_create_io_event(ev, sv[0], NGR_EVENT_READABLE,
+                                  index_write, NULL);
+        sv[0] = -1;
+    }
+}
+
+
+static void reuse_read(ngr_event_t *ev, int fd, void *data, int mask)
+{
+    char buf[16];
+
+    (void)read(fd, buf, sizeof(buf));
+
+    if (data) reuse_new++;
+    else reuse_old++;
+}
+
+
+static void test_fd_reuse()
+{
+    ngr_event_t *ev = ngr_event_new(0);
+    int a[2], b[2], c[2], old, fd;
+
+    /* closed by one handler, reused before its fired event is reached */
+    make_pair(a);
+    make_pair(b);
+    old = b[0];
+
+    ngr_event_create_io_event(ev, a[0], NGR_EVENT_READABLE, reuse_close,
+                              b);
+    ngr_event_create_io_event(ev, b[0], NGR_EVENT_READABLE, reuse_close,
+                              b);
+    (void)write(a[1], "x", 1);
+    (void)write(b[1], "x", 1);
+
+    writes = 0;
+    ngr_event_process_events(ev, 1);
+    check(reuse_fd == old);
+    check(writes == 0);
+
+    close_pair(a);
+    ngr_event_close_fd(ev, a[0]);
+    ngr_event_close_fd(ev, reuse_fd);
+    close(b[1]);
+
+    /* closed with close() while registered, the number is reused */
+    make_pair(a);
+    fd = a[0];
+    ngr_event_create_io_event(ev, a[0], NGR_EVENT_READABLE, reuse_read,
+                              NULL);
+    ngr_event_create_io_event(ev, a[0], NGR_EVENT_WRITABLE, index_write,
+                              NULL);
+    close_pair(a);
+
+    /* nothing of the old registration carries over to the new one */
+    make_pair(c);
+    check(c[0] == fd);
+    check(ngr_event_create_io_event(ev, c[0], NGR_EVENT_READABLE,
+                                    reuse_read, (void *)1) == 0);
+    check(ev->events[fd].mask == NGR_EVENT_READABLE);
+    check(ev->busy == 1);
+    (void)write(c[1], "x", 1);
+    writes = 0;
+    ngr_event_process_events(ev, 1);
+    check(reuse_new == 1 && reuse_old == 0);
+    check(writes == 0);
+
+    ngr_event_close_fd(ev, c[0]);
+    close(c[1]);
+    ngr_event_destroy(ev);
+}
+
+
+#ifdef NGR_EVENT_SIM
+
+static int sim_fd, sim_mask;
+static int64_t sim_at;
+
+static void sim_handler(ngr_event_t *ev, int fd, void *data, int mask)
+{
+    sim_fd = fd;
+    sim_mask = mask;
+    sim_at = ngr_sim_now();
+}
+
+
+static void sim_drain(ngr_event_t *ev, void *data)
+{
+    ngr_event_del_io_event(ev, 100, NGR_EVENT_READABLE);
+}
+
+
+static void test_sim()
+{
+    ngr_event_t *ev = ngr_event_new(1024);
+    int64_t start = now_msec(), t0;
+
+    check(ngr_sim_inject(ev, 0, -1, NGR_EVENT_READABLE) == -1);
+    check(ngr_sim_inject(ev, 0, 1024, NGR_EVENT_READABLE) == -1);
+    check(ngr_sim_pending(ev) == 0);
+
+    /* an hour long timer fires at once, the clock jumps to it */
+    t0 = ngr_sim_now();
+    ngr_event_create_timer(ev, 3600 * 1000, wake_handler, NULL, NULL);
+    ngr_event_process_events(ev, 0);
+    check(ngr_sim_now() - t0 >= 3600 * 1000000LL);
+
+    /* injected readiness reaches the handler at its virtual time */
+    check(ngr_event_create_io_event(ev, 100, NGR_EVENT_READABLE,
+                                    sim_handler, NULL) == 0);
+    t0 = ngr_sim_now();
+    check(ngr_sim_inject(ev, t0 + 500, 100, NGR_EVENT_READABLE) == 0);
+    check(ngr_sim_inject(ev, t0 + 100, 101, NGR_EVENT_READABLE) == 0);
+    check(ngr_sim_pending(ev) == 2);
+
+    ngr_event_process_events(ev, 0);
+    ngr_event_process_events(ev, 0);
+    check(sim_fd == 100 && sim_mask == NGR_EVENT_READABLE);
+    check(sim_at == t0 + 500);
+    check(ngr_sim_pending(ev) == 0);
+
+    /* a drain request is seen through the wakeup fd */
+    ngr_event_set_drain_handler(ev, sim_drain, NULL);
+    ngr_event_drain(ev, 0);
+    ngr_event_loop(ev);
+    check(ev->busy == 0);
+
+    check(now_msec() - start < 1000);
+
+    ngr_event_destroy(ev);
+}
+
+#endif
+
+
+int main(int argc, char *argv[])
+{
+#ifdef NGR_EVENT_SIM
+    test_sim();
+#else
+    test_timer();
+    test_priority();
+    test_budget();
+    test_busy_poll();
+    test_signal();
+    test_child();
+    test_thread_pool();
+    test_listener();
+    test_listener_register();
+    test_dgram();
+    test_channel();
+    test_executor();
+    test_dispatch();
+    test_batch();
+#ifdef HAVE_EPOLL
+    test_static();
+#endif
+    test_trace();
+    test_timer_policy();
+    test_drain();
+    test_periodic_del();
+    test_periodic_rate();
+    test_ring();
+    test_stream();
+    test_limit();
+    test_drain_timers();
+    test_upstream();
+    test_placement();
+    test_fd_reuse();
+#endif
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        exit(-1);
+    }
+
+    printf("all tests passed\n");
     return 0;
 }
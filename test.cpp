@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include "ngr_event.hpp"
+
+static int failures = 0;
+
+#define check(expr)                                                      \
+    do {                                                                 \
+        if (!(expr)) {                                                   \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+            failures++;                                                  \
+        }                                                                \
+    } while (0)
+
+
+static int64_t now_msec()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
+/* run the loop for about msec milliseconds */
+static void run_for(ngr::loop &l, int64_t msec)
+{
+    int64_t end = now_msec() + msec;
+    ngr::timer wake(l, msec, [] { return uint64_t(0); });
+
+    while (now_msec() < end) {
+        l.process();
+    }
+}
+
+
+static int make_pair(int sv[2])
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        return -1;
+    }
+
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) | O_NONBLOCK);
+
+    return 0;
+}
+
+
+/* hands out the running coroutine's handle without suspending it */
+struct self {
+    std::coroutine_handle<> *h;
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> c) noexcept
+    {
+        *h = c;
+        return false;
+    }
+
+    void await_resume() const noexcept {}
+};
+
+
+static int reads, sleeps;
+
+static ngr::task reader(ngr::loop &l, int fd, std::coroutine_handle<> *h)
+{
+    char c;
+
+    co_await self{h};
+
+    while (co_await ngr::readable(l, fd) > 0) {
+        if (read(fd, &c, 1) != 1) {
+            break;
+        }
+
+        reads++;
+    }
+}
+
+
+static ngr::task sleeper(ngr::loop &l, int64_t ms, std::coroutine_handle<> *h)
+{
+    co_await self{h};
+
+    for ( ;; ) {
+        co_await ngr::sleep(l, ms);
+        sleeps++;
+    }
+}
+
+
+static void test_awaitables()
+{
+    std::coroutine_handle<> h;
+    ngr::loop l(64);
+    int sv[2];
+
+    check(make_pair(sv) == 0);
+
+    reader(l, sv[0], &h);
+    check(write(sv[1], "a", 1) == 1);
+    run_for(l, 20);
+    check(reads == 1);
+
+    /* a destroyed coroutine drops its registration */
+    h.destroy();
+    check(write(sv[1], "b", 1) == 1);
+    run_for(l, 20);
+    check(reads == 1);
+
+    sleeper(l, 5, &h);
+    run_for(l, 30);
+    check(sleeps > 0);
+
+    /* and its pending timer */
+    h.destroy();
+    sleeps = 0;
+    run_for(l, 30);
+    check(sleeps == 0);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+
+static int duplex_read, duplex_write, duplex_refused;
+
+static ngr::task duplex_reader(ngr::loop &l, int fd)
+{
+    duplex_read = co_await ngr::readable(l, fd);
+}
+
+
+static ngr::task duplex_writer(ngr::loop &l, int fd)
+{
+    duplex_write = co_await ngr::writable(l, fd);
+}
+
+
+static ngr::task second_reader(ngr::loop &l, int fd)
+{
+    duplex_refused = co_await ngr::readable(l, fd);
+}
+
+
+static void test_duplex()
+{
+    ngr::loop l(64);
+    int sv[2];
+
+    check(make_pair(sv) == 0);
+
+    /* a reader and a writer on one fd, each resumed for its direction */
+    duplex_reader(l, sv[0]);
+    second_reader(l, sv[0]);
+    check(duplex_refused == -1);
+
+    duplex_writer(l, sv[0]);
+    l.process(true);
+    check(duplex_write == NGR_EVENT_WRITABLE);
+    check(duplex_read == 0);
+
+    check(write(sv[1], "a", 1) == 1);
+    l.process(true);
+    check(duplex_read == NGR_EVENT_READABLE);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+
+int main(int argc, char *argv[])
+{
+    test_awaitables();
+    test_duplex();
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        exit(-1);
+    }
+
+    printf("all tests passed\n");
+    return 0;
+}